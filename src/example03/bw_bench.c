@@ -0,0 +1,556 @@
+#include "rdma_common.h"
+#include "topo.h"
+
+#include <time.h>
+
+// 单边 RDMA WRITE/READ 带宽测试:
+// 客户端在每个 QP 上保持 depth 个请求在途, 对端只负责建连, 不参与数据传输.
+// 每个 QP 使用独立的设备上下文, 缓冲区大小为 size * depth,
+// 第 i 个在途请求使用第 i % depth 段.
+// -N 把轮询线程, 缓冲区和 CQ 的完成向量放在网卡所在的 NUMA 节点 (local)
+// 或另一个节点 (remote) 上, 两次运行的结果对比可以看出跨节点的代价.
+// -M 打开所有 ACTIVE 的设备端口 (rail), 每条 rail 与对端同序号的 rail 建一个 QP,
+// 两端共用一个在每个设备上各注册一次的缓冲区. 不小于 RAIL_STRIPE_MIN 的请求
+// 切成每条 rail 一段, 所有段完成才算完成; 更小的请求整个交给在途最少的 rail.
+
+#define MAX_QPS          64
+#define DEFAULT_SIZE     65536
+#define DEFAULT_DEPTH    16
+#define DEFAULT_ITERS    10000
+#define POLL_BATCH       16
+#define MAX_RAILS        8
+#define RAIL_STRIPE_MIN  16384
+#define RAIL_CHUNK_ALIGN 4096
+
+enum output_format { FMT_TEXT, FMT_CSV, FMT_JSON };
+enum placement { PLACE_ANY, PLACE_LOCAL, PLACE_REMOTE };
+
+static const char *place_names[] = { "any", "local", "remote" };
+
+// 客户端通过 TCP 发给服务端的测试参数, 网络字节序
+struct bw_params {
+    uint32_t nqp;
+    uint32_t size;
+    uint32_t depth;
+    uint32_t rails;          // 客户端的 rail 数, 0 表示不用多 rail
+} __attribute__((packed));
+
+struct bench_opts {
+    const char *server_ip;   // 为空时作为服务端运行
+    const char *dev_name;
+    int ib_port;
+    int gid_index;
+    int nqp;
+    int size;
+    int depth;
+    int iters;               // 每个 QP 的请求数
+    int do_write;
+    int do_read;
+    enum output_format fmt;
+    enum placement place;
+    int numa_node;           // 由 place_thread() 选出, -1 表示不限制
+    int cpu;                 // 轮询线程绑定的 CPU
+    int multirail;           // 为真时 nqp 是两端协商出的 rail 数
+};
+
+struct qp_run {
+    int posted;
+    int completed;
+    uint64_t end_ns;
+};
+
+struct qp_result {
+    long ops;
+    double secs;
+    double ops_per_sec;
+    double gbytes_per_sec;
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] [server-ip]\n"
+            "  不带 server-ip 时作为服务端运行, 其余参数由客户端决定\n"
+            "  -d dev      RDMA 设备名, 例如 rxe0 (默认第一个设备)\n"
+            "  -p port     设备端口 (默认 1)\n"
+            "  -g index    GID 序号 (默认 0)\n"
+            "  -q qps      QP 数量 (默认 1, 最多 %d)\n"
+            "  -D depth    每个 QP 在途请求数 (默认 %d)\n"
+            "  -s size     每个请求的字节数 (默认 %d)\n"
+            "  -n iters    每个 QP 的请求数 (默认 %d)\n"
+            "  -t op       write, read 或 both (默认 both)\n"
+            "  -f format   输出格式 text, csv 或 json (默认 text)\n"
+            "  -N place    local 或 remote: 线程, 缓冲区和 CQ 放在网卡所在的\n"
+            "              NUMA 节点或另一个节点上 (默认不绑定)\n"
+            "  -M          多 rail: 使用所有 ACTIVE 端口, 每个端口一个 QP,\n"
+            "              不小于 %d 字节的请求切分到各个 rail 上 (不能与 -d, -q 同用)\n",
+            prog, MAX_QPS, DEFAULT_DEPTH, DEFAULT_SIZE, DEFAULT_ITERS,
+            RAIL_STRIPE_MIN);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sync_peer(int sock_fd) {
+    char c = 0;
+    if (write(sock_fd, &c, 1) != 1 || read(sock_fd, &c, 1) != 1) {
+        die("sync with peer failed");
+    }
+}
+
+// 按 -N 选出节点和 CPU 并把当前线程绑定上去, 之后建立的缓冲区和 CQ 都跟着走
+static void place_thread(struct bench_opts *o) {
+    o->numa_node = -1;
+    if (o->place == PLACE_ANY) return;
+
+    struct dev_topo t;
+    if (topo_query(o->dev_name, o->ib_port, &t)) die("Failed to query device topology");
+    int node = t.numa_node;
+    int *cpus = t.cpus, ncpus = t.ncpus;
+    int remote_cpus[TOPO_MAX_CPUS];
+    if (o->place == PLACE_REMOTE) {
+        if (t.numa_node < 0) die("Device NUMA node unknown, cannot place remotely");
+        node = topo_remote_node(t.numa_node);
+        if (node < 0) die("No other NUMA node");
+        ncpus = topo_node_cpus(node, remote_cpus, TOPO_MAX_CPUS);
+        if (ncpus <= 0) die("Failed to read CPUs of the remote node");
+        cpus = remote_cpus;
+    }
+    o->numa_node = node;
+    o->cpu = cpus[0];
+    if (topo_pin_cpu(o->cpu)) die("Failed to pin thread");
+    fprintf(stderr, "device numa node %d, netdev %s, %d local CPUs; "
+            "%s placement: node %d, cpu %d\n", t.numa_node,
+            t.netdev[0] ? t.netdev : "-", t.ncpus, place_names[o->place],
+            node, o->cpu);
+}
+
+// 小请求会同时在所有 rail 上各有 depth 个在途, 缓冲区按这个数量分段
+static size_t rail_buf_size(const struct bench_opts *o) {
+    return (size_t)o->size * o->depth * o->nqp;
+}
+
+// 每个 QP 一套资源, 与对端逐个交换信息并切换到 RTS.
+// 多 rail 时第 i 个 QP 开在 rails[i] 上, 缓冲区都用 buf
+static void connect_qps(const struct bench_opts *o, int sock_fd,
+                        const struct rdma_rail *rails, char *buf,
+                        struct rdma_context *res, struct qp_conn_info *remote) {
+    for (int i = 0; i < o->nqp; i++) {
+        res[i].ib_port = o->ib_port;
+        res[i].dev_name = o->dev_name;
+        res[i].gid_index = o->gid_index;
+        res[i].buf_size = (size_t)o->size * o->depth;
+        res[i].queue_depth = o->depth;
+        if (rails) {
+            res[i].dev_name = rails[i].dev_name;
+            res[i].ib_port = rails[i].ib_port;
+            res[i].buf = buf;
+            res[i].buf_shared = 1;
+            res[i].buf_size = rail_buf_size(o);
+        }
+        res[i].numa_bind = o->numa_node >= 0;
+        res[i].numa_node = o->numa_node;
+        res[i].comp_vector = o->cpu;
+        if (build_rdma_resources(&res[i])) die("Failed to build RDMA resources");
+        if (exchange_qp_info(&res[i], sock_fd, &remote[i])) {
+            die("Failed to exchange QP info");
+        }
+        if (setup_qp_state(&res[i], &remote[i])) die("Failed to set up QP state");
+    }
+}
+
+static void post_one(struct rdma_context *res, const struct qp_conn_info *remote,
+                     enum ibv_wr_opcode opcode, const struct bench_opts *o,
+                     struct qp_run *run) {
+    size_t offset = (size_t)(run->posted % o->depth) * o->size;
+    if (post_rdma(res, opcode, offset, o->size, remote, run->posted)) {
+        die("post_rdma failed");
+    }
+    run->posted++;
+}
+
+// 所有 QP 在一个线程里轮流轮询, 每个 QP 完成一个就补一个
+static void run_bw(struct rdma_context *res, const struct qp_conn_info *remote,
+                   enum ibv_wr_opcode opcode, const struct bench_opts *o,
+                   struct qp_result *results, struct qp_result *total) {
+    struct qp_run runs[MAX_QPS];
+    struct ibv_wc wcs[POLL_BATCH];
+    memset(runs, 0, sizeof(runs));
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < o->nqp; i++) {
+        while (runs[i].posted < o->iters && runs[i].posted < o->depth) {
+            post_one(&res[i], &remote[i], opcode, o, &runs[i]);
+        }
+    }
+
+    int remaining = o->nqp;
+    while (remaining > 0) {
+        for (int i = 0; i < o->nqp; i++) {
+            struct qp_run *run = &runs[i];
+            if (run->completed == o->iters) continue;
+
+            int ne = ibv_poll_cq(res[i].cq, POLL_BATCH, wcs);
+            if (ne < 0) die("ibv_poll_cq failed");
+            for (int k = 0; k < ne; k++) {
+                if (wcs[k].status != IBV_WC_SUCCESS) {
+                    fprintf(stderr, "QP %d wc error: %s\n", i,
+                            ibv_wc_status_str(wcs[k].status));
+                    exit(EXIT_FAILURE);
+                }
+            }
+            run->completed += ne;
+            while (run->posted < o->iters && run->posted - run->completed < o->depth) {
+                post_one(&res[i], &remote[i], opcode, o, run);
+            }
+            if (run->completed == o->iters) {
+                run->end_ns = now_ns();
+                remaining--;
+            }
+        }
+    }
+
+    uint64_t end = 0;
+    for (int i = 0; i < o->nqp; i++) {
+        double secs = (runs[i].end_ns - start) / 1e9;
+        results[i].ops = o->iters;
+        results[i].secs = secs;
+        results[i].ops_per_sec = o->iters / secs;
+        results[i].gbytes_per_sec = (double)o->iters * o->size / secs / 1e9;
+        if (runs[i].end_ns > end) end = runs[i].end_ns;
+    }
+    double secs = (end - start) / 1e9;
+    double ops = (double)o->iters * o->nqp;
+    total->ops = (long)ops;
+    total->secs = secs;
+    total->ops_per_sec = ops / secs;
+    total->gbytes_per_sec = ops * o->size / secs / 1e9;
+}
+
+struct rail_run {
+    int outstanding;
+    long ops;
+    uint64_t bytes;
+};
+
+// 多 rail: 一次请求占缓冲区的一段, 空闲段放在栈里. 切分的请求每条 rail
+// 一个 WR, wr_id 是段号, pending[段号] 记录还没完成的 WR 数.
+// 每条 rail 最多 depth 个在途, 完成的顺序可能和发出的顺序不同.
+static void run_rails(struct rdma_context *res, const struct qp_conn_info *remote,
+                      enum ibv_wr_opcode opcode, const struct bench_opts *o,
+                      struct qp_result *results, struct qp_result *total) {
+    int nrails = o->nqp;
+    int stripe = o->size >= RAIL_STRIPE_MIN && nrails > 1;
+    // 每段向上对齐到页, 最后一段可能更短, 太小的请求不一定用满所有 rail
+    int chunk = (o->size + nrails - 1) / nrails;
+    chunk = (chunk + RAIL_CHUNK_ALIGN - 1) / RAIL_CHUNK_ALIGN * RAIL_CHUNK_ALIGN;
+    int nchunks = stripe ? (o->size + chunk - 1) / chunk : 1;
+    int nslots = stripe ? o->depth : o->depth * nrails;
+
+    struct rail_run rails[MAX_RAILS];
+    struct ibv_wc wcs[POLL_BATCH];
+    int *free_slots = malloc(nslots * sizeof(int));
+    int *pending = calloc(nslots, sizeof(int));
+    if (!free_slots || !pending) die("malloc failed");
+    memset(rails, 0, sizeof(rails));
+    int nfree = 0;
+    for (int i = nslots - 1; i >= 0; i--) free_slots[nfree++] = i;
+
+    long posted = 0, completed = 0;
+    uint64_t start = now_ns();
+    while (completed < o->iters) {
+        while (posted < o->iters && nfree > 0) {
+            int slot = free_slots[--nfree];
+            size_t offset = (size_t)slot * o->size;
+            if (stripe) {
+                for (int k = 0; k < nchunks; k++) {
+                    int len = o->size - k * chunk < chunk ? o->size - k * chunk : chunk;
+                    if (post_rdma(&res[k], opcode, offset + (size_t)k * chunk, len,
+                                  &remote[k], slot)) {
+                        die("post_rdma failed");
+                    }
+                    rails[k].outstanding++;
+                }
+                pending[slot] = nchunks;
+            } else {
+                // 段数是 depth * nrails, 有空闲段就一定有 rail 没满
+                int best = 0;
+                for (int k = 1; k < nrails; k++) {
+                    if (rails[k].outstanding < rails[best].outstanding) best = k;
+                }
+                if (post_rdma(&res[best], opcode, offset, o->size, &remote[best], slot)) {
+                    die("post_rdma failed");
+                }
+                rails[best].outstanding++;
+                pending[slot] = 1;
+            }
+            posted++;
+        }
+
+        for (int k = 0; k < nrails; k++) {
+            if (rails[k].outstanding == 0) continue;
+            int ne = ibv_poll_cq(res[k].cq, POLL_BATCH, wcs);
+            if (ne < 0) die("ibv_poll_cq failed");
+            for (int j = 0; j < ne; j++) {
+                if (wcs[j].status != IBV_WC_SUCCESS) {
+                    fprintf(stderr, "rail %d wc error: %s\n", k,
+                            ibv_wc_status_str(wcs[j].status));
+                    exit(EXIT_FAILURE);
+                }
+                int len = o->size;
+                if (stripe) {
+                    len = o->size - k * chunk < chunk ? o->size - k * chunk : chunk;
+                }
+                rails[k].outstanding--;
+                rails[k].ops++;
+                rails[k].bytes += len;
+                int slot = (int)wcs[j].wr_id;
+                if (--pending[slot] == 0) {
+                    free_slots[nfree++] = slot;
+                    completed++;
+                }
+            }
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    for (int k = 0; k < nrails; k++) {
+        results[k].ops = rails[k].ops;
+        results[k].secs = secs;
+        results[k].ops_per_sec = rails[k].ops / secs;
+        results[k].gbytes_per_sec = rails[k].bytes / secs / 1e9;
+    }
+    total->ops = o->iters;
+    total->secs = secs;
+    total->ops_per_sec = o->iters / secs;
+    total->gbytes_per_sec = (double)o->iters * o->size / secs / 1e9;
+    free(free_slots);
+    free(pending);
+}
+
+static void print_row(const struct bench_opts *o, const char *op, int qp,
+                      const struct qp_result *r, int *first) {
+    char qp_name[16];
+    if (qp < 0)
+        snprintf(qp_name, sizeof(qp_name), "all");
+    else
+        snprintf(qp_name, sizeof(qp_name), "%d", qp);
+    long ops = r->ops;
+
+    if (o->fmt == FMT_JSON) {
+        printf("%s    {\"op\": \"%s\", \"qp\": \"%s\", \"place\": \"%s\", "
+               "\"size\": %d, \"depth\": %d, "
+               "\"ops\": %ld, \"secs\": %.6f, \"ops_per_sec\": %.0f, "
+               "\"gbytes_per_sec\": %.3f}",
+               *first ? "" : ",\n", op, qp_name, place_names[o->place], o->size,
+               o->depth, ops, r->secs, r->ops_per_sec, r->gbytes_per_sec);
+    } else if (o->fmt == FMT_CSV) {
+        printf("%s,%s,%s,%d,%d,%ld,%.6f,%.0f,%.3f\n", op, qp_name,
+               place_names[o->place], o->size, o->depth, ops, r->secs,
+               r->ops_per_sec, r->gbytes_per_sec);
+    } else {
+        printf("%-6s %4s %6s %8d %6d %10ld %10.3f %12.0f %10.3f\n", op, qp_name,
+               place_names[o->place], o->size, o->depth, ops, r->secs,
+               r->ops_per_sec, r->gbytes_per_sec);
+    }
+    *first = 0;
+}
+
+// 多 rail 时分配两端共用的缓冲区, 不用多 rail 时返回 NULL
+static char *alloc_rail_buf(const struct bench_opts *o) {
+    if (!o->multirail) return NULL;
+    char *buf = topo_alloc(rail_buf_size(o), o->numa_node);
+    if (!buf) die("buffer allocation failed");
+    return buf;
+}
+
+static void run_client(struct bench_opts *o, int sock_fd) {
+    struct rdma_rail rails[MAX_RAILS];
+    int nrails = 0;
+    if (o->multirail) {
+        nrails = find_active_ports(rails, MAX_RAILS);
+        if (nrails == 0) die("No active ports");
+    }
+
+    struct bw_params params = {
+        .nqp = htonl(o->nqp),
+        .size = htonl(o->size),
+        .depth = htonl(o->depth),
+        .rails = htonl(nrails),
+    };
+    if (write(sock_fd, &params, sizeof(params)) != sizeof(params)) {
+        die("Failed to send parameters");
+    }
+    // 服务端回复双方 rail 数中较小的一个, 两端按序号一一配对
+    if (o->multirail) {
+        uint32_t agreed;
+        if (read(sock_fd, &agreed, sizeof(agreed)) != sizeof(agreed)) {
+            die("Failed to receive rail count");
+        }
+        o->nqp = ntohl(agreed);
+        if (o->nqp <= 0 || o->nqp > nrails) die("Bad rail count from server");
+    }
+
+    struct rdma_context res[MAX_QPS];
+    struct qp_conn_info remote[MAX_QPS];
+    memset(res, 0, sizeof(res));
+    char *buf = alloc_rail_buf(o);
+    connect_qps(o, sock_fd, o->multirail ? rails : NULL, buf, res, remote);
+    sync_peer(sock_fd);
+    if (o->multirail) {
+        for (int i = 0; i < o->nqp; i++) {
+            fprintf(stderr, "rail %d: device %s port %d\n", i, rails[i].dev_name,
+                    rails[i].ib_port);
+        }
+    } else {
+        fprintf(stderr, "device %s, %d QPs connected\n",
+                ibv_get_device_name(res[0].ctx->device), o->nqp);
+    }
+
+    if (o->fmt == FMT_JSON) {
+        printf("{\n  \"results\": [\n");
+    } else if (o->fmt == FMT_CSV) {
+        printf("op,qp,place,size,depth,ops,secs,ops_per_sec,gbytes_per_sec\n");
+    } else {
+        printf("%-6s %4s %6s %8s %6s %10s %10s %12s %10s\n", "op", "qp", "place",
+               "bytes", "depth", "ops", "secs", "ops/s", "GB/s");
+    }
+
+    struct qp_result results[MAX_QPS], total;
+    int first = 1;
+    for (int pass = 0; pass < 2; pass++) {
+        if ((pass == 0 && !o->do_write) || (pass == 1 && !o->do_read)) continue;
+        enum ibv_wr_opcode opcode = pass == 0 ? IBV_WR_RDMA_WRITE : IBV_WR_RDMA_READ;
+        const char *op = pass == 0 ? "write" : "read";
+
+        if (o->multirail)
+            run_rails(res, remote, opcode, o, results, &total);
+        else
+            run_bw(res, remote, opcode, o, results, &total);
+        for (int i = 0; i < o->nqp; i++) {
+            print_row(o, op, i, &results[i], &first);
+        }
+        print_row(o, op, -1, &total, &first);
+    }
+    if (o->fmt == FMT_JSON) printf("\n  ]\n}\n");
+
+    // 通知服务端测试结束
+    sync_peer(sock_fd);
+    for (int i = 0; i < o->nqp; i++) cleanup_resources(&res[i]);
+    if (buf) topo_free(buf, rail_buf_size(o));
+}
+
+static void run_server(struct bench_opts *o, int sock_fd) {
+    struct bw_params params;
+    if (read(sock_fd, &params, sizeof(params)) != sizeof(params)) {
+        die("Failed to receive parameters");
+    }
+    o->nqp = ntohl(params.nqp);
+    o->size = ntohl(params.size);
+    o->depth = ntohl(params.depth);
+    int client_rails = ntohl(params.rails);
+    if (o->nqp <= 0 || o->nqp > MAX_QPS || o->size <= 0 || o->depth <= 0 ||
+        client_rails < 0 || client_rails > MAX_RAILS) {
+        die("Bad parameters from client");
+    }
+
+    struct rdma_rail rails[MAX_RAILS];
+    o->multirail = client_rails > 0;
+    if (o->multirail) {
+        int n = find_active_ports(rails, MAX_RAILS);
+        if (n > client_rails) n = client_rails;
+        uint32_t agreed = htonl(n);
+        if (write(sock_fd, &agreed, sizeof(agreed)) != sizeof(agreed)) {
+            die("Failed to send rail count");
+        }
+        if (n == 0) die("No active ports");
+        o->nqp = n;
+        for (int i = 0; i < n; i++) {
+            printf("rail %d: device %s port %d\n", i, rails[i].dev_name,
+                   rails[i].ib_port);
+        }
+    }
+    printf("%d QPs, %d bytes x %d per QP\n", o->nqp, o->size, o->depth);
+
+    struct rdma_context res[MAX_QPS];
+    struct qp_conn_info remote[MAX_QPS];
+    memset(res, 0, sizeof(res));
+    char *buf = alloc_rail_buf(o);
+    connect_qps(o, sock_fd, o->multirail ? rails : NULL, buf, res, remote);
+    sync_peer(sock_fd);
+
+    // 数据传输完全由客户端驱动, 这里只等待结束
+    sync_peer(sock_fd);
+    printf("client done\n");
+    for (int i = 0; i < o->nqp; i++) cleanup_resources(&res[i]);
+    if (buf) topo_free(buf, rail_buf_size(o));
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_opts o = {
+        .ib_port = 1,
+        .nqp = 1,
+        .size = DEFAULT_SIZE,
+        .depth = DEFAULT_DEPTH,
+        .iters = DEFAULT_ITERS,
+        .do_write = 1,
+        .do_read = 1,
+        .fmt = FMT_TEXT,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:p:g:q:D:s:n:t:f:N:M")) != -1) {
+        switch (opt) {
+        case 'd': o.dev_name = optarg; break;
+        case 'p': o.ib_port = atoi(optarg); break;
+        case 'g': o.gid_index = atoi(optarg); break;
+        case 'q': o.nqp = atoi(optarg); break;
+        case 'D': o.depth = atoi(optarg); break;
+        case 's': o.size = atoi(optarg); break;
+        case 'n': o.iters = atoi(optarg); break;
+        case 't':
+            if (strcmp(optarg, "write") && strcmp(optarg, "read") &&
+                strcmp(optarg, "both")) {
+                usage(argv[0]);
+            }
+            o.do_write = strcmp(optarg, "read") != 0;
+            o.do_read = strcmp(optarg, "write") != 0;
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) o.fmt = FMT_CSV;
+            else if (strcmp(optarg, "json") == 0) o.fmt = FMT_JSON;
+            else if (strcmp(optarg, "text") == 0) o.fmt = FMT_TEXT;
+            else usage(argv[0]);
+            break;
+        case 'N':
+            if (strcmp(optarg, "local") == 0) o.place = PLACE_LOCAL;
+            else if (strcmp(optarg, "remote") == 0) o.place = PLACE_REMOTE;
+            else usage(argv[0]);
+            break;
+        case 'M': o.multirail = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind < argc) o.server_ip = argv[optind];
+    if (o.nqp <= 0 || o.nqp > MAX_QPS || o.depth <= 0 || o.size <= 0 || o.iters <= 0) {
+        usage(argv[0]);
+    }
+    // 多 rail 由客户端发起, rail 和 QP 数都由可用端口决定
+    if (o.multirail && (!o.server_ip || o.dev_name || o.nqp != 1)) usage(argv[0]);
+
+    // 服务端的缓冲区是 RDMA 读写的目标, 同样按 -N 放置
+    place_thread(&o);
+
+    int sock_fd = o.server_ip ? tcp_connect(o.server_ip, TCP_PORT)
+                              : tcp_listen_accept(TCP_PORT);
+    if (o.server_ip)
+        run_client(&o, sock_fd);
+    else
+        run_server(&o, sock_fd);
+
+    close(sock_fd);
+    return 0;
+}
@@ -44,11 +44,15 @@ int main(int argc, char *argv[]) {
 
     remote_info.qp_num = ntohl(remote_info.qp_num);
     remote_info.lid = ntohs(remote_info.lid);
+    remote_info.addr = ntohll(remote_info.addr);
+    remote_info.rkey = ntohl(remote_info.rkey);
     printf("Remote QP info: QPN=0x%x, LID=0x%x\n", remote_info.qp_num, remote_info.lid);
 
     local_info.qp_num = htonl(res.qp->qp_num);
     local_info.lid = htons(res.port_attr.lid);
     memcpy(local_info.gid, &res.gid, 16);
+    local_info.addr = htonll((uintptr_t)res.buf);
+    local_info.rkey = htonl(res.mr->rkey);
     printf("Local QP info: QPN=0x%x, LID=0x%x\n", res.qp->qp_num, res.port_attr.lid);
 
     if (write(sock_fd, &local_info, sizeof(local_info)) != sizeof(local_info)) {
@@ -85,9 +89,9 @@ int main(int argc, char *argv[]) {
         int completions = 0;
         while (completions < 2) {
             struct ibv_wc wc[2];
-            int n = ibv_poll_cq(res.cq, 2, wc);
+            int n = wait_completion(&res, 2 - completions, wc);
             if (n < 0) {
-                die("poll_cq failed");
+                die("wait_completion failed");
             }
             for (int i = 0; i < n; i++) {
                 if (wc[i].status != IBV_WC_SUCCESS) {
@@ -0,0 +1,51 @@
+#include "histogram.h"
+
+#include <string.h>
+
+static int bucket_index(uint64_t v) {
+    if (v < HIST_SUB_COUNT) return (int)v;
+    // m 使 v >> m 落在 [64, 128)
+    int m = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+    return m * HIST_HALF_COUNT + (int)(v >> m);
+}
+
+// 桶内的最大值
+static uint64_t bucket_high(int idx) {
+    if (idx < HIST_SUB_COUNT) return (uint64_t)idx;
+    int m = idx / HIST_HALF_COUNT - 1;
+    uint64_t sub = (uint64_t)(idx - m * HIST_HALF_COUNT);
+    return ((sub + 1) << m) - 1;
+}
+
+void hist_reset(struct histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(struct histogram *h, uint64_t value) {
+    h->counts[bucket_index(value)]++;
+    h->total++;
+    h->sum += (double)value;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+uint64_t hist_percentile(const struct histogram *h, double p) {
+    if (h->total == 0) return 0;
+    uint64_t target = (uint64_t)(p / 100.0 * (double)h->total + 0.5);
+    if (target == 0) target = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t v = bucket_high(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+double hist_mean(const struct histogram *h) {
+    return h->total ? h->sum / (double)h->total : 0.0;
+}
@@ -0,0 +1,28 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// HDR 风格的对数-线性直方图:
+// 0..127 每个值一个桶, 之后每个 2 的幂区间分成 64 个桶,
+// 相对误差不超过 1/64, 记录一次只是一次 clz 和一次自增.
+#define HIST_SUB_BITS   7
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) * HIST_HALF_COUNT + HIST_HALF_COUNT)
+
+struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double   sum;
+};
+
+void hist_reset(struct histogram *h);
+void hist_record(struct histogram *h, uint64_t value);
+// p 取 0..100, 返回不小于该分位的最小桶上界
+uint64_t hist_percentile(const struct histogram *h, double p);
+double hist_mean(const struct histogram *h);
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,270 @@
+#include "rdma_common.h"
+#include "histogram.h"
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+// SEND/RECV 乒乓延迟测试:
+// 客户端发送 size 字节, 服务端收到后原样回显, 客户端记录往返时间的一半.
+// 消息大小从 min 到 max 按 2 倍递增, 每个大小输出一行统计.
+
+#define MIN_MSG_SIZE     8
+#define MAX_MSG_SIZE     (1 << 20)
+#define DEFAULT_ITERS    1000
+#define DEFAULT_WARMUP   100
+
+#define WR_ID_RECV 0
+#define WR_ID_SEND 1
+
+enum output_format { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+struct bench_opts {
+    const char *server_ip;   // 为空时作为服务端运行
+    int iters;
+    int warmup;
+    size_t min_size;
+    size_t max_size;
+    int busy_poll;           // 一直忙轮询, 不进入睡眠
+    enum output_format fmt;
+};
+
+struct size_result {
+    size_t size;
+    struct histogram hist;
+    double cpu_ns_per_msg;
+    double cycles_per_msg;
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] [server-ip]\n"
+            "  不带 server-ip 时作为服务端运行\n"
+            "  -d dev      RDMA 设备名, 例如 rxe0 (默认第一个设备)\n"
+            "  -p port     设备端口 (默认 1)\n"
+            "  -g index    GID 序号 (默认 0)\n"
+            "  -n iters    每个消息大小的测试次数 (默认 %d)\n"
+            "  -w warmup   每个消息大小的预热次数 (默认 %d)\n"
+            "  -s min      最小消息大小 (默认 %d)\n"
+            "  -S max      最大消息大小 (默认 %d)\n"
+            "  -b          一直忙轮询, 不在完成通道上睡眠\n"
+            "  -f format   输出格式 text, csv 或 json (默认 text)\n",
+            prog, DEFAULT_ITERS, DEFAULT_WARMUP, MIN_MSG_SIZE, MAX_MSG_SIZE);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t clock_ns(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t read_cycles(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// 等待 n 个完成, 检查状态, 返回最后一个接收完成的长度
+static uint32_t wait_n(struct rdma_context *res, int n, int busy_poll) {
+    struct ibv_wc wc[2];
+    uint32_t recv_len = 0;
+    while (n > 0) {
+        int ne = busy_poll ? ibv_poll_cq(res->cq, n, wc)
+                           : wait_completion(res, n, wc);
+        if (ne < 0) die("poll cq failed");
+        for (int i = 0; i < ne; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "wc error: %s\n", ibv_wc_status_str(wc[i].status));
+                exit(EXIT_FAILURE);
+            }
+            if (wc[i].wr_id == WR_ID_RECV) recv_len = wc[i].byte_len;
+        }
+        n -= ne;
+    }
+    return recv_len;
+}
+
+static void sync_peer(int sock_fd) {
+    char c = 0;
+    if (write(sock_fd, &c, 1) != 1 || read(sock_fd, &c, 1) != 1) {
+        die("sync with peer failed");
+    }
+}
+
+// 服务端: 回显每条消息, 收到 0 字节消息时结束
+static void run_server(struct rdma_context *res, int sock_fd, int busy_poll) {
+    if (post_receive(res)) die("post_receive failed");
+    sync_peer(sock_fd);
+
+    for (;;) {
+        uint32_t len = wait_n(res, 1, busy_poll);
+        if (len == 0) break;
+        // 回显之前先为下一条消息投递接收
+        if (post_receive(res)) die("post_receive failed");
+        if (post_send(res, len)) die("post_send failed");
+        wait_n(res, 1, busy_poll);
+    }
+}
+
+static void measure_size(struct rdma_context *res, const struct bench_opts *o,
+                         struct size_result *r) {
+    uint64_t wall0 = 0, cpu0 = 0, cycles0 = 0;
+    hist_reset(&r->hist);
+    memset(res->buf, 'a', r->size);
+
+    for (int i = 0; i < o->warmup + o->iters; i++) {
+        if (i == o->warmup) {
+            // 只统计预热之后的部分
+            wall0 = clock_ns(CLOCK_MONOTONIC);
+            cpu0 = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+            cycles0 = read_cycles();
+        }
+
+        if (post_receive(res)) die("post_receive failed");
+        uint64_t start = clock_ns(CLOCK_MONOTONIC);
+        if (post_send(res, r->size)) die("post_send failed");
+        wait_n(res, 2, o->busy_poll);
+        uint64_t rtt = clock_ns(CLOCK_MONOTONIC) - start;
+
+        if (i >= o->warmup) hist_record(&r->hist, rtt / 2);
+    }
+
+    double wall_ns = (double)(clock_ns(CLOCK_MONOTONIC) - wall0);
+    double cpu_ns = (double)(clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu0);
+    double cycles = (double)(read_cycles() - cycles0);
+    r->cpu_ns_per_msg = cpu_ns / o->iters;
+    // TSC 按墙上时间计数, 乘上进程实际占用 CPU 的比例才是消耗的周期
+    r->cycles_per_msg = wall_ns > 0 ? cycles / o->iters * (cpu_ns / wall_ns) : 0;
+}
+
+static void print_results(const struct bench_opts *o, const struct rdma_context *res,
+                          const struct size_result *rs, int n) {
+    if (o->fmt == FMT_JSON) {
+        printf("{\n  \"device\": \"%s\",\n  \"iters\": %d,\n  \"unit\": \"ns\",\n"
+               "  \"results\": [\n",
+               ibv_get_device_name(res->ctx->device), o->iters);
+    } else if (o->fmt == FMT_CSV) {
+        printf("size,iters,min_ns,p50_ns,p99_ns,p999_ns,max_ns,avg_ns,"
+               "cpu_ns_per_msg,cycles_per_msg\n");
+    } else {
+        printf("%8s %8s %10s %10s %10s %10s %10s %10s %12s\n", "bytes", "iters",
+               "min(ns)", "p50(ns)", "p99(ns)", "p99.9(ns)", "max(ns)", "avg(ns)",
+               "cycles/msg");
+    }
+
+    for (int i = 0; i < n; i++) {
+        const struct size_result *r = &rs[i];
+        const struct histogram *h = &r->hist;
+        if (o->fmt == FMT_JSON) {
+            printf("    {\"size\": %zu, \"iters\": %" PRIu64 ", \"min\": %" PRIu64
+                   ", \"p50\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64
+                   ", \"max\": %" PRIu64 ", \"avg\": %.1f, \"cpu_ns_per_msg\": %.1f"
+                   ", \"cycles_per_msg\": %.0f}%s\n",
+                   r->size, h->total, h->min, hist_percentile(h, 50),
+                   hist_percentile(h, 99), hist_percentile(h, 99.9), h->max,
+                   hist_mean(h), r->cpu_ns_per_msg, r->cycles_per_msg,
+                   i + 1 < n ? "," : "");
+        } else if (o->fmt == FMT_CSV) {
+            printf("%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                   ",%" PRIu64 ",%.1f,%.1f,%.0f\n",
+                   r->size, h->total, h->min, hist_percentile(h, 50),
+                   hist_percentile(h, 99), hist_percentile(h, 99.9), h->max,
+                   hist_mean(h), r->cpu_ns_per_msg, r->cycles_per_msg);
+        } else {
+            printf("%8zu %8" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+                   " %10" PRIu64 " %10" PRIu64 " %10.1f %12.0f\n",
+                   r->size, h->total, h->min, hist_percentile(h, 50),
+                   hist_percentile(h, 99), hist_percentile(h, 99.9), h->max,
+                   hist_mean(h), r->cycles_per_msg);
+        }
+    }
+
+    if (o->fmt == FMT_JSON) printf("  ]\n}\n");
+}
+
+static void run_client(struct rdma_context *res, int sock_fd, const struct bench_opts *o) {
+    sync_peer(sock_fd);
+
+    int n = 0;
+    for (size_t size = o->min_size; size <= o->max_size; size *= 2) n++;
+    struct size_result *rs = calloc(n, sizeof(*rs));
+    if (!rs) die("calloc failed");
+
+    int i = 0;
+    for (size_t size = o->min_size; size <= o->max_size; size *= 2, i++) {
+        rs[i].size = size;
+        measure_size(res, o, &rs[i]);
+        fprintf(stderr, "%zu bytes done\n", size);
+    }
+
+    // 0 字节的消息通知服务端结束
+    if (post_send(res, 0)) die("post_send failed");
+    wait_n(res, 1, o->busy_poll);
+
+    print_results(o, res, rs, n);
+    free(rs);
+}
+
+int main(int argc, char *argv[]) {
+    struct rdma_context res = { .ib_port = 1 };
+    struct bench_opts o = {
+        .iters = DEFAULT_ITERS,
+        .warmup = DEFAULT_WARMUP,
+        .min_size = MIN_MSG_SIZE,
+        .max_size = MAX_MSG_SIZE,
+        .fmt = FMT_TEXT,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:p:g:n:w:s:S:bf:")) != -1) {
+        switch (opt) {
+        case 'd': res.dev_name = optarg; break;
+        case 'p': res.ib_port = atoi(optarg); break;
+        case 'g': res.gid_index = atoi(optarg); break;
+        case 'n': o.iters = atoi(optarg); break;
+        case 'w': o.warmup = atoi(optarg); break;
+        case 's': o.min_size = strtoul(optarg, NULL, 0); break;
+        case 'S': o.max_size = strtoul(optarg, NULL, 0); break;
+        case 'b': o.busy_poll = 1; break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) o.fmt = FMT_CSV;
+            else if (strcmp(optarg, "json") == 0) o.fmt = FMT_JSON;
+            else if (strcmp(optarg, "text") == 0) o.fmt = FMT_TEXT;
+            else usage(argv[0]);
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind < argc) o.server_ip = argv[optind];
+    if (o.iters <= 0 || o.warmup < 0 || o.min_size == 0 || o.min_size > o.max_size) {
+        usage(argv[0]);
+    }
+
+    // 接收缓冲区要能放下最大的消息
+    res.buf_size = o.max_size;
+    if (build_rdma_resources(&res)) die("Failed to build RDMA resources");
+    fprintf(stderr, "device %s, max inline %u\n",
+            ibv_get_device_name(res.ctx->device), res.max_inline);
+
+    int sock_fd = o.server_ip ? tcp_connect(o.server_ip, TCP_PORT)
+                              : tcp_listen_accept(TCP_PORT);
+    struct qp_conn_info remote_info;
+    if (exchange_qp_info(&res, sock_fd, &remote_info)) {
+        die("Failed to exchange QP info");
+    }
+    if (setup_qp_state(&res, &remote_info)) die("Failed to set up QP state");
+
+    if (o.server_ip)
+        run_client(&res, sock_fd, &o);
+    else
+        run_server(&res, sock_fd, o.busy_poll);
+
+    close(sock_fd);
+    cleanup_resources(&res);
+    return 0;
+}
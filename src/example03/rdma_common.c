@@ -1,4 +1,7 @@
 #include "rdma_common.h"
+#include "topo.h"
+
+#include <time.h>
 
 // 这个文件包含了 server.c 和 client.c 共享的通用函数
 
@@ -11,6 +14,13 @@ int build_rdma_resources(struct rdma_context *res) {
 
     ib_dev = dev_list[0];
     if (!ib_dev) die("No IB devices found");
+    // 按名字选择设备, 例如 rxe0
+    if (res->dev_name) {
+        for (int i = 0; (ib_dev = dev_list[i]) != NULL; i++) {
+            if (strcmp(ibv_get_device_name(ib_dev), res->dev_name) == 0) break;
+        }
+        if (!ib_dev) die("IB device not found");
+    }
 
     res->ctx = ibv_open_device(ib_dev);
     if (!res->ctx) die("ibv_open_device failed");
@@ -21,48 +31,76 @@ int build_rdma_resources(struct rdma_context *res) {
         die("ibv_query_port failed");
     }
 
-    if (ibv_query_gid(res->ctx, res->ib_port, 0, &res->gid)) {
+    if (ibv_query_gid(res->ctx, res->ib_port, res->gid_index, &res->gid)) {
         die("ibv_query_gid failed");
     }
 
     res->pd = ibv_alloc_pd(res->ctx);
     if (!res->pd) die("ibv_alloc_pd failed");
 
-    res->buf = (char *)malloc(RDMA_BUFFER_SIZE);
-    if (!res->buf) die("malloc failed");
-    memset(res->buf, 0, RDMA_BUFFER_SIZE);
+    // 同一块内存可以在多个设备的 PD 上各注册一次, 多 rail 时共用一个缓冲区
+    if (!res->buf_shared) {
+        if (res->buf_size == 0) res->buf_size = RDMA_BUFFER_SIZE;
+        res->buf = topo_alloc(res->buf_size, res->numa_bind ? res->numa_node : -1);
+        if (!res->buf) die("buffer allocation failed");
+    }
 
-    res->mr = ibv_reg_mr(res->pd, res->buf, RDMA_BUFFER_SIZE,
-                         IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    res->mr = ibv_reg_mr(res->pd, res->buf, res->buf_size,
+                         IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                         IBV_ACCESS_REMOTE_READ);
     if (!res->mr) die("ibv_reg_mr failed");
 
-    res->cq = ibv_create_cq(res->ctx, 10, NULL, NULL, 0);
+    res->cc = ibv_create_comp_channel(res->ctx);
+    if (!res->cc) die("ibv_create_comp_channel failed");
+
+    if (res->queue_depth <= 0) res->queue_depth = 10;
+    // 发送和接收共用一个 CQ. 完成向量决定完成中断投递到哪个 CPU,
+    // 调用者让它和轮询线程所在的 CPU 对应
+    int vector = res->comp_vector % res->ctx->num_comp_vectors;
+    res->cq = ibv_create_cq(res->ctx, 2 * res->queue_depth, NULL, res->cc, vector);
     if (!res->cq) die("ibv_create_cq failed");
+    res->spin_ns = RDMA_SPIN_MAX_NS;
 
     struct ibv_qp_init_attr qp_init_attr = {
         .send_cq = res->cq,
         .recv_cq = res->cq,
         .qp_type = IBV_QPT_RC,
         .cap = {
-            .max_send_wr = 10,
-            .max_recv_wr = 10,
+            .max_send_wr = res->queue_depth,
+            .max_recv_wr = res->queue_depth,
             .max_send_sge = 1,
             .max_recv_sge = 1,
+            .max_inline_data = RDMA_MAX_INLINE,
         }
     };
-    res->qp = ibv_create_qp(res->pd, &qp_init_attr);
-    if (!res->qp) die("ibv_create_qp failed");
+    // verbs 没有查询内联上限的接口, 创建失败就减半重试,
+    // 成功后 cap.max_inline_data 是设备实际支持的值
+    while (!(res->qp = ibv_create_qp(res->pd, &qp_init_attr))) {
+        if (qp_init_attr.cap.max_inline_data == 0) die("ibv_create_qp failed");
+        qp_init_attr.cap.max_inline_data /= 2;
+    }
+    res->max_inline = qp_init_attr.cap.max_inline_data;
 
     return 0;
 }
 
 int setup_qp_state(struct rdma_context *res, struct qp_conn_info *remote_info) {
+    // 同时在途的 RDMA READ 数量, 受设备能力限制
+    struct ibv_device_attr dev_attr;
+    if (ibv_query_device(res->ctx, &dev_attr)) {
+        die("ibv_query_device failed");
+    }
+    int rd_atomic = RDMA_MAX_RD_ATOMIC;
+    if (rd_atomic > dev_attr.max_qp_rd_atom) rd_atomic = dev_attr.max_qp_rd_atom;
+    if (rd_atomic > dev_attr.max_qp_init_rd_atom) rd_atomic = dev_attr.max_qp_init_rd_atom;
+    if (rd_atomic < 1) rd_atomic = 1;
+
     // 1. RESET -> INIT
     struct ibv_qp_attr attr = {
         .qp_state = IBV_QPS_INIT,
         .pkey_index = 0,
         .port_num = res->ib_port,
-        .qp_access_flags = IBV_ACCESS_REMOTE_WRITE
+        .qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ
     };
     if (ibv_modify_qp(res->qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS)) {
         die("Failed to modify QP to INIT");
@@ -74,12 +112,12 @@ int setup_qp_state(struct rdma_context *res, struct qp_conn_info *remote_info) {
     attr.path_mtu = res->port_attr.active_mtu;
     attr.dest_qp_num = remote_info->qp_num;
     attr.rq_psn = 0;
-    attr.max_dest_rd_atomic = 1;
+    attr.max_dest_rd_atomic = rd_atomic;
     attr.min_rnr_timer = 12;
     attr.ah_attr.is_global = 1;
     attr.ah_attr.grh.dgid = *(union ibv_gid*)remote_info->gid;
     attr.ah_attr.grh.flow_label = 0;
-    attr.ah_attr.grh.sgid_index = 0;
+    attr.ah_attr.grh.sgid_index = res->gid_index;
     attr.ah_attr.grh.hop_limit = 1;
     attr.ah_attr.dlid = remote_info->lid;
     attr.ah_attr.sl = 0;
@@ -97,7 +135,7 @@ int setup_qp_state(struct rdma_context *res, struct qp_conn_info *remote_info) {
     attr.timeout = 14;
     attr.retry_cnt = 7;
     attr.rnr_retry = 7;
-    attr.max_rd_atomic = 1;
+    attr.max_rd_atomic = rd_atomic;
 
     if (ibv_modify_qp(res->qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_MAX_QP_RD_ATOMIC)) {
         die("Failed to modify QP to RTS");
@@ -113,7 +151,7 @@ int post_receive(struct rdma_context *res) {
 
     memset(&sge, 0, sizeof(sge));
     sge.addr = (uintptr_t)res->buf;
-    sge.length = RDMA_BUFFER_SIZE;
+    sge.length = res->buf_size;
     sge.lkey = res->mr->lkey;
 
     memset(&rr, 0, sizeof(rr));
@@ -140,15 +178,207 @@ int post_send(struct rdma_context *res, int len) {
     sr.sg_list = &sge;
     sr.num_sge = 1;
     sr.send_flags = IBV_SEND_SIGNALED;
+    // 小消息直接拷贝进 WQE, 网卡不必再通过 DMA 读取 buf
+    if ((uint32_t)len <= res->max_inline) sr.send_flags |= IBV_SEND_INLINE;
+
+    return ibv_post_send(res->qp, &sr, &bad_wr);
+}
+
+// 服务端: 在 port 上等待一个客户端, 返回连接的 fd
+int tcp_listen_accept(int port) {
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd < 0) die("socket creation failed");
+
+    int on = 1;
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        die("bind failed");
+    }
+    if (listen(sock_fd, 1) < 0) die("listen failed");
+
+    int client_fd = accept(sock_fd, NULL, NULL);
+    if (client_fd < 0) die("accept failed");
+    close(sock_fd);
+    return client_fd;
+}
+
+// 客户端: 连接 server_ip:port, 返回连接的 fd
+int tcp_connect(const char *server_ip, int port) {
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd < 0) die("socket creation failed");
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
+        die("inet_pton failed");
+    }
+    if (connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        die("connect failed");
+    }
+    return sock_fd;
+}
+
+// 双方都先写本端信息再读对端信息, 结果转换成主机字节序
+int exchange_qp_info(struct rdma_context *res, int sock_fd,
+                     struct qp_conn_info *remote_info) {
+    struct qp_conn_info local_info;
+    memset(&local_info, 0, sizeof(local_info));
+    local_info.qp_num = htonl(res->qp->qp_num);
+    local_info.lid = htons(res->port_attr.lid);
+    memcpy(local_info.gid, &res->gid, 16);
+    local_info.addr = htonll((uintptr_t)res->buf);
+    local_info.rkey = htonl(res->mr->rkey);
+
+    if (write(sock_fd, &local_info, sizeof(local_info)) != sizeof(local_info)) {
+        return -1;
+    }
+    if (read(sock_fd, remote_info, sizeof(*remote_info)) != sizeof(*remote_info)) {
+        return -1;
+    }
+    remote_info->qp_num = ntohl(remote_info->qp_num);
+    remote_info->lid = ntohs(remote_info->lid);
+    remote_info->addr = ntohll(remote_info->addr);
+    remote_info->rkey = ntohl(remote_info->rkey);
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 根据完成到达的间隔调整忙轮询窗口: 间隔短就轮询大约两个间隔,
+// 间隔比上限还长时轮询多半落空, 直接睡眠
+static void record_arrival(struct rdma_context *res) {
+    uint64_t now = now_ns();
+    if (res->last_ns) {
+        uint64_t gap = now - res->last_ns;
+        if (res->avg_gap_ns == 0)
+            res->avg_gap_ns = gap;
+        else
+            res->avg_gap_ns = res->avg_gap_ns - res->avg_gap_ns / 8 + gap / 8;
+        uint64_t spin = 2 * res->avg_gap_ns;
+        res->spin_ns = spin <= RDMA_SPIN_MAX_NS ? spin : 0;
+    }
+    res->last_ns = now;
+}
+
+// 等待至少一个完成, 最多返回 n 个, 出错返回 -1.
+// 先忙轮询一个自适应窗口, 之后 arm CQ 并在完成通道上睡眠.
+int wait_completion(struct rdma_context *res, int n, struct ibv_wc *wcs) {
+    int ne;
+    uint64_t start = now_ns();
+    for (;;) {
+        ne = ibv_poll_cq(res->cq, n, wcs);
+        if (ne != 0) {
+            if (ne > 0) res->spin_hits++;
+            goto out;
+        }
+        if (now_ns() - start >= res->spin_ns) break;
+    }
+
+    for (;;) {
+        if (ibv_req_notify_cq(res->cq, 0)) return -1;
+        // 最后一次轮询和 arm 之间到达的完成不会产生事件, 睡眠前再查一次
+        ne = ibv_poll_cq(res->cq, n, wcs);
+        if (ne != 0) {
+            if (ne > 0) res->arm_races++;
+            goto out;
+        }
+
+        struct ibv_cq *ev_cq;
+        void *ev_ctx;
+        if (ibv_get_cq_event(res->cc, &ev_cq, &ev_ctx)) return -1;
+        // ack 需要加锁, 攒够一批再 ack
+        if (++res->unacked >= 64) {
+            ibv_ack_cq_events(res->cq, res->unacked);
+            res->unacked = 0;
+        }
+        res->sleep_wakeups++;
+
+        // 事件可能属于之前 arm 之后已经取走的完成, 取不到就重新 arm
+        ne = ibv_poll_cq(res->cq, n, wcs);
+        if (ne != 0) goto out;
+    }
+
+out:
+    if (ne > 0) record_arrival(res);
+    return ne < 0 ? -1 : ne;
+}
+
+// 单边 RDMA 读写: 本端 buf + offset 与对端 addr + offset 之间传输 len 字节,
+// 对端 CPU 不参与, 也不消耗对端的接收请求
+int post_rdma(struct rdma_context *res, enum ibv_wr_opcode opcode, size_t offset,
+              int len, const struct qp_conn_info *remote_info, uint64_t wr_id) {
+    struct ibv_send_wr sr;
+    struct ibv_sge sge;
+    struct ibv_send_wr *bad_wr;
+
+    memset(&sge, 0, sizeof(sge));
+    sge.addr = (uintptr_t)(res->buf + offset);
+    sge.length = len;
+    sge.lkey = res->mr->lkey;
+
+    memset(&sr, 0, sizeof(sr));
+    sr.wr_id = wr_id;
+    sr.opcode = opcode;
+    sr.sg_list = &sge;
+    sr.num_sge = 1;
+    sr.send_flags = IBV_SEND_SIGNALED;
+    // READ 的数据从对端来, 不能内联
+    if (opcode != IBV_WR_RDMA_READ && (uint32_t)len <= res->max_inline) {
+        sr.send_flags |= IBV_SEND_INLINE;
+    }
+    sr.wr.rdma.remote_addr = remote_info->addr + offset;
+    sr.wr.rdma.rkey = remote_info->rkey;
 
     return ibv_post_send(res->qp, &sr, &bad_wr);
 }
 
 void cleanup_resources(struct rdma_context *res) {
     if (res->qp) ibv_destroy_qp(res->qp);
+    if (res->cq && res->unacked) ibv_ack_cq_events(res->cq, res->unacked);
     if (res->cq) ibv_destroy_cq(res->cq);
+    if (res->cc) ibv_destroy_comp_channel(res->cc);
     if (res->mr) ibv_dereg_mr(res->mr);
     if (res->pd) ibv_dealloc_pd(res->pd);
     if (res->ctx) ibv_close_device(res->ctx);
-    if (res->buf) free(res->buf);
+    if (res->buf && !res->buf_shared) topo_free(res->buf, res->buf_size);
+}
+
+// 按设备和端口顺序列出所有 ACTIVE 端口, 返回个数
+int find_active_ports(struct rdma_rail *rails, int max) {
+    int num_devices, n = 0;
+    struct ibv_device **dev_list = ibv_get_device_list(&num_devices);
+    if (!dev_list) die("ibv_get_device_list failed");
+
+    for (int i = 0; i < num_devices && n < max; i++) {
+        struct ibv_context *ctx = ibv_open_device(dev_list[i]);
+        if (!ctx) continue;
+        struct ibv_device_attr dev_attr;
+        if (ibv_query_device(ctx, &dev_attr) == 0) {
+            for (int port = 1; port <= dev_attr.phys_port_cnt && n < max; port++) {
+                struct ibv_port_attr port_attr;
+                if (ibv_query_port(ctx, port, &port_attr)) continue;
+                if (port_attr.state != IBV_PORT_ACTIVE) continue;
+                snprintf(rails[n].dev_name, sizeof(rails[n].dev_name), "%s",
+                         ibv_get_device_name(dev_list[i]));
+                rails[n].ib_port = port;
+                n++;
+            }
+        }
+        ibv_close_device(ctx);
+    }
+    ibv_free_device_list(dev_list);
+    return n;
 }
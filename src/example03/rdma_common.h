@@ -27,6 +27,12 @@ static inline uint64_t ntohll(uint64_t x) { return x; }
 
 #define TCP_PORT (19875)
 #define RDMA_BUFFER_SIZE (1024)
+// 创建 QP 时请求的内联数据上限, 设备不支持时会逐步减半
+#define RDMA_MAX_INLINE (256)
+// 每个 QP 同时在途的 RDMA READ 上限, 实际取值不超过设备能力
+#define RDMA_MAX_RD_ATOMIC (16)
+// 进入睡眠前最多忙轮询的时间 (纳秒)
+#define RDMA_SPIN_MAX_NS (50000)
 
 // 用于保存所有RDMA相关的上下文
 struct rdma_context {
@@ -34,11 +40,36 @@ struct rdma_context {
     struct ibv_pd           *pd;
     struct ibv_mr           *mr;
     struct ibv_cq           *cq;
+    struct ibv_comp_channel *cc;
     struct ibv_qp           *qp;
     struct ibv_port_attr    port_attr;
     union ibv_gid           gid;
     char                    *buf;
     int                     ib_port;
+    const char              *dev_name;    // 为空时使用第一个设备
+    int                     gid_index;    // RoCE (例如 rxe) 下用到的 GID 序号
+    size_t                  buf_size;     // 为 0 时使用 RDMA_BUFFER_SIZE
+    int                     buf_shared;   // 非 0 时 buf 由调用者分配, 这里只注册
+    int                     queue_depth;  // 发送/接收队列深度, 为 0 时使用 10
+    uint32_t                max_inline;   // 设备实际给出的内联数据上限
+    int                     numa_bind;    // 非 0 时缓冲区分配在 numa_node 上
+    int                     numa_node;
+    int                     comp_vector;  // CQ 的完成向量, 按设备支持的数量取模
+
+    // wait_completion() 的自适应轮询状态
+    uint64_t                spin_ns;      // 当前忙轮询窗口
+    uint64_t                avg_gap_ns;   // 完成到达间隔的移动平均
+    uint64_t                last_ns;      // 上一次拿到完成的时间
+    unsigned int            unacked;      // 还没有 ack 的 CQ 事件
+    uint64_t                spin_hits;    // 忙轮询阶段拿到完成的次数
+    uint64_t                arm_races;    // arm 之后立即轮询拿到完成的次数
+    uint64_t                sleep_wakeups; // 在完成通道上睡眠后被唤醒的次数
+};
+
+// 一条 rail: 一个处于 ACTIVE 状态的设备端口
+struct rdma_rail {
+    char dev_name[64];
+    int  ib_port;
 };
 
 // 用于通过TCP交换的QP信息
@@ -46,6 +77,8 @@ struct qp_conn_info {
     uint32_t qp_num;
     uint16_t lid;
     uint8_t  gid[16];
+    uint64_t addr;      // 对端缓冲区地址, 单边 RDMA 读写的目标
+    uint32_t rkey;      // 对端缓冲区的 rkey
 } __attribute__((packed));
 
 
@@ -60,6 +93,14 @@ int build_rdma_resources(struct rdma_context *res);
 int setup_qp_state(struct rdma_context *res, struct qp_conn_info *remote_info);
 int post_receive(struct rdma_context *res);
 int post_send(struct rdma_context *res, int len);
+int post_rdma(struct rdma_context *res, enum ibv_wr_opcode opcode, size_t offset,
+              int len, const struct qp_conn_info *remote_info, uint64_t wr_id);
+int wait_completion(struct rdma_context *res, int n, struct ibv_wc *wcs);
+int tcp_listen_accept(int port);
+int tcp_connect(const char *server_ip, int port);
+int exchange_qp_info(struct rdma_context *res, int sock_fd,
+                     struct qp_conn_info *remote_info);
 void cleanup_resources(struct rdma_context *res);
+int find_active_ports(struct rdma_rail *rails, int max);
 
 #endif // RDMA_COMMON_H
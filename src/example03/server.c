@@ -36,6 +36,8 @@ int main() {
     local_info.qp_num = htonl(res.qp->qp_num);
     local_info.lid = htons(res.port_attr.lid);
     memcpy(local_info.gid, &res.gid, 16);
+    local_info.addr = htonll((uintptr_t)res.buf);
+    local_info.rkey = htonl(res.mr->rkey);
 
     printf("Local QP info: QPN=0x%x, LID=0x%x\n", res.qp->qp_num, res.port_attr.lid);
 
@@ -49,6 +51,8 @@ int main() {
 
     remote_info.qp_num = ntohl(remote_info.qp_num);
     remote_info.lid = ntohs(remote_info.lid);
+    remote_info.addr = ntohll(remote_info.addr);
+    remote_info.rkey = ntohl(remote_info.rkey);
 
     printf("Remote QP info: QPN=0x%x, LID=0x%x\n", remote_info.qp_num, remote_info.lid);
 
@@ -72,10 +76,8 @@ int main() {
 
         struct ibv_wc wc;
         int n;
-        // 等待接收完成
-        do {
-            n = ibv_poll_cq(res.cq, 1, &wc);
-        } while (n == 0);
+        // 等待接收完成, 空闲时在完成通道上睡眠而不是一直空转
+        n = wait_completion(&res, 1, &wc);
 
         if (n < 0 || wc.status != IBV_WC_SUCCESS) {
             die("poll_cq failed on receive");
@@ -91,9 +93,7 @@ int main() {
             }
 
             // 等待发送完成
-            do {
-                n = ibv_poll_cq(res.cq, 1, &wc);
-            } while (n == 0);
+            n = wait_completion(&res, 1, &wc);
 
             if (n < 0 || wc.status != IBV_WC_SUCCESS) {
                 die("poll_cq failed on send");
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include "topo.h"
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <infiniband/verbs.h>
+
+// 不依赖 libnuma, 直接用 mbind 系统调用, 常量取自 <linux/mempolicy.h>
+#define TOPO_MPOL_BIND    2
+#define TOPO_MPOL_MF_MOVE (1 << 1)
+
+// 读取 sysfs 文件的第一行, 去掉换行
+static int read_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char *ok = fgets(buf, len, f);
+    fclose(f);
+    if (!ok) return -1;
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+// 解析 "0-3,8-11" 格式的列表, 返回个数
+static int parse_list(const char *s, int *out, int max) {
+    int n = 0;
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10);
+        if (end == s) return -1;
+        long hi = lo;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo) return -1;
+        }
+        for (long i = lo; i <= hi && n < max; i++) out[n++] = (int)i;
+        s = end;
+        if (*s == ',') s++;
+        else if (*s) return -1;
+    }
+    return n;
+}
+
+static int read_int(const char *path, int *v) {
+    char buf[32];
+    if (read_line(path, buf, sizeof(buf))) return -1;
+    *v = atoi(buf);
+    return 0;
+}
+
+// dir 是 PCI 设备在 sysfs 下的目录
+static void read_pci_node(const char *dir, struct dev_topo *t) {
+    char path[512], buf[4096];
+    snprintf(path, sizeof(path), "%s/numa_node", dir);
+    if (read_int(path, &t->numa_node)) t->numa_node = -1;
+    snprintf(path, sizeof(path), "%s/local_cpulist", dir);
+    if (read_line(path, buf, sizeof(buf)) == 0) {
+        int n = parse_list(buf, t->cpus, TOPO_MAX_CPUS);
+        if (n > 0) t->ncpus = n;
+    }
+}
+
+int topo_query(const char *dev_name, int port, struct dev_topo *t) {
+    char path[512], name[64];
+    memset(t, 0, sizeof(*t));
+    t->numa_node = -1;
+
+    if (dev_name) {
+        snprintf(name, sizeof(name), "%s", dev_name);
+    } else {
+        struct ibv_device **dev_list = ibv_get_device_list(NULL);
+        if (!dev_list || !dev_list[0]) {
+            if (dev_list) ibv_free_device_list(dev_list);
+            return -1;
+        }
+        snprintf(name, sizeof(name), "%s", ibv_get_device_name(dev_list[0]));
+        ibv_free_device_list(dev_list);
+    }
+
+    // 物理网卡: device 指向 PCI 设备, 网络接口在它的 net 目录下
+    snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device", name);
+    read_pci_node(path, t);
+    snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/net", name);
+    DIR *d = opendir(path);
+    if (d) {
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            if (e->d_name[0] == '.') continue;
+            snprintf(t->netdev, sizeof(t->netdev), "%.63s", e->d_name);
+            break;
+        }
+        closedir(d);
+    }
+
+    // rxe 这类软件设备没有 PCI 设备, 通过 GID 表找到下面的网络接口,
+    // 再看网络接口所在的节点
+    if (t->netdev[0] == '\0') {
+        snprintf(path, sizeof(path),
+                 "/sys/class/infiniband/%s/ports/%d/gid_attrs/ndevs/0", name, port);
+        read_line(path, t->netdev, sizeof(t->netdev));
+    }
+    if (t->ncpus == 0 && t->netdev[0]) {
+        snprintf(path, sizeof(path), "/sys/class/net/%s/device", t->netdev);
+        read_pci_node(path, t);
+    }
+
+    // 节点未知时所有在线 CPU 都算本地
+    if (t->ncpus == 0) {
+        char buf[4096];
+        if (read_line("/sys/devices/system/cpu/online", buf, sizeof(buf)) == 0) {
+            int n = parse_list(buf, t->cpus, TOPO_MAX_CPUS);
+            if (n > 0) t->ncpus = n;
+        }
+    }
+    return t->ncpus > 0 ? 0 : -1;
+}
+
+int topo_node_cpus(int node, int *cpus, int max) {
+    char path[128], buf[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (read_line(path, buf, sizeof(buf))) return -1;
+    return parse_list(buf, cpus, max);
+}
+
+int topo_remote_node(int node) {
+    char buf[4096];
+    int nodes[TOPO_MAX_NODES];
+    if (read_line("/sys/devices/system/node/online", buf, sizeof(buf))) return -1;
+    int n = parse_list(buf, nodes, TOPO_MAX_NODES);
+    for (int i = 0; i < n; i++) {
+        if (nodes[i] != node) return nodes[i];
+    }
+    return -1;
+}
+
+int topo_pin_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+void *topo_alloc(size_t len, int node) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    if (node >= 0 && node < TOPO_MAX_NODES) {
+        unsigned long mask[TOPO_MAX_NODES / (8 * sizeof(unsigned long))];
+        memset(mask, 0, sizeof(mask));
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        // 内核会把 maxnode 减一, 所以多传一位.
+        // 没有 NUMA 支持的内核会失败, 这时退回到首次访问时的默认分配
+        if (syscall(SYS_mbind, p, len, TOPO_MPOL_BIND, mask,
+                    8 * sizeof(mask) + 1, TOPO_MPOL_MF_MOVE)) {
+            perror("mbind");
+        }
+    }
+    // 现在就触发缺页, 让页面落在指定节点上, 注册内存时也不会再分配
+    memset(p, 0, len);
+    return p;
+}
+
+void topo_free(void *p, size_t len) {
+    munmap(p, len);
+}
@@ -0,0 +1,31 @@
+#ifndef TOPO_H
+#define TOPO_H
+
+#include <stddef.h>
+
+// 从 sysfs 读出 RDMA 设备所在的 NUMA 节点, 对应的网络接口和本地 CPU.
+// 跨节点访问内存要经过处理器间互连, 网卡 DMA 的缓冲区, 轮询 CQ 的线程
+// 和完成中断最好都放在网卡所在的节点上.
+#define TOPO_MAX_CPUS  1024
+#define TOPO_MAX_NODES 1024
+
+struct dev_topo {
+    int  numa_node;             // -1 表示未知, 例如单节点虚拟机
+    char netdev[64];            // 对应的网络接口, 只有 RoCE 设备才有
+    int  ncpus;
+    int  cpus[TOPO_MAX_CPUS];   // 与网卡在同一节点的 CPU
+};
+
+// dev_name 为空时查询第一个设备, port 用于找 RoCE 设备的网络接口
+int topo_query(const char *dev_name, int port, struct dev_topo *t);
+// 节点上的 CPU, 返回个数, 出错返回 -1
+int topo_node_cpus(int node, int *cpus, int max);
+// 除 node 之外的第一个在线节点, 没有时返回 -1
+int topo_remote_node(int node);
+// 把调用线程绑定到一个 CPU 上
+int topo_pin_cpu(int cpu);
+// 从 node 上分配并清零 len 字节, 页对齐. node < 0 时不限制节点.
+void *topo_alloc(size_t len, int node);
+void topo_free(void *p, size_t len);
+
+#endif // TOPO_H
@@ -65,7 +65,9 @@ int main() {
 
         if (wc.opcode == IBV_WC_RECV) {
             LOGF("received: %s\n", nc->recv_buff);
-            strcpy(nc->send_buff, nc->recv_buff);
+            // copy only what arrived and send back exactly that much
+            memcpy(nc->send_buff, nc->recv_buff, wc.byte_len);
+            nc->send_sge.length = wc.byte_len;
             // post recv wr after we handled the received message.
             IF_NZERO_DIE(ibv_post_recv(nc->qp, &nc->recv_wr, &bad_rwr));
 
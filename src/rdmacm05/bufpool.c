@@ -0,0 +1,97 @@
+#include "bufpool.h"
+
+#include <sys/mman.h>
+
+#include "common.h"
+
+static size_t round_up(size_t x, size_t align) {
+    return (x + align - 1) / align * align;
+}
+
+struct buf_pool *buf_pool_create(struct ibv_pd *pd, size_t slice_size,
+                                 int nslices, int flags) {
+    struct buf_pool *pool = NULL;
+    IF_NULL_DIE(pool = calloc(1, sizeof(*pool)));
+    pool->pd = pd;
+    pool->slice_size = round_up(slice_size, CACHE_LINE_SIZE);
+    pool->nslices = nslices;
+
+    size_t len = pool->slice_size * nslices;
+    void *base = MAP_FAILED;
+    if (flags & BUF_POOL_HUGETLB) {
+        pool->len = round_up(len, HUGE_PAGE_SIZE);
+        base = mmap(NULL, pool->len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                    -1, 0);
+        if (base == MAP_FAILED) {
+            LOG("no huge pages available, using normal pages");
+        } else {
+            pool->hugetlb = 1;
+        }
+    }
+    if (base == MAP_FAILED) {
+        pool->len = round_up(len, sysconf(_SC_PAGESIZE));
+        base = mmap(NULL, pool->len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (base == MAP_FAILED) die("mmap buffer pool");
+    }
+    pool->base = base;
+
+    IF_NULL_DIE(pool->mr = ibv_reg_mr(pd, pool->base, pool->len,
+                                      IBV_ACCESS_LOCAL_WRITE |
+                                          IBV_ACCESS_REMOTE_WRITE |
+                                          IBV_ACCESS_REMOTE_READ));
+
+    IF_NULL_DIE(pool->free = calloc(nslices, sizeof(*pool->free)));
+    // hand out low addresses first
+    for (int i = 0; i < nslices; i++) {
+        pool->free[i] = nslices - 1 - i;
+    }
+    pool->nfree = nslices;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    LOGF("buffer pool: %d x %zu bytes, %zu bytes mapped%s\n", nslices,
+         pool->slice_size, pool->len, pool->hugetlb ? " on huge pages" : "");
+    return pool;
+}
+
+void buf_pool_destroy(struct buf_pool *pool) {
+    ibv_dereg_mr(pool->mr);
+    munmap(pool->base, pool->len);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->free);
+    free(pool);
+}
+
+// take n slices at once, all or nothing. returns -1 when the pool is short.
+int buf_pool_get_many(struct buf_pool *pool, int n, char **bufs) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nfree < n) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        int idx = pool->free[--pool->nfree];
+        bufs[i] = pool->base + (size_t)idx * pool->slice_size;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// give back a slice from buf_pool_get_many(). returns -1 for anything that
+// is not the start of one, or when every slice is free already.
+int buf_pool_put(struct buf_pool *pool, char *buf) {
+    if (buf == NULL || buf < pool->base) return -1;
+    size_t off = buf - pool->base;
+    if (off % pool->slice_size ||
+        off / pool->slice_size >= (size_t)pool->nslices)
+        return -1;
+    int ret = -1;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nfree < pool->nslices) {
+        pool->free[pool->nfree++] = (int)(off / pool->slice_size);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
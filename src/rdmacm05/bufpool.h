@@ -0,0 +1,44 @@
+#ifndef RDMA_BUFPOOL_H
+#define RDMA_BUFPOOL_H
+
+#include <infiniband/verbs.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+// buf_pool_create() flags
+#define BUF_POOL_HUGETLB 0x1  // try MAP_HUGETLB, fall back to normal pages
+
+// one registered region per pd cut into fixed-size, cache-line-aligned
+// slices. taking a slice is a pop from a free stack, no registration.
+struct buf_pool {
+    struct ibv_pd *pd;
+    struct ibv_mr *mr;
+    char *base;
+    size_t len;         // mapped length
+    size_t slice_size;  // requested size rounded up to a cache line
+    int nslices;
+    int hugetlb;  // the region is backed by huge pages
+
+    pthread_mutex_t lock;
+    int *free;  // stack of free slice indices
+    int nfree;
+};
+
+struct buf_pool *buf_pool_create(struct ibv_pd *pd, size_t slice_size,
+                                 int nslices, int flags);
+void buf_pool_destroy(struct buf_pool *pool);
+int buf_pool_get_many(struct buf_pool *pool, int n, char **bufs);
+int buf_pool_put(struct buf_pool *pool, char *buf);
+
+static inline uint32_t buf_pool_lkey(const struct buf_pool *pool) {
+    return pool->mr->lkey;
+}
+
+static inline uint32_t buf_pool_rkey(const struct buf_pool *pool) {
+    return pool->mr->rkey;
+}
+
+#endif
@@ -1,24 +1,526 @@
+#include "coalesce.h"
 #include "common.h"
+#include "cqwait.h"
+#include "rndv.h"
+#include "ud.h"
+
+#define MAX_WINDOW 512
+#define UD_RTO_US 1000
+#define POLL_BATCH 16
+#define MAX_LARGE (1 << 30)
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-w window] [-s size] [-e every] [-i inline] "
+            "[-p spin_us] [-W] [-C] [-c deadline_us] [-L size] [-T threshold] "
+            "[-x] [-D] [-U] [-R rto_us] <server_ip> <count>\n"
+            "  -w window  keep <window> messages in flight and report "
+            "throughput\n"
+            "  -s size    message size in bytes for pipelined mode, header "
+            "included (min %zu, max %d)\n"
+            "  -e every   in pipelined mode ask for a send completion every "
+            "<every> sends\n"
+            "  -i inline  inline data to ask of the qp, 0 to disable "
+            "(default %d)\n"
+            "  -p spin_us busy-poll at most this long before sleeping on the "
+            "completion channel (default %d)\n"
+            "  -W         write messages into the server's receive ring with "
+            "RDMA WRITE with immediate\n"
+            "  -C         credit flow control, the server must use it too\n"
+            "  -c us      in pipelined mode pack messages into batches, a "
+            "message waits at most <us> for company\n"
+            "  -L size    echo <count> messages of <size> bytes, larger ones "
+            "through rendezvous (max %d)\n"
+            "  -T bytes   largest payload sent eagerly in -L mode "
+            "(default %zu)\n"
+            "  -x         poll the cq through ibv_cq_ex\n"
+            "  -D         post the sends queued before each wait as one "
+            "chain\n"
+            "  -U         send datagrams to the server's ud qp, up to one mtu "
+            "each, the server must run with -U\n"
+            "  -R rto_us  with -U send a request again when its echo is not "
+            "back after this long (default %d)\n",
+            prog, MSG_HDR_SIZE, BUFFER_SIZE, MAX_INLINE, SPIN_MAX_NS / 1000,
+            MAX_LARGE, RNDV_THRESHOLD, UD_RTO_US);
+    exit(1);
+}
+
+static double elapsed_sec(const struct timespec *start,
+                          const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void count_msg(const char *msg, uint32_t len, void *arg) {
+    *(uint64_t *)arg += len;
+}
+
+// keep up to <window> messages outstanding on the connection's send and
+// receive rings. with a coalescer every message is queued into a batch
+// instead of getting a send of its own.
+static void run_pipelined(struct connection *nc, struct cq_waiter *waiter,
+                          int count, int window, int size,
+                          struct coalescer *co) {
+    LOGF("pipelined: count=%d window=%d size=%d inline=%u coalesce=%s\n",
+         count, window, size, nc->max_inline, co ? "on" : "off");
+    // small messages are built on the stack and copied into the wqe
+    char msg[BUFFER_SIZE];
+    int inl = co == NULL && (uint32_t)size <= nc->max_inline;
+
+    int sent = 0, received = 0;
+    uint64_t tx_bytes = 0, rx_bytes = 0, completions = 0;
+    struct ibv_wc wcs[POLL_BATCH];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (received < count) {
+        // fill the window
+        char *buf = NULL;
+        while (sent < count && sent - received < window &&
+               (buf = inl || co ? msg : conn_send_buf(nc)) != NULL) {
+            memset(buf, 0, size);
+            msg_hdr_init(buf, MSG_EAGER, size);
+            snprintf(buf + MSG_HDR_SIZE, size - MSG_HDR_SIZE, "msg-%02d: hello",
+                     sent);
+            if (co) {
+                if (coalesce_add(co, msg, size)) break;  // send ring full
+            } else if (inl) {
+                int ret = conn_send_inline(nc, msg, size);
+                if (ret < 0) break;  // send ring full
+                IF_NZERO_DIE(ret);
+            } else {
+                IF_NZERO_DIE(conn_post_send(nc, size));
+            }
+            tx_bytes += size;
+            sent++;
+        }
+        if (co) {
+            // the open batch goes now when nothing more can join it: every
+            // message is queued, or it holds all of the window so no echo
+            // will come to make room. otherwise it waits for the deadline,
+            // and the wait below is cut short then. if it cannot go it is
+            // retried after the next completion.
+            uint64_t now = now_ns();
+            if (sent == count || sent - received == co->count)
+                coalesce_flush(co);
+            else
+                coalesce_poll(co, now);
+            // cq_wait() sleeps in whole milliseconds, a shorter deadline
+            // can be overshot by up to one
+            waiter->timeout_ns = 0;
+            if (co->used > 0 && now - co->first_ns < co->deadline_ns)
+                waiter->timeout_ns = co->first_ns + co->deadline_ns - now;
+        }
+        // with -D the window and the credit updates go out as one chain
+        IF_NZERO_DIE(conn_flush_send(nc));
+
+        int ne = cq_wait(waiter, POLL_BATCH, wcs);
+        if (ne < 0) {
+            die("cq_wait");
+        }
+        if (co) coalesce_poll(co, now_ns());
+        completions += ne;
+        for (int i = 0; i < ne; i++) {
+            struct ibv_wc *wc = &wcs[i];
+            if (wc->status != IBV_WC_SUCCESS) {
+                LOGF("WC error: %s wr_id=%lu\n", ibv_wc_status_str(wc->status),
+                     wc->wr_id);
+                exit(EXIT_FAILURE);
+            }
+            if (wc->opcode == IBV_WC_SEND ||
+                wc->opcode == IBV_WC_RDMA_WRITE) {
+                IF_NZERO_DIE(conn_send_done(nc, wc->wr_id));
+            } else if (wc->opcode == IBV_WC_RECV ||
+                       wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                uint32_t len;
+                int slot = conn_recv_slot(nc, wc, &len);
+                if (slot < 0) continue;  // a credit update only
+                char *rmsg = conn_recv_buf(nc, slot);
+                if (((struct msg_hdr *)rmsg)->type == MSG_COALESCED) {
+                    // count what the batch carried, not its framing
+                    int n = batch_unpack(rmsg, len, count_msg, &rx_bytes);
+                    if (n < 0) die("malformed batch");
+                    received += n;
+                } else {
+                    received++;
+                    rx_bytes += len;
+                }
+                IF_NZERO_DIE(conn_release_recv(nc, slot));
+            } else {
+                die("Unexpected opcode");
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = elapsed_sec(&start, &end);
+    LOGF("%d messages in %.3f s: %.0f msg/s, %.0f bytes/s (tx %lu, rx %lu)\n",
+         count, secs, count / secs, (tx_bytes + rx_bytes) / secs, tx_bytes,
+         rx_bytes);
+    // an echo costs one receive and, when every send is signaled, one send
+    // completion
+    LOGF("%lu completions: %.0f completions/s, %.2f per message "
+         "(signal every %d)\n",
+         completions, completions / secs, (double)completions / count,
+         nc->send_signal);
+    if (co && co->batches > 0)
+        LOGF("%lu batches, %.1f messages per batch\n", co->batches,
+             (double)co->messages / co->batches);
+}
+
+static void fill_pattern(char *buf, size_t len, int seed) {
+    for (size_t i = 0; i < len; i++) buf[i] = (char)(i * 7 + seed);
+}
+
+// echo <count> messages of <size> bytes one at a time. payloads up to the
+// threshold go eagerly through the ring, larger ones are offered with
+// rendezvous, the server pulls them and offers the echo back the same way.
+static void run_large(struct connection *nc, struct cq_waiter *waiter,
+                      int count, size_t size, size_t threshold) {
+    struct rndv_state rs;
+    rndv_init(&rs, threshold, size);
+    int eager = size <= rs.threshold;
+    LOGF("large: count=%d size=%zu %s (threshold %zu)\n", count, size,
+         eager ? "eager" : "rendezvous", rs.threshold);
+
+    char *buf;
+    struct ibv_mr *mr;
+    IF_NULL_DIE(buf = malloc(size));
+    IF_NULL_DIE(mr = ibv_reg_mr(nc->pd, buf, size,
+                                IBV_ACCESS_LOCAL_WRITE |
+                                    IBV_ACCESS_REMOTE_READ));
+
+    struct ibv_wc wcs[POLL_BATCH];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int n = 0; n < count; n++) {
+        fill_pattern(buf, size, n);
+        if (eager) {
+            char *sbuf;
+            IF_NULL_DIE(sbuf = conn_send_buf(nc));
+            msg_hdr_init(sbuf, MSG_EAGER, MSG_HDR_SIZE + size);
+            memcpy(sbuf + MSG_HDR_SIZE, buf, size);
+            IF_NZERO_DIE(conn_post_send(nc, MSG_HDR_SIZE + size));
+        } else {
+            IF_NZERO_DIE(rndv_send(nc, &rs, buf, size, mr, buf));
+        }
+
+        // the echo is back, and for rendezvous the server has our buffer
+        // back to us
+        int echoed = 0, released = eager;
+        while (!echoed || !released) {
+            IF_NZERO_DIE(conn_flush_send(nc));
+            int ne = cq_wait(waiter, POLL_BATCH, wcs);
+            if (ne < 0) die("cq_wait");
+            for (int i = 0; i < ne; i++) {
+                struct ibv_wc *wc = &wcs[i];
+                if (wc->status != IBV_WC_SUCCESS) {
+                    LOGF("WC error: %s wr_id=%lu\n",
+                         ibv_wc_status_str(wc->status), wc->wr_id);
+                    exit(EXIT_FAILURE);
+                }
+                if (wc->opcode == IBV_WC_SEND ||
+                    wc->opcode == IBV_WC_RDMA_WRITE) {
+                    IF_NZERO_DIE(conn_send_done(nc, wc->wr_id));
+                } else if (wc->opcode == IBV_WC_RDMA_READ) {
+                    IF_NZERO_DIE(conn_send_done(nc, wc->wr_id));
+                    struct rndv_in *in;
+                    IF_NULL_DIE(in = rndv_read_done(&rs, wc->wr_id));
+                    if (in->len != size || memcmp(in->buf, buf, size))
+                        die("echo mismatch");
+                    IF_NZERO_DIE(rndv_send_fin(nc, in));
+                    rndv_in_free(in);
+                    echoed = 1;
+                } else if (wc->opcode == IBV_WC_RECV ||
+                           wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                    uint32_t len;
+                    int slot = conn_recv_slot(nc, wc, &len);
+                    if (slot < 0) continue;  // a credit update only
+                    char *msg = conn_recv_buf(nc, slot);
+                    struct rndv_in *in;
+                    void *cookie;
+                    int ret;
+                    switch (((struct msg_hdr *)msg)->type) {
+                        case MSG_EAGER:
+                            if (len != MSG_HDR_SIZE + size ||
+                                memcmp(msg + MSG_HDR_SIZE, buf, size))
+                                die("echo mismatch");
+                            echoed = 1;
+                            break;
+                        case MSG_RNDV_RTS:
+                            IF_NZERO_DIE(rndv_on_rts(nc, &rs, msg, len, &in));
+                            if (in == NULL) die("Echo offer refused");
+                            break;
+                        case MSG_RNDV_FIN:
+                            ret = rndv_on_fin(&rs, msg, len, &cookie);
+                            if (ret < 0) die("Unexpected rendezvous fin");
+                            if (ret > 0) die("Server refused the offer");
+                            released = 1;
+                            break;
+                        default:
+                            die("Unexpected message type");
+                    }
+                    IF_NZERO_DIE(conn_release_recv(nc, slot));
+                } else {
+                    die("Unexpected opcode");
+                }
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = elapsed_sec(&start, &end);
+    LOGF("%d echoes of %zu bytes in %.3f s: %.0f msg/s, %.1f MB/s\n", count,
+         size, secs, count / secs, 2.0 * count * size / secs / 1e6);
+
+    rndv_destroy(&rs);
+    ibv_dereg_mr(mr);
+    free(buf);
+}
+
+// where the server's ud qp is, from the RDMA_PS_UDP handshake
+struct ud_dest {
+    struct ibv_ah *ah;
+    uint32_t qp_num;
+    uint32_t qkey;
+};
+
+// ask the server for a ud qp to send to, <id> has its route resolved
+static struct ud_ep *connect_ud(struct rdma_cm_id *id,
+                                const struct conn_config *cfg,
+                                struct ud_dest *dest) {
+    struct ud_ep *ep = ud_ep_create(id->verbs, id->port_num, cfg);
+    struct rdma_conn_param param = {0};
+    param.qp_num = ep->qp->qp_num;
+    IF_NZERO_DIE(rdma_connect(id, &param));
+
+    struct rdma_cm_event *event;
+    IF_NZERO_DIE(rdma_get_cm_event(id->channel, &event));
+    check_cm_event(event, RDMA_CM_EVENT_ESTABLISHED);
+    IF_NULL_DIE(dest->ah = ibv_create_ah(ep->pd, &event->param.ud.ah_attr));
+    dest->qp_num = event->param.ud.qp_num;
+    dest->qkey = event->param.ud.qkey;
+    rdma_ack_cm_event(event);
+    LOGF("ud: server qp %u\n", dest->qp_num);
+    return ep;
+}
+
+// request <seq>, -1 when every send slot is in flight
+static int ud_send_req(struct ud_ep *ep, const struct ud_dest *dest,
+                       uint32_t seq, int size) {
+    char *buf = ud_send_buf(ep);
+    if (buf == NULL) return -1;
+    memset(buf, 0, size);
+    msg_hdr_init(buf, MSG_DATAGRAM, size);
+    ((struct ud_hdr *)buf)->seq = htonl(seq);
+    snprintf(buf + UD_HDR_SIZE, size - UD_HDR_SIZE, "msg-%02u: hello", seq);
+    IF_NZERO_DIE(ud_post_send(ep, dest->ah, dest->qp_num, dest->qkey, size));
+    return 0;
+}
+
+struct ud_req {
+    uint64_t sent_ns;  // last time it went out
+    int done;          // its echo is back
+};
+
+// echo <count> datagrams with up to <window> unanswered. requests are
+// numbered, the window only moves past the oldest once its echo is back,
+// and a request still unanswered after <rto_ns> is sent again. an echo of
+// a request already answered is a duplicate and only counted.
+static void run_ud(struct ud_ep *ep, const struct ud_dest *dest,
+                   struct cq_waiter *waiter, int count, int window, int size,
+                   uint64_t rto_ns) {
+    LOGF("ud: count=%d window=%d size=%d mtu=%u rto=%lu us\n", count, window,
+         size, ep->mtu, rto_ns / 1000);
+    struct ud_req *reqs = NULL;
+    IF_NULL_DIE(reqs = calloc(window, sizeof(*reqs)));
+    // a wait never sleeps past the next retransmit
+    waiter->timeout_ns = rto_ns;
+
+    uint32_t base = 0, next = 0;  // oldest unanswered, next new request
+    uint64_t retransmits = 0, duplicates = 0, rx_bytes = 0;
+    struct ibv_wc wcs[POLL_BATCH];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (base < (uint32_t)count) {
+        while (next < (uint32_t)count && next - base < (uint32_t)window &&
+               ud_send_req(ep, dest, next, size) == 0) {
+            reqs[next % window].sent_ns = now_ns();
+            reqs[next % window].done = 0;
+            next++;
+        }
+        uint64_t now = now_ns();
+        for (uint32_t seq = base; seq < next; seq++) {
+            struct ud_req *r = &reqs[seq % window];
+            if (r->done || now - r->sent_ns < rto_ns) continue;
+            if (ud_send_req(ep, dest, seq, size)) break;  // send ring full
+            r->sent_ns = now;
+            retransmits++;
+        }
+
+        int ne = cq_wait(waiter, POLL_BATCH, wcs);
+        if (ne < 0) die("cq_wait");
+        for (int i = 0; i < ne; i++) {
+            struct ibv_wc *wc = &wcs[i];
+            if (wc->status != IBV_WC_SUCCESS) {
+                LOGF("WC error: %s wr_id=%lu\n", ibv_wc_status_str(wc->status),
+                     wc->wr_id);
+                exit(EXIT_FAILURE);
+            }
+            if (wc->opcode == IBV_WC_SEND) {
+                IF_NZERO_DIE(ud_send_done(ep, wc->wr_id));
+                continue;
+            }
+            uint32_t len;
+            int slot = ud_recv_slot(ep, wc, &len);
+            struct ud_hdr *h = (struct ud_hdr *)ud_recv_buf(ep, slot);
+            if (len != (uint32_t)size || h->msg.type != MSG_DATAGRAM)
+                die("echo mismatch");
+            uint32_t seq = ntohl(h->seq);
+            if (seq - base < next - base && !reqs[seq % window].done) {
+                reqs[seq % window].done = 1;
+                rx_bytes += len;
+            } else {
+                duplicates++;
+            }
+            IF_NZERO_DIE(ud_release_recv(ep, slot));
+        }
+        while (base < next && reqs[base % window].done) base++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = elapsed_sec(&start, &end);
+    LOGF("%d echoes in %.3f s: %.0f msg/s, %.0f bytes/s received\n", count,
+         secs, count / secs, rx_bytes / secs);
+    LOGF("%lu retransmits, %lu duplicate echoes\n", retransmits, duplicates);
+    free(reqs);
+}
+
+static void report_waits(const struct cq_waiter *w) {
+    LOGF("cq waits: %lu spin hits, %lu arm races, %lu sleep wakeups "
+         "(%lu empty), spin window %lu ns\n",
+         w->spin_hits, w->arm_races, w->sleep_wakeups, w->empty_wakeups,
+         w->sw.spin_ns);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <server_ip> <count>\n", argv[0]);
-        exit(1);
+    int opt, window = 0, size = 0, signal_every = 1, max_inline = 0;
+    long spin_ns = SPIN_MAX_NS;
+    int write_imm = 0, credits = 0, cq_ex = 0, send_chain = 0, ud = 0;
+    long large = 0, threshold = 0, coalesce_ns = -1;
+    long rto_ns = UD_RTO_US * 1000L;
+    while ((opt = getopt(argc, argv, "w:s:e:i:p:WCc:L:T:xDUR:")) != -1) {
+        switch (opt) {
+            case 'w':
+                window = atoi(optarg);
+                if (window <= 0 || window > MAX_WINDOW) {
+                    fprintf(stderr, "window must be in [1, %d]\n", MAX_WINDOW);
+                    exit(1);
+                }
+                break;
+            case 's':
+                // checked once the transport is known
+                size = atoi(optarg);
+                if (size <= 0) {
+                    fprintf(stderr, "size must be a positive integer\n");
+                    exit(1);
+                }
+                break;
+            case 'e':
+                signal_every = atoi(optarg);
+                if (signal_every <= 0) {
+                    fprintf(stderr, "every must be a positive integer\n");
+                    exit(1);
+                }
+                break;
+            case 'i':
+                max_inline = atoi(optarg);
+                if (max_inline <= 0) max_inline = -1;
+                break;
+            case 'p':
+                spin_ns = atol(optarg) * 1000;
+                if (spin_ns < 0) {
+                    fprintf(stderr, "spin_us must not be negative\n");
+                    exit(1);
+                }
+                break;
+            case 'W':
+                write_imm = 1;
+                break;
+            case 'C':
+                credits = 1;
+                break;
+            case 'c':
+                coalesce_ns = atol(optarg) * 1000;
+                if (coalesce_ns < 0) {
+                    fprintf(stderr, "deadline_us must not be negative\n");
+                    exit(1);
+                }
+                break;
+            case 'L':
+                large = atol(optarg);
+                if (large <= 0 || large > MAX_LARGE) {
+                    fprintf(stderr, "size must be in [1, %d]\n", MAX_LARGE);
+                    exit(1);
+                }
+                break;
+            case 'T':
+                threshold = atol(optarg);
+                if (threshold <= 0) {
+                    fprintf(stderr, "threshold must be a positive integer\n");
+                    exit(1);
+                }
+                break;
+            case 'x':
+                cq_ex = 1;
+                break;
+            case 'D':
+                send_chain = 1;
+                break;
+            case 'U':
+                ud = 1;
+                break;
+            case 'R':
+                rto_ns = atol(optarg) * 1000;
+                if (rto_ns <= 0) {
+                    fprintf(stderr, "rto_us must be a positive integer\n");
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
-    int count = atoi(argv[2]);
+    if (argc - optind != 2) {
+        usage(argv[0]);
+    }
+    const char *server_ip = argv[optind];
+    int count = atoi(argv[optind + 1]);
     if (count <= 0) {
-        fprintf(
-            stderr,
-            "count must be a positive integer, usage: %s <server_ip> <count>\n",
-            argv[0]);
+        fprintf(stderr, "count must be a positive integer\n");
+        usage(argv[0]);
+    }
+    // a datagram is bounded by the mtu, checked once the qp exists
+    size_t hdr_size = ud ? UD_HDR_SIZE : MSG_HDR_SIZE;
+    if (size == 0) {
+        size = hdr_size + sizeof("msg-00: hello");
+    } else if ((size_t)size < hdr_size || (!ud && size > BUFFER_SIZE)) {
+        fprintf(stderr, "size must be in [%zu, %d]\n", hdr_size, BUFFER_SIZE);
         exit(1);
     }
+    if (ud && (write_imm || credits || coalesce_ns >= 0 || large > 0 ||
+               cq_ex || send_chain))
+        usage(argv[0]);
+    if (ud && window == 0) window = 1;
 
     struct rdma_event_channel *ec = NULL;
     IF_NULL_DIE(ec = rdma_create_event_channel());
 
     struct rdma_cm_id *conn = NULL;
-    IF_NZERO_DIE(rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP));
+    IF_NZERO_DIE(
+        rdma_create_id(ec, &conn, NULL, ud ? RDMA_PS_UDP : RDMA_PS_TCP));
     LOG("created id");
 
     struct addrinfo *ai;
@@ -26,7 +528,7 @@ int main(int argc, char *argv[]) {
         .ai_family = AF_INET,
         .ai_socktype = SOCK_STREAM,
     };
-    IF_NZERO_DIE(getaddrinfo(argv[1], PORT, &hints, &ai));
+    IF_NZERO_DIE(getaddrinfo(server_ip, PORT, &hints, &ai));
 
     // resolve ip addr
     IF_NZERO_DIE(rdma_resolve_addr(conn, NULL, ai->ai_addr, 2000));
@@ -46,69 +548,180 @@ int main(int argc, char *argv[]) {
 
     // allocate resources
     struct connection *nc = NULL;
-    IF_NULL_DIE(nc = setup_connection(conn));
+    struct conn_config cfg = {0};
+    cfg.max_inline = max_inline;
+    cfg.write_imm = write_imm;
+    cfg.credits = credits;
+    cfg.cq_ex = cq_ex;
+    cfg.send_chain = send_chain;
+    if (write_imm && credits) usage(argv[0]);
+    if (window > 0) {
+        // twice the window so that a full re-post batch never leaves fewer
+        // than <window> receives posted
+        cfg.queue_depth = window;
+        cfg.recv_slots = 2 * window;
+        cfg.recv_batch = window;
+        cfg.signal_every = signal_every;
+    }
+    if (ud) {
+        struct ud_dest dest;
+        struct ud_ep *ep = connect_ud(conn, &cfg, &dest);
+        if ((uint32_t)size > ep->mtu) {
+            fprintf(stderr, "size must be at most the mtu, %u\n", ep->mtu);
+            exit(1);
+        }
+        struct cq_waiter waiter;
+        cq_waiter_init(&waiter, ep->cq, ep->cc, spin_ns);
+        run_ud(ep, &dest, &waiter, count, window, size, rto_ns);
+        report_waits(&waiter);
+        cq_waiter_finish(&waiter);
+
+        ibv_destroy_ah(dest.ah);
+        ud_ep_destroy(ep);
+        rdma_destroy_id(conn);
+        rdma_destroy_event_channel(ec);
+        return 0;
+    }
+    IF_NULL_DIE(nc = setup_connection(conn, &cfg));
 
     // connect server
     LOG("connect to server");
     struct rdma_conn_param conn_param = {0};
     conn_param.retry_count = 3;
-    conn_param.rnr_retry_count = 7;  // try infinity
+    // with credits a message never arrives without a receive for it, an
+    // rnr would be a bug
+    conn_param.rnr_retry_count = credits ? 0 : 7;  // 7 is infinity
+    // rendezvous pulls are rdma reads in both directions
+    conn_rd_atomic(conn, &conn_param);
+    // tell the server where to write its replies, or how many it may send
+    struct ring_info ring;
+    if (write_imm || credits) {
+        conn_ring_info(nc, &ring);
+        conn_param.private_data = &ring;
+        conn_param.private_data_len = sizeof(ring);
+    }
     IF_NZERO_DIE(rdma_connect(conn, &conn_param));
     IF_NZERO_DIE(rdma_get_cm_event(ec, &event));
     check_cm_event(event, RDMA_CM_EVENT_ESTABLISHED);
+    // the server's ring comes with the accept
+    if ((write_imm || credits) &&
+        conn_set_peer_ring(nc, event->param.conn.private_data,
+                           event->param.conn.private_data_len))
+        die("server did not advertise a receive ring, is it running with -W "
+            "or -C?");
     rdma_ack_cm_event(event);
 
     LOG("enter ESTABLISHED");
 
+    struct cq_waiter waiter;
+    cq_waiter_init(&waiter, nc->cq, nc->cc, spin_ns);
+    waiter.xcq = nc->xcq;
+
+    if (large > 0) {
+        run_large(nc, &waiter, count, large, threshold);
+        goto out;
+    }
+    if (window > 0) {
+        struct coalescer co;
+        if (coalesce_ns >= 0) {
+            if ((uint32_t)size > COALESCE_MAX_MSG) {
+                fprintf(stderr, "size must be at most %zu to coalesce\n",
+                        COALESCE_MAX_MSG);
+                exit(1);
+            }
+            coalesce_init(&co, nc, coalesce_ns);
+        }
+        run_pipelined(nc, &waiter, count, window, size,
+                      coalesce_ns >= 0 ? &co : NULL);
+        goto out;
+    }
+
     // send & recv msg
     int i, ret;
     struct ibv_wc wc;
-    struct ibv_recv_wr *bad_rwr = NULL;
-    struct ibv_send_wr *bad_swr = NULL;
 
     for (i = 0; i < count; i++) {
-        sprintf(nc->send_buff, "msg-%02d: hello", i);
-        IF_NZERO_DIE(ibv_post_send(nc->qp, &nc->send_wr, &bad_swr));
-
-        do {
-            ret = ibv_poll_cq(nc->cq, 1, &wc);
-        } while (ret == 0);
-        if (ret < 0) {
-            die("ibv_poll_cq");
+        char *send_buff;
+        // with write_imm the server may still hold the slot we would write
+        // into, wait for it to report the slot released
+        while ((send_buff = conn_send_buf(nc)) == NULL) {
+            IF_NZERO_DIE(conn_flush_send(nc));
+            ret = cq_wait(&waiter, 1, &wc);
+            if (ret < 0) die("cq_wait");
+            if (ret == 0) continue;
+            if (wc.status != IBV_WC_SUCCESS) {
+                LOGF("WC error: %s\n", ibv_wc_status_str(wc.status));
+                goto out;
+            }
+            if (wc.opcode == IBV_WC_SEND || wc.opcode == IBV_WC_RDMA_WRITE) {
+                IF_NZERO_DIE(conn_send_done(nc, wc.wr_id));
+            } else {
+                uint32_t len;
+                // every echo was taken, only updates can come in
+                if (conn_recv_slot(nc, &wc, &len) >= 0) die("unexpected msg");
+            }
         }
-        if (wc.status != IBV_WC_SUCCESS) {
-            LOGF("WC error: %s\n", ibv_wc_status_str(wc.status));
-            break;
-        }
-        if (wc.opcode == IBV_WC_SEND) {
-            LOGF("sent: %s\n", nc->send_buff);
+        // send what the message holds, not the whole slot, so it can go
+        // inline
+        char out[MSG_HDR_SIZE + 32];
+        snprintf(out + MSG_HDR_SIZE, sizeof(out) - MSG_HDR_SIZE,
+                 "msg-%02d: hello", i);
+        uint32_t out_len = MSG_HDR_SIZE + strlen(out + MSG_HDR_SIZE) + 1;
+        msg_hdr_init(out, MSG_EAGER, out_len);
+        unsigned int seq = nc->send_head;
+        if (out_len <= nc->max_inline) {
+            IF_NZERO_DIE(conn_send_inline(nc, out, out_len));
         } else {
-            die("Unexpected opcode");
-        }
-        ret = ibv_req_notify_cq(nc->cq, 0);
-        if (ret) break;
-
-        do {
-            ret = ibv_poll_cq(nc->cq, 1, &wc);
-        } while (ret == 0);
-        if (ret < 0) {
-            die("ibv_poll_cq");
+            memcpy(send_buff, out, out_len);
+            IF_NZERO_DIE(conn_post_send(nc, out_len));
         }
-        if (wc.status != IBV_WC_SUCCESS) {
-            LOGF("WC error: %s\n", ibv_wc_status_str(wc.status));
-            break;
-        }
-        if (wc.opcode == IBV_WC_RECV) {
-            LOGF("received: %s\n", nc->recv_buff);
-            // post recv wr in order to receive next message
-            IF_NZERO_DIE(ibv_post_recv(nc->qp, &nc->recv_wr, &bad_rwr));
-        } else {
-            die("Unexpected opcode");
+
+        // the send and its echo may complete in either order, and credit
+        // updates can come in between
+        int sent = 0, echoed = 0;
+        while (!sent || !echoed) {
+            IF_NZERO_DIE(conn_flush_send(nc));
+            ret = cq_wait(&waiter, 1, &wc);
+            if (ret < 0) {
+                die("cq_wait");
+            }
+            if (wc.status != IBV_WC_SUCCESS) {
+                LOGF("WC error: %s\n", ibv_wc_status_str(wc.status));
+                goto out;
+            }
+            if (wc.opcode == IBV_WC_SEND || wc.opcode == IBV_WC_RDMA_WRITE) {
+                IF_NZERO_DIE(conn_send_done(nc, wc.wr_id));
+                if ((unsigned int)wc.wr_id != seq) continue;
+                LOGF("sent: %s\n", out + MSG_HDR_SIZE);
+                sent = 1;
+            } else if (wc.opcode == IBV_WC_RECV ||
+                       wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                uint32_t len;
+                int slot = conn_recv_slot(nc, &wc, &len);
+                if (slot < 0) continue;  // a credit update only
+                char *msg = conn_recv_buf(nc, slot);
+                LOGF("received: %.*s\n", (int)(len - MSG_HDR_SIZE),
+                     msg + MSG_HDR_SIZE);
+                // hand the slot back to the receive ring
+                IF_NZERO_DIE(conn_release_recv(nc, slot));
+                echoed = 1;
+            } else {
+                die("Unexpected opcode");
+            }
         }
-        ret = ibv_req_notify_cq(nc->cq, 0);
-        if (ret) break;
         sleep(1);
     }
+out:
+    report_waits(&waiter);
+    if (nc->credit_fc)
+        LOGF("credits: %lu stalls, %lu updates sent\n", nc->credit_stalls,
+             nc->credit_updates);
+    LOGF("doorbells: %.2f sends per ibv_post_send, %.2f receives per "
+         "ibv_post_recv\n",
+         nc->send_posts ? (double)nc->send_wrs / nc->send_posts : 0,
+         nc->recv_posts ? (double)nc->recv_wrs / nc->recv_posts : 0);
+    cq_waiter_finish(&waiter);
+
     // cleanup
     rdma_disconnect(conn);
     rdma_destroy_id(conn);
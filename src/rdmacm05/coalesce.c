@@ -0,0 +1,93 @@
+#include "coalesce.h"
+
+#include "cqwait.h"
+
+void coalesce_init(struct coalescer *c, struct connection *nc,
+                   uint64_t deadline_ns) {
+    memset(c, 0, sizeof(*c));
+    c->nc = nc;
+    c->deadline_ns = deadline_ns;
+}
+
+// post the open batch, if any. returns -1 when the connection cannot take
+// a send right now, the batch stays open then.
+int coalesce_flush(struct coalescer *c) {
+    if (c->used == 0) return 0;
+
+    msg_hdr_init(c->buf, MSG_COALESCED, c->used);
+    if (c->used <= c->nc->max_inline) {
+        // copied into the wqe straight from the staging buffer
+        int ret = conn_send_inline(c->nc, c->buf, c->used);
+        if (ret) return ret;
+    } else {
+        char *buf = conn_send_buf(c->nc);
+        if (buf == NULL) return -1;
+        memcpy(buf, c->buf, c->used);
+        IF_NZERO_DIE(conn_post_send(c->nc, c->used));
+    }
+
+    c->batches++;
+    c->messages += c->count;
+    c->used = 0;
+    c->count = 0;
+    return 0;
+}
+
+// queue one message of at most COALESCE_MAX_MSG bytes. a batch that cannot
+// take it is posted first. returns -1 when that is not possible, the message
+// is not queued then and the caller should retry after a completion. the
+// message is queued even when posting the batch it filled fails.
+int coalesce_add(struct coalescer *c, const void *msg, uint32_t len) {
+    if (len > COALESCE_MAX_MSG) return -1;
+
+    if (c->used + BATCH_REC_SIZE + len > BUFFER_SIZE && coalesce_flush(c))
+        return -1;
+    if (c->used == 0) {
+        c->used = MSG_HDR_SIZE;
+        c->first_ns = now_ns();
+    }
+
+    uint16_t rec = htons(len);
+    memcpy(c->buf + c->used, &rec, BATCH_REC_SIZE);
+    memcpy(c->buf + c->used + BATCH_REC_SIZE, msg, len);
+    c->used += BATCH_REC_SIZE + len;
+    c->count++;
+
+    if (c->used + BATCH_REC_SIZE >= BUFFER_SIZE) {
+        coalesce_flush(c);
+        return 0;
+    }
+    coalesce_poll(c, now_ns());
+    return 0;
+}
+
+// post the open batch once its first message is due, -1 if that is not
+// possible right now
+int coalesce_poll(struct coalescer *c, uint64_t now) {
+    if (c->used > 0 && now - c->first_ns >= c->deadline_ns)
+        return coalesce_flush(c);
+    return 0;
+}
+
+// call fn for every message of a MSG_COALESCED message. returns how many there
+// were, or -1 when the batch is malformed.
+int batch_unpack(const char *buf, uint32_t len, batch_fn fn, void *arg) {
+    struct msg_hdr h;
+    if (len < MSG_HDR_SIZE) return -1;
+    memcpy(&h, buf, MSG_HDR_SIZE);
+    if (h.type != MSG_COALESCED || ntohl(h.len) != len) return -1;
+
+    int n = 0;
+    uint32_t off = MSG_HDR_SIZE;
+    while (off < len) {
+        uint16_t rec;
+        if (len - off < BATCH_REC_SIZE) return -1;
+        memcpy(&rec, buf + off, BATCH_REC_SIZE);
+        off += BATCH_REC_SIZE;
+        if (len - off < ntohs(rec)) return -1;
+        if (fn) fn(buf + off, ntohs(rec), arg);
+        off += ntohs(rec);
+        n++;
+    }
+    return n;
+}
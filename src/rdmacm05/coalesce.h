@@ -0,0 +1,40 @@
+#ifndef RDMA_COALESCE_H
+#define RDMA_COALESCE_H
+
+#include "common.h"
+
+// packs small messages into one send. a MSG_COALESCED message is a msg_hdr
+// followed by records, each a 16 bit length in network byte order and that
+// many bytes. the batch is staged here and posted when it fills up, when
+// its first message has waited for the deadline, or when the caller has
+// nothing more to send for now.
+
+#define BATCH_REC_SIZE sizeof(uint16_t)
+// largest message that fits a batch on its own
+#define COALESCE_MAX_MSG (BUFFER_SIZE - MSG_HDR_SIZE - BATCH_REC_SIZE)
+
+struct coalescer {
+    struct connection *nc;
+    uint64_t deadline_ns;  // longest a queued message waits for company
+    uint32_t used;         // bytes of buf filled, header included, 0 if none
+    int count;             // messages in buf
+    uint64_t first_ns;     // when the first message in buf was queued
+
+    uint64_t batches;   // sends posted
+    uint64_t messages;  // messages they carried
+
+    // staged rather than built in a send slot, which would hold the slot
+    // while sends of the connection itself, credit updates, go past it
+    char buf[BUFFER_SIZE];
+};
+
+void coalesce_init(struct coalescer *c, struct connection *nc,
+                   uint64_t deadline_ns);
+int coalesce_add(struct coalescer *c, const void *msg, uint32_t len);
+int coalesce_flush(struct coalescer *c);
+int coalesce_poll(struct coalescer *c, uint64_t now);
+
+typedef void (*batch_fn)(const char *msg, uint32_t len, void *arg);
+int batch_unpack(const char *buf, uint32_t len, batch_fn fn, void *arg);
+
+#endif
@@ -3,40 +3,13 @@
 #include <infiniband/verbs.h>
 #include <rdma/rdma_cma.h>
 
+#include "cqwait.h"
+
 void die(const char *reason) {
     perror(reason);
     exit(EXIT_FAILURE);
 }
 
-void timestr(char *buffer) {
-    char time_buf[64];
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-
-    struct tm *tm_info;
-    tm_info = localtime(&tv.tv_sec);
-
-    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", tm_info);
-    sprintf(buffer, "%s.%06ld", time_buf, tv.tv_usec);
-}
-
-void LOG(const char *msg) {
-    char buffer[64];
-    timestr(buffer);
-    fprintf(stdout, "%s %s\n", buffer, msg);
-}
-
-void LOGF(const char *format, ...) {
-    char buffer[64];
-    timestr(buffer);
-    fprintf(stdout, "%s ", buffer);
-
-    va_list args;
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
-}
-
 const char *get_event_string(enum rdma_cm_event_type type) {
     switch (type) {
         case RDMA_CM_EVENT_ESTABLISHED:
@@ -64,6 +37,12 @@ const char *wc_opcode_str(enum ibv_wc_opcode opcode) {
             return "IBV_WC_SEND";
         case IBV_WC_RECV:
             return "IBV_WC_RECV";
+        case IBV_WC_RDMA_WRITE:
+            return "IBV_WC_RDMA_WRITE";
+        case IBV_WC_RDMA_READ:
+            return "IBV_WC_RDMA_READ";
+        case IBV_WC_RECV_RDMA_WITH_IMM:
+            return "IBV_WC_RECV_RDMA_WITH_IMM";
         default:
             return "Unknown wc opcode";
     }
@@ -77,61 +56,929 @@ void check_cm_event(struct rdma_cm_event *event, enum rdma_cm_event_type exp) {
     }
 }
 
-struct connection *setup_connection(struct rdma_cm_id *cm_id) {
+static struct device *g_devices = NULL;
+// connections may be allocated off the cm thread
+static pthread_mutex_t g_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char *srq_buf(struct srq *s, int slot) {
+    return s->bufs[slot / s->chunk] + (size_t)(slot % s->chunk) * BUFFER_SIZE;
+}
+
+// post every pending srq slot with a single ibv_post_srq_recv
+int srq_flush(struct srq *s) {
+    int n = s->npending;
+    if (n == 0) return 0;
+
+    for (int i = 0; i < n; i++) {
+        struct ibv_recv_wr *wr = &s->wr[s->pending[i]];
+        wr->next = (i + 1 < n) ? &s->wr[s->pending[i + 1]] : NULL;
+    }
+    s->npending = 0;
+
+    struct ibv_recv_wr *bad_wr = NULL;
+    return ibv_post_srq_recv(s->srq, &s->wr[s->pending[0]], &bad_wr);
+}
+
+int srq_release(struct srq *s, int slot) {
+    s->pending[s->npending++] = slot;
+    if (s->npending < s->batch) return 0;
+    return srq_flush(s);
+}
+
+// register one more chunk of buffers and post it, returns -1 at max_slots
+static int srq_grow(struct srq *s) {
+    if (s->slots >= s->max_slots) return -1;
+
+    int n = s->slots / s->chunk;
+    IF_NULL_DIE(s->bufs[n] = calloc(s->chunk, BUFFER_SIZE));
+    IF_NULL_DIE(s->mrs[n] = ibv_reg_mr(s->pd, s->bufs[n],
+                                       (size_t)s->chunk * BUFFER_SIZE,
+                                       IBV_ACCESS_LOCAL_WRITE));
+    for (int i = s->slots; i < s->slots + s->chunk; i++) {
+        s->sge[i].addr = (uintptr_t)srq_buf(s, i);
+        s->sge[i].length = BUFFER_SIZE;
+        s->sge[i].lkey = s->mrs[n]->lkey;
+        s->wr[i].sg_list = &s->sge[i];
+        s->wr[i].num_sge = 1;
+        s->wr[i].wr_id = i;
+        s->pending[s->npending++] = i;
+    }
+    s->slots += s->chunk;
+    IF_NZERO_DIE(srq_flush(s));
+    return 0;
+}
+
+// ask for IBV_EVENT_SRQ_LIMIT_REACHED once fewer than <limit> are posted
+static int srq_arm(struct srq *s) {
+    struct ibv_srq_attr attr = {.srq_limit = s->limit};
+    return ibv_modify_srq(s->srq, &attr, IBV_SRQ_LIMIT);
+}
+
+// <slots> buffers are registered up front and again whenever the limit event
+// fires, up to <max_slots>
+struct srq *create_srq(struct device *dev, int slots, int max_slots,
+                       int batch) {
+    struct ibv_device_attr dev_attr;
+    IF_NZERO_DIE(ibv_query_device(dev->ctx, &dev_attr));
+    if (dev_attr.max_srq_wr <= 0) die("device does not support srq");
+
+    struct srq *s = NULL;
+    IF_NULL_DIE(s = calloc(1, sizeof(*s)));
+    s->pd = dev->pd;
+    s->chunk = slots;
+    s->max_slots = max_slots;
+    if (s->max_slots > dev_attr.max_srq_wr) s->max_slots = dev_attr.max_srq_wr;
+    if (s->chunk > s->max_slots) s->chunk = s->max_slots;
+    // whole chunks only
+    s->max_slots -= s->max_slots % s->chunk;
+    s->batch = batch;
+    s->limit = s->chunk / 4 > 0 ? s->chunk / 4 : 1;
+
+    struct ibv_srq_init_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.srq_context = s;
+    attr.attr.max_wr = s->max_slots;
+    attr.attr.max_sge = 1;
+    IF_NULL_DIE(s->srq = ibv_create_srq(dev->pd, &attr));
+
+    int nchunks = s->max_slots / s->chunk;
+    IF_NULL_DIE(s->bufs = calloc(nchunks, sizeof(*s->bufs)));
+    IF_NULL_DIE(s->mrs = calloc(nchunks, sizeof(*s->mrs)));
+    IF_NULL_DIE(s->sge = calloc(s->max_slots, sizeof(*s->sge)));
+    IF_NULL_DIE(s->wr = calloc(s->max_slots, sizeof(*s->wr)));
+    IF_NULL_DIE(s->pending = calloc(s->max_slots, sizeof(*s->pending)));
+
+    IF_NZERO_DIE(srq_grow(s));
+    IF_NZERO_DIE(srq_arm(s));
+    LOGF("srq created: %d slots, up to %d\n", s->slots, s->max_slots);
+    return s;
+}
+
+// one struct device per ibv_context, created on first use
+struct device *get_device(struct ibv_context *ctx) {
+    struct device *dev;
+    pthread_mutex_lock(&g_devices_lock);
+    for (dev = g_devices; dev; dev = dev->next) {
+        if (dev->ctx == ctx) break;
+    }
+    if (dev) {
+        pthread_mutex_unlock(&g_devices_lock);
+        return dev;
+    }
+
+    IF_NULL_DIE(dev = calloc(1, sizeof(*dev)));
+    dev->ctx = ctx;
+    IF_NULL_DIE(dev->pd = ibv_alloc_pd(ctx));
+
+    // async events are read from an epoll loop, never block on them
+    int flags = fcntl(ctx->async_fd, F_GETFL);
+    IF_NZERO_DIE(fcntl(ctx->async_fd, F_SETFL, flags | O_NONBLOCK));
+
+    dev->next = g_devices;
+    g_devices = dev;
+    pthread_mutex_unlock(&g_devices_lock);
+    return dev;
+}
+
+// IBV_EVENT_SRQ_LIMIT_REACHED disarms the limit, grow and re-arm it
+void srq_on_limit(struct srq *s) {
+    if (srq_grow(s)) {
+        LOGF("srq limit reached, already at %d slots\n", s->slots);
+        return;
+    }
+    LOGF("srq limit reached, grown to %d slots\n", s->slots);
+    if (srq_arm(s)) LOG("Failed to arm srq limit");
+}
+
+// size must be a power of two
+void qp_table_init(struct qp_table *t, uint32_t size) {
+    uint32_t bits = 0;
+    while ((1u << bits) < size) bits++;
+    IF_NULL_DIE(t->entries = calloc(1u << bits, sizeof(*t->entries)));
+    t->mask = (1u << bits) - 1;
+    t->shift = 32 - bits;
+    t->count = 0;
+}
+
+static void qp_table_put(struct qp_table *t, uint32_t qp_num,
+                         struct connection *nc) {
+    uint32_t i = qp_table_hash(t, qp_num);
+    while (t->entries[i].conn && t->entries[i].qp_num != qp_num)
+        i = (i + 1) & t->mask;
+    if (t->entries[i].conn == NULL) t->count++;
+    t->entries[i].qp_num = qp_num;
+    t->entries[i].conn = nc;
+}
+
+void qp_table_insert(struct qp_table *t, uint32_t qp_num,
+                     struct connection *nc) {
+    // keep the load factor below 1/2 so probe chains stay short
+    if ((t->count + 1) * 2 > t->mask + 1) {
+        struct qp_table old = *t;
+        qp_table_init(t, (old.mask + 1) * 2);
+        for (uint32_t i = 0; i <= old.mask; i++) {
+            if (old.entries[i].conn)
+                qp_table_put(t, old.entries[i].qp_num, old.entries[i].conn);
+        }
+        free(old.entries);
+    }
+    qp_table_put(t, qp_num, nc);
+}
+
+void qp_table_remove(struct qp_table *t, uint32_t qp_num) {
+    uint32_t i = qp_table_hash(t, qp_num);
+    while (t->entries[i].conn && t->entries[i].qp_num != qp_num)
+        i = (i + 1) & t->mask;
+    if (t->entries[i].conn == NULL) return;
+
+    // backward shift deletion, no tombstones
+    uint32_t j = i;
+    for (;;) {
+        j = (j + 1) & t->mask;
+        if (t->entries[j].conn == NULL) break;
+        uint32_t k = qp_table_hash(t, t->entries[j].qp_num);
+        // leave entries whose home slot lies cyclically in (i, j]
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        t->entries[i] = t->entries[j];
+        i = j;
+    }
+    t->entries[i].conn = NULL;
+    t->count--;
+}
+
+// <flags> are the EX_CQ_ ones, without any the cq is polled with
+// ibv_poll_cq() and *xcq stays NULL
+static struct ibv_cq *create_cq(struct ibv_context *ctx, int cqe,
+                                void *cq_context, struct ibv_comp_channel *cc,
+                                int flags, struct ex_cq **xcq) {
+    if (flags == 0) return ibv_create_cq(ctx, cqe, cq_context, cc, 0);
+    IF_NULL_DIE(*xcq = calloc(1, sizeof(**xcq)));
+    return ex_cq_create(*xcq, ctx, cqe, cq_context, cc, flags);
+}
+
+// the EX_CQ_ flags for the cqs of connections set up with <c>
+int conn_cq_flags(const struct conn_config *c) {
+    return (c->cq_ex ? EX_CQ_EXTENDED : 0) |
+           (c->trace ? EX_CQ_TIMESTAMPS : 0);
+}
+
+struct shared_cq *create_shared_cq(struct ibv_context *ctx, int cqe,
+                                   int flags) {
+    struct shared_cq *scq = NULL;
+    IF_NULL_DIE(scq = calloc(1, sizeof(*scq)));
+    scq->ctx = ctx;
+    IF_NULL_DIE(scq->cc = ibv_create_comp_channel(ctx));
+    IF_NULL_DIE(scq->cq = create_cq(ctx, cqe, scq, scq->cc, flags,
+                                    &scq->xcq));
+    scq->cqe = scq->cq->cqe;
+    IF_NZERO_DIE(ibv_req_notify_cq(scq->cq, 0));
+    qp_table_init(&scq->qpt, QP_TABLE_SIZE);
+    return scq;
+}
+
+// every connection on it must be gone and every event taken acked
+void destroy_shared_cq(struct shared_cq *scq) {
+    ibv_destroy_cq(scq->cq);
+    ibv_destroy_comp_channel(scq->cc);
+    free(scq->xcq);
+    free(scq->qpt.entries);
+    free(scq);
+}
+
+// buffers for the send and receive rings: slices of the pool, or one
+// registered allocation per ring. returns -1 when the pool is exhausted,
+// what was taken is given back by free_ring_buffers().
+static int alloc_ring_buffers(struct connection *nc) {
+    int nrecv = nc->srq ? 0 : nc->recv_slots;
+    IF_NULL_DIE(nc->send_bufs = calloc(nc->send_slots, sizeof(char *)));
+    if (nrecv) IF_NULL_DIE(nc->recv_bufs = calloc(nrecv, sizeof(char *)));
+
+    if (nc->pool) {
+        if (buf_pool_get_many(nc->pool, nc->send_slots, nc->send_bufs))
+            return -1;
+        if (nrecv && buf_pool_get_many(nc->pool, nrecv, nc->recv_bufs))
+            return -1;
+        return 0;
+    }
+
+    size_t send_len = (size_t)nc->send_slots * BUFFER_SIZE;
+    IF_NULL_DIE(nc->send_buff = calloc(nc->send_slots, BUFFER_SIZE));
+    IF_NULL_DIE(nc->send_mr = ibv_reg_mr(
+                    nc->pd, nc->send_buff, send_len,
+                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    for (int i = 0; i < nc->send_slots; i++)
+        nc->send_bufs[i] = nc->send_buff + (size_t)i * BUFFER_SIZE;
+
+    if (nrecv == 0) return 0;
+
+    size_t recv_len = (size_t)nrecv * BUFFER_SIZE;
+    IF_NULL_DIE(nc->recv_buff = calloc(nrecv, BUFFER_SIZE));
+    IF_NULL_DIE(nc->recv_mr = ibv_reg_mr(
+                    nc->pd, nc->recv_buff, recv_len,
+                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    for (int i = 0; i < nrecv; i++)
+        nc->recv_bufs[i] = nc->recv_buff + (size_t)i * BUFFER_SIZE;
+    return 0;
+}
+
+// a ring the pool could not fill is still all NULL, it has nothing to give
+// back
+static void free_ring_buffers(struct connection *nc) {
+    if (nc->pool) {
+        for (int i = 0; nc->send_bufs && i < nc->send_slots; i++)
+            if (nc->send_bufs[i]) buf_pool_put(nc->pool, nc->send_bufs[i]);
+        for (int i = 0; nc->recv_bufs && !nc->srq && i < nc->recv_slots; i++)
+            if (nc->recv_bufs[i]) buf_pool_put(nc->pool, nc->recv_bufs[i]);
+    }
+    if (nc->send_mr) ibv_dereg_mr(nc->send_mr);
+    if (nc->recv_mr) ibv_dereg_mr(nc->recv_mr);
+    free(nc->send_buff);
+    free(nc->recv_buff);
+    free(nc->send_bufs);
+    free(nc->recv_bufs);
+}
+
+// everything a connection on <ctx> needs but its qp: pd, cq, rings and
+// their registration. may run ahead of time on any thread, see connpool.h.
+struct connection *conn_alloc(struct ibv_context *ctx,
+                              const struct conn_config *cfg) {
     struct connection *nc = NULL;
+    struct conn_config c = {0};
+    if (cfg) c = *cfg;
+    if (c.queue_depth <= 0) c.queue_depth = QUEUE_DEPTH;
+    if (c.recv_slots <= 0) c.recv_slots = RECV_SLOTS;
+    if (c.recv_batch <= 0) c.recv_batch = c.recv_slots / 4;
+    if (c.recv_batch <= 0) c.recv_batch = 1;
+    if (c.recv_batch > c.recv_slots) c.recv_batch = c.recv_slots;
+    // unsignaled sends keep their slot, and a loaned receive buffer, until
+    // a later completion so the run is bounded by both rings
+    if (c.signal_every <= 0) c.signal_every = 1;
+    if (c.signal_every > c.queue_depth) c.signal_every = c.queue_depth;
+    if (!c.srq && c.signal_every > c.recv_slots / 2)
+        c.signal_every = c.recv_slots / 2 > 0 ? c.recv_slots / 2 : 1;
+    if (c.max_inline == 0) c.max_inline = MAX_INLINE;
+    if (c.max_inline < 0) c.max_inline = 0;
+    if (c.max_inline > BUFFER_SIZE) c.max_inline = BUFFER_SIZE;
+    // the peer addresses ring slots by index, pool and srq buffers are not
+    // one contiguous region
+    if (c.write_imm && (c.srq || c.pool)) {
+        LOG("write_imm needs a private receive ring");
+        return NULL;
+    }
+    // credits count the receives of one ring and travel in the immediate
+    // of a send
+    if (c.write_imm && c.recv_slots > IMM_LEN_MASK) {
+        LOG("write_imm ring is too large for the immediate");
+        return NULL;
+    }
+    if (c.credits && (c.srq || c.write_imm)) {
+        LOG("credits need a private receive ring and the send transport");
+        return NULL;
+    }
+
+    IF_NULL_DIE(nc = (struct connection *)calloc(1, sizeof(*nc)));
+    nc->ctx = ctx;
+    nc->send_slots = c.queue_depth;
+    nc->send_signal = c.signal_every;
+    // in srq mode there is no ring, recv_slots is only a sizing hint: the
+    // srq may hand one connection any number of its receives
+    nc->recv_slots = c.recv_slots;
+    nc->recv_batch = c.recv_batch;
+    nc->srq = c.srq;
+    nc->pool = c.pool;
+    nc->write_imm = c.write_imm;
+    nc->credit_fc = c.credits;
+    nc->send_chain = c.send_chain;
+    // never wait for more credits than the peer can owe while its last
+    // partial batch of receives is still unposted
+    nc->credit_batch = c.recv_slots / 2;
+    if (nc->credit_batch > c.recv_slots - c.recv_batch)
+        nc->credit_batch = c.recv_slots - c.recv_batch;
+    if (nc->credit_batch <= 0) nc->credit_batch = 1;
+    if (c.srq || c.scq || c.pool) {
+        nc->dev = get_device(ctx);
+        nc->pd = c.pool ? c.pool->pd : nc->dev->pd;
+    } else {
+        IF_NULL_DIE(nc->pd = ibv_alloc_pd(ctx));
+    }
+
+    // with a pool this is the only step that can run out of resources, do
+    // it before anything else is created
+    if (alloc_ring_buffers(nc)) {
+        LOG("buffer pool is exhausted");
+        free_ring_buffers(nc);
+        free(nc);
+        return NULL;
+    }
+
+    // the cq must have room for everything this connection can complete.
+    // receives from an srq are bounded by the srq alone, every one it has
+    // posted may complete on this qp. a shared cq has that room set aside
+    // once by whoever pairs it with the srq, see conn_config.
+    int cqe = c.queue_depth + (c.srq ? c.srq->max_slots : c.recv_slots);
+    int reserve = c.srq ? c.queue_depth : cqe;
+    if (c.scq && __atomic_add_fetch(&c.scq->used, reserve,
+                                    __ATOMIC_RELAXED) > c.scq->cqe) {
+        __atomic_sub_fetch(&c.scq->used, reserve, __ATOMIC_RELAXED);
+        LOG("shared cq is full");
+        free_ring_buffers(nc);
+        free(nc);
+        return NULL;
+    }
+
+    if (c.scq) {
+        nc->scq = c.scq;
+        nc->cc = c.scq->cc;
+        nc->cq = c.scq->cq;
+        nc->xcq = c.scq->xcq;
+    } else {
+        IF_NULL_DIE(nc->cc = ibv_create_comp_channel(ctx));
+        IF_NULL_DIE(nc->cq = create_cq(ctx, cqe, nc, nc->cc,
+                                       conn_cq_flags(&c), &nc->xcq));
+        IF_NZERO_DIE(ibv_req_notify_cq(nc->cq, 0));
+    }
+
+    nc->max_inline = c.max_inline;
+
+    uint32_t send_lkey =
+        nc->pool ? buf_pool_lkey(nc->pool) : nc->send_mr->lkey;
+    IF_NULL_DIE(nc->send_sge = calloc(nc->send_slots, sizeof(*nc->send_sge)));
+    IF_NULL_DIE(nc->send_wr = calloc(nc->send_slots, sizeof(*nc->send_wr)));
+    IF_NULL_DIE(nc->send_loan = calloc(nc->send_slots, sizeof(int)));
+    if (c.trace)
+        IF_NULL_DIE(nc->send_ns = calloc(nc->send_slots, sizeof(uint64_t)));
+    for (int i = 0; i < nc->send_slots; i++) {
+        nc->send_loan[i] = -1;
+        nc->send_sge[i].addr = (uintptr_t)SEND_BUF(nc, i);
+        nc->send_sge[i].length = BUFFER_SIZE;
+        nc->send_sge[i].lkey = send_lkey;
+        nc->send_wr[i].opcode =
+            nc->write_imm   ? IBV_WR_RDMA_WRITE_WITH_IMM
+            : nc->credit_fc ? IBV_WR_SEND_WITH_IMM
+                            : IBV_WR_SEND;
+        nc->send_wr[i].sg_list = &nc->send_sge[i];
+        nc->send_wr[i].num_sge = 1;
+        nc->send_wr[i].next = NULL;
+    }
+
+    // the srq already has its receives posted
+    if (nc->srq) return nc;
+
+    uint32_t recv_lkey = nc->pool ? buf_pool_lkey(nc->pool) : nc->recv_mr->lkey;
+    IF_NULL_DIE(nc->recv_sge = calloc(nc->recv_slots, sizeof(*nc->recv_sge)));
+    IF_NULL_DIE(nc->recv_wr = calloc(nc->recv_slots, sizeof(*nc->recv_wr)));
+    IF_NULL_DIE(nc->recv_pending =
+                    calloc(nc->recv_slots, sizeof(*nc->recv_pending)));
+    for (int i = 0; i < nc->recv_slots; i++) {
+        nc->recv_sge[i].addr = (uintptr_t)RECV_BUF(nc, i);
+        nc->recv_sge[i].length = BUFFER_SIZE;
+        nc->recv_sge[i].lkey = recv_lkey;
+        nc->recv_wr[i].sg_list = &nc->recv_sge[i];
+        // the payload is written straight into the slot
+        nc->recv_wr[i].num_sge = nc->write_imm ? 0 : 1;
+        nc->recv_wr[i].wr_id = i;
+        nc->recv_pending[i] = i;
+    }
+    nc->recv_npending = nc->recv_slots;
+    if (nc->write_imm) IF_NULL_DIE(nc->ring_done = calloc(nc->recv_slots, 1));
+    return nc;
+}
 
-    IF_NULL_DIE(nc = (struct connection *)malloc(sizeof(*nc)));
-    nc->ctx = cm_id->verbs;
-    IF_NULL_DIE(nc->pd = ibv_alloc_pd(cm_id->verbs));
-    IF_NULL_DIE(nc->cc = ibv_create_comp_channel(cm_id->verbs));
-    IF_NULL_DIE(nc->cq = ibv_create_cq(cm_id->verbs, 10, NULL, nc->cc, 0));
+// the receive kept for zero length writes, re-posted as soon as one is
+// taken rather than with the next batch
+static int post_notify_recv(struct connection *nc) {
+    struct ibv_recv_wr wr = {0}, *bad_wr = NULL;
+    wr.wr_id = nc->recv_slots;
+    int ret = ibv_post_recv(nc->qp, &wr, &bad_wr);
+    nc->recv_posts++;
+    nc->recv_wrs++;
+    if (ret == 0) nc->recv_posted++;
+    return ret;
+}
 
-    IF_NZERO_DIE(ibv_req_notify_cq(nc->cq, 0));
+// the last step of setting up a connection: create its qp on <cm_id> and
+// post the receive ring. nc must come from conn_alloc() for cm_id's device.
+int conn_bind(struct connection *nc, struct rdma_cm_id *cm_id) {
+    if (cm_id->verbs != nc->ctx) return -1;
 
-    // create qp
     struct ibv_qp_init_attr qp_attr;
     memset(&qp_attr, 0, sizeof(qp_attr));
     qp_attr.send_cq = nc->cq;
     qp_attr.recv_cq = nc->cq;
     qp_attr.qp_type = IBV_QPT_RC;
-    qp_attr.cap.max_send_wr = 10;
-    qp_attr.cap.max_recv_wr = 10;
+    qp_attr.cap.max_send_wr = nc->send_slots;
+    // with write_imm one more for zero length writes
+    qp_attr.cap.max_recv_wr = nc->recv_slots + (nc->write_imm ? 1 : 0);
     qp_attr.cap.max_send_sge = 1;
     qp_attr.cap.max_recv_sge = 1;
-    IF_NZERO_DIE(rdma_create_qp(cm_id, nc->pd, &qp_attr));
+    qp_attr.cap.max_inline_data = nc->max_inline;
+    qp_attr.sq_sig_all = 0;
+    if (nc->srq) qp_attr.srq = nc->srq->srq;
+    // there is no device attribute for the inline limit, so back off until
+    // the provider accepts the qp. it reports what it actually granted.
+    while (rdma_create_qp(cm_id, nc->pd, &qp_attr)) {
+        if (qp_attr.cap.max_inline_data == 0) die("rdma_create_qp");
+        qp_attr.cap.max_inline_data /= 2;
+    }
     nc->qp = cm_id->qp;
+    nc->max_inline = qp_attr.cap.max_inline_data;
 
-    // alloc and register mr
-    IF_NULL_DIE(nc->recv_buff = malloc(BUFFER_SIZE));
-    IF_NULL_DIE(nc->send_buff = malloc(BUFFER_SIZE));
-    IF_NULL_DIE(nc->recv_mr = ibv_reg_mr(
-                    nc->pd, nc->recv_buff, BUFFER_SIZE,
-                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
-    IF_NULL_DIE(nc->send_mr = ibv_reg_mr(
-                    nc->pd, nc->send_buff, BUFFER_SIZE,
-                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    // the srq already has its receives posted
+    if (nc->srq) return 0;
+    // post the whole ring as one chain, the peer learns of it as its
+    // initial credit
+    IF_NZERO_DIE(conn_flush_recv(nc));
+    nc->credits_owed = 0;
+    if (nc->write_imm) {
+        IF_NZERO_DIE(post_notify_recv(nc));
+        nc->ring_reposted = 0;
+    }
+    return 0;
+}
+
+struct connection *setup_connection(struct rdma_cm_id *cm_id,
+                                   const struct conn_config *cfg) {
+    struct connection *nc = conn_alloc(cm_id->verbs, cfg);
+    if (nc == NULL) return NULL;
+    if (conn_bind(nc, cm_id)) {
+        destroy_connection(nc);
+        return NULL;
+    }
+    return nc;
+}
+
+void destroy_connection(struct connection *nc) {
+    if (nc->qp) ibv_destroy_qp(nc->qp);
+    if (nc->scq) {
+        // the shared cq and channel stay, only give back the reservation
+        int reserve = nc->send_slots + (nc->srq ? 0 : nc->recv_slots);
+        __atomic_sub_fetch(&nc->scq->used, reserve, __ATOMIC_RELAXED);
+        nc->cq = NULL;
+        nc->cc = NULL;
+    } else {
+        free(nc->xcq);
+    }
+    if (nc->cq) ibv_destroy_cq(nc->cq);
+    free_ring_buffers(nc);
+    free(nc->send_sge);
+    free(nc->send_wr);
+    free(nc->send_loan);
+    free(nc->send_ns);
+    free(nc->recv_sge);
+    free(nc->recv_wr);
+    free(nc->recv_pending);
+    free(nc->ring_done);
+    if (nc->cc) ibv_destroy_comp_channel(nc->cc);
+    // a shared pd belongs to the device
+    if (nc->pd && !nc->dev) ibv_dealloc_pd(nc->pd);
+    free(nc);
+}
+
+char *conn_recv_buf(struct connection *nc, int slot) {
+    return nc->srq ? srq_buf(nc->srq, slot) : RECV_BUF(nc, slot);
+}
+
+// released write_imm slots whose receive is posted again, the peer may
+// write that many slots past its first ring
+static unsigned int ring_avail(struct connection *nc) {
+    if ((int)(nc->ring_freed - nc->ring_reposted) > 0)
+        return nc->ring_reposted;
+    return nc->ring_freed;
+}
 
-    // setup wr
-    nc->recv_sge.addr = (uintptr_t)nc->recv_buff;
-    nc->recv_sge.length = BUFFER_SIZE;
-    nc->recv_sge.lkey = nc->recv_mr->lkey;
-    nc->recv_wr.sg_list = &nc->recv_sge;
-    nc->recv_wr.num_sge = 1;
-    nc->recv_wr.next = NULL;
-    nc->recv_wr.wr_id = (uint64_t)nc;
-
-    nc->send_sge.addr = (uintptr_t)nc->send_buff;
-    nc->send_sge.length = BUFFER_SIZE;
-    nc->send_sge.lkey = nc->send_mr->lkey;
-    nc->send_wr.opcode = IBV_WR_SEND;
-    nc->send_wr.send_flags = IBV_SEND_SIGNALED;
-    nc->send_wr.sg_list = &nc->send_sge;
-    nc->send_wr.num_sge = 1;
-    nc->send_wr.next = NULL;
-    nc->send_wr.wr_id = (uint64_t)nc;
+// return the released count in a zero length write once credit_batch of
+// them have piled up, as for owed credits
+static int send_ring_update(struct connection *nc) {
+    if (nc->peer_slots == 0) return 0;
+    if (ring_avail(nc) - nc->ring_reported < (unsigned int)nc->credit_batch)
+        return 0;
+    if (nc->send_head - nc->send_tail >= (unsigned int)nc->send_slots)
+        return 0;
+    nc->credit_updates++;
+    return conn_post_send(nc, 0);
+}
+
+// count a released write_imm slot. the count only moves past slots that
+// are all released, one released ahead of an older one waits for it.
+static void ring_release(struct connection *nc, int slot) {
+    nc->ring_done[slot] = 1;
+    while (nc->ring_freed != nc->ring_seq) {
+        int s = nc->ring_freed % nc->recv_slots;
+        if (!nc->ring_done[s]) break;
+        nc->ring_done[s] = 0;
+        nc->ring_freed++;
+    }
+}
+
+// hand a consumed receive slot back to the ring
+int conn_release_recv(struct connection *nc, int slot) {
+    if (nc->srq) return srq_release(nc->srq, slot);
+    if (nc->write_imm) ring_release(nc, slot);
+
+    nc->recv_pending[nc->recv_npending++] = slot;
+    if (nc->recv_npending >= nc->recv_batch) return conn_flush_recv(nc);
+    // a slot released late may let the count past slots already reposted
+    return nc->write_imm ? send_ring_update(nc) : 0;
+}
+
+// one ibv_post_send() with n work requests, one doorbell
+static void count_send_post(struct connection *nc, int n) {
+    nc->send_posts++;
+    nc->send_wrs += n;
+    if (nc->stats) {
+        STAT_ADD(nc->stats->send_posts, 1);
+        STAT_ADD(nc->stats->send_wrs, n);
+    }
+}
+
+// post every send queued with send_chain as one list
+int conn_flush_send(struct connection *nc) {
+    if (nc->chain_len == 0) return 0;
+    struct ibv_send_wr *bad_wr = NULL;
+    int ret = ibv_post_send(nc->qp, nc->chain_head, &bad_wr);
+    count_send_post(nc, nc->chain_len);
+    nc->chain_head = nc->chain_tail = NULL;
+    nc->chain_len = 0;
+    return ret;
+}
+
+// every receive completion takes one posted receive
+static void count_recv(struct connection *nc, uint32_t len) {
+    if (!nc->srq) nc->recv_posted--;
+    if (nc->stats) {
+        STAT_ADD(nc->stats->msgs_in, 1);
+        STAT_ADD(nc->stats->bytes_in, len);
+        STAT_SET(nc->stats->rq_posted, nc->recv_posted);
+    }
+}
+
+// slot and length of a receive completion. with write_imm the slot is the
+// one the peer wrote into, not the receive that carried the notification,
+// and it is released with conn_release_recv() like any other. with credits
+// or write_imm the returned count is taken here, and -1 means the message
+// carried nothing else and its receive is already posted again.
+int conn_recv_slot(struct connection *nc, const struct ibv_wc *wc,
+                   uint32_t *len) {
+    if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+        uint32_t imm = ntohl(wc->imm_data);
+        *len = imm & IMM_LEN_MASK;
+        count_recv(nc, *len);
+        // the peer's count is within one ring of ring_head
+        uint16_t released = imm >> IMM_RELEASED_SHIFT;
+        nc->peer_released =
+            nc->ring_head - (uint16_t)(nc->ring_head - released);
+        if (*len == 0) {
+            IF_NZERO_DIE(post_notify_recv(nc));
+            return -1;
+        }
+        // writes arrive in the order they were posted
+        return (int)(nc->ring_seq++ % nc->recv_slots);
+    }
+    *len = wc->byte_len;
+    count_recv(nc, *len);
+    if (nc->credit_fc && (wc->wc_flags & IBV_WC_WITH_IMM)) {
+        nc->send_credits += ntohl(wc->imm_data);
+        if (wc->byte_len == 0) {
+            IF_NZERO_DIE(conn_release_recv(nc, (int)wc->wr_id));
+            return -1;
+        }
+    }
+    return (int)wc->wr_id;
+}
+
+// return the owed credits in a zero length send once enough have piled up.
+// it may take the last credit, the peer can always answer with its own.
+static int send_credit_update(struct connection *nc) {
+    if (nc->credits_owed < nc->credit_batch || nc->send_credits < 1) return 0;
+    if (nc->send_head - nc->send_tail >= (unsigned int)nc->send_slots)
+        return 0;
+    nc->credit_updates++;
+    return conn_post_send(nc, 0);
+}
+
+// post every pending receive slot with a single ibv_post_recv
+int conn_flush_recv(struct connection *nc) {
+    int n = nc->recv_npending;
+    if (n == 0) return 0;
+
+    for (int i = 0; i < n; i++) {
+        struct ibv_recv_wr *wr = &nc->recv_wr[nc->recv_pending[i]];
+        wr->next = (i + 1 < n) ? &nc->recv_wr[nc->recv_pending[i + 1]] : NULL;
+    }
+    nc->recv_npending = 0;
 
     struct ibv_recv_wr *bad_wr = NULL;
-    IF_NZERO_DIE(ibv_post_recv(nc->qp, &nc->recv_wr, &bad_wr));
+    int ret =
+        ibv_post_recv(nc->qp, &nc->recv_wr[nc->recv_pending[0]], &bad_wr);
+    nc->recv_posts++;
+    nc->recv_wrs += n;
+    if (nc->stats) {
+        STAT_ADD(nc->stats->recv_posts, 1);
+        STAT_ADD(nc->stats->recv_wrs, n);
+    }
+    if (ret) return ret;
+    nc->recv_posted += n;
+    if (nc->stats) STAT_SET(nc->stats->rq_posted, nc->recv_posted);
+    if (nc->write_imm) {
+        nc->ring_reposted += n;
+        return send_ring_update(nc);
+    }
+    if (!nc->credit_fc) return 0;
 
-    return nc;
+    nc->credits_owed += n;
+    return send_credit_update(nc);
+}
+
+// sends that may be in flight
+static int send_ring_full(struct connection *nc) {
+    return nc->send_head - nc->send_tail >= (unsigned int)nc->send_slots;
+}
+
+// with write_imm a message also needs a slot of the peer's ring the peer
+// has released since it last held a message
+static int peer_ring_full(struct connection *nc) {
+    return nc->write_imm &&
+           nc->ring_head - nc->peer_released >= (unsigned int)nc->peer_slots;
+}
+
+// no send slot, or no credit for a message. the last credit is kept for a
+// message that returns credits, so two peers that are both out of credits
+// can always tell each other about their receives.
+static int send_blocked(struct connection *nc) {
+    if (send_ring_full(nc) || peer_ring_full(nc)) return 1;
+    if (!nc->credit_fc || nc->send_credits > 1 ||
+        (nc->send_credits == 1 && nc->credits_owed > 0)) {
+        nc->credit_stalled = 0;
+        return 0;
+    }
+    if (!nc->credit_stalled) {
+        nc->credit_stalls++;
+        if (nc->stats) STAT_ADD(nc->stats->credit_stalls, 1);
+    }
+    nc->credit_stalled = 1;
+    return 1;
+}
+
+// next free send buffer, NULL when every send slot is in flight
+char *conn_send_buf(struct connection *nc) {
+    if (send_blocked(nc)) return NULL;
+    return SEND_BUF(nc, nc->send_head % nc->send_slots);
+}
+
+// point a send slot back at its own buffer
+static void unloan_slot(struct connection *nc, int s) {
+    nc->send_loan[s] = -1;
+    nc->send_sge[s].addr = (uintptr_t)SEND_BUF(nc, s);
+    nc->send_sge[s].lkey =
+        nc->pool ? buf_pool_lkey(nc->pool) : nc->send_mr->lkey;
+}
+
+// send a loaned receive buffer in place, the receive slot is returned when
+// the send completes, or at once when the payload goes inline. returns -1
+// when every send slot is in flight or the peer has no receive for it.
+int conn_send_loaned(struct connection *nc, int slot, uint32_t len) {
+    if (send_blocked(nc)) return -1;
+
+    if (len <= nc->max_inline) {
+        // the payload is copied at post time, the buffer is free right away
+        int ret = conn_send_inline(nc, conn_recv_buf(nc, slot), len);
+        if (ret == 0) IF_NZERO_DIE(conn_release_recv(nc, slot));
+        return ret;
+    }
+
+    struct ibv_sge *recv_sge =
+        nc->srq ? &nc->srq->sge[slot] : &nc->recv_sge[slot];
+    int s = nc->send_head % nc->send_slots;
+    nc->send_sge[s].addr = recv_sge->addr;
+    nc->send_sge[s].lkey = recv_sge->lkey;
+    nc->send_loan[s] = slot;
+    int ret = conn_post_send(nc, len);
+    // not posted, the receive buffer is still the caller's
+    if (ret) unloan_slot(nc, s);
+    return ret;
+}
+
+// post the buffer returned by conn_send_buf()
+int conn_post_send(struct connection *nc, uint32_t len) {
+    int slot = nc->send_head % nc->send_slots;
+    struct ibv_send_wr *wr = &nc->send_wr[slot];
+    nc->send_sge[slot].length = len;
+
+    // signal every send_signal-th send, and always the one that fills the
+    // ring, otherwise nothing would ever complete to free a slot
+    unsigned int used = nc->send_head + 1 - nc->send_tail;
+    int signaled = used == (unsigned int)nc->send_slots ||
+                   nc->send_unsignaled + 1 >= nc->send_signal;
+    wr->send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+    if (len <= nc->max_inline) wr->send_flags |= IBV_SEND_INLINE;
+    // the completion carries the sequence number of its send
+    wr->wr_id = nc->send_head;
+    if (nc->credit_fc) wr->imm_data = htonl(nc->credits_owed);
+    // a zero length sge could be taken for the largest possible one
+    wr->num_sge = len > 0 ? 1 : 0;
+    unsigned int avail = 0;
+    if (nc->write_imm) {
+        // a zero length write only returns the count, it takes no slot
+        uint32_t target = nc->ring_head % nc->peer_slots;
+        avail = ring_avail(nc);
+        wr->wr.rdma.remote_addr =
+            nc->peer_addr + (uint64_t)target * BUFFER_SIZE;
+        wr->wr.rdma.rkey = nc->peer_rkey;
+        wr->imm_data =
+            htonl((avail & IMM_LEN_MASK) << IMM_RELEASED_SHIFT | len);
+    }
+
+    if (nc->send_ns) nc->send_ns[slot] = now_ns();
+    int ret = 0;
+    wr->next = NULL;
+    if (nc->send_chain) {
+        // goes to the device with the rest of the chain in conn_flush_send()
+        if (nc->chain_tail)
+            nc->chain_tail->next = wr;
+        else
+            nc->chain_head = wr;
+        nc->chain_tail = wr;
+        nc->chain_len++;
+    } else {
+        struct ibv_send_wr *bad_wr = NULL;
+        ret = ibv_post_send(nc->qp, wr, &bad_wr);
+        count_send_post(nc, 1);
+    }
+    if (ret == 0) {
+        nc->send_head++;
+        nc->send_unsignaled = signaled ? 0 : nc->send_unsignaled + 1;
+        if (nc->credit_fc) {
+            nc->send_credits--;
+            nc->credits_owed = 0;
+        }
+        if (nc->write_imm) {
+            nc->ring_reported = avail;
+            if (len > 0) nc->ring_head++;
+        }
+        if (nc->stats) {
+            STAT_ADD(nc->stats->msgs_out, 1);
+            STAT_ADD(nc->stats->bytes_out, len);
+            STAT_SET(nc->stats->sq_used, nc->send_head - nc->send_tail);
+        }
+    }
+    return ret;
+}
+
+// send up to max_inline bytes from any memory, registered or not. the data
+// is copied into the work request so buf may be reused on return. returns
+// -1 when the payload is too large, every send slot is in flight or the
+// peer has no receive for it.
+int conn_send_inline(struct connection *nc, const void *buf, uint32_t len) {
+    if (len > nc->max_inline) return -1;
+    if (send_blocked(nc)) return -1;
+
+    int s = nc->send_head % nc->send_slots;
+    if (nc->send_chain) {
+        // the wqe is only built when the chain is posted, keep the payload
+        // in the slot's own buffer until then
+        memcpy(SEND_BUF(nc, s), buf, len);
+        return conn_post_send(nc, len);
+    }
+    nc->send_sge[s].addr = (uintptr_t)buf;
+    int ret = conn_post_send(nc, len);
+    nc->send_sge[s].addr = (uintptr_t)SEND_BUF(nc, s);
+    return ret;
+}
+
+// called for every IBV_WC_SEND completion with its wr_id, reclaims the
+// signaled send and every unsignaled one posted before it
+int conn_send_done(struct connection *nc, uint64_t wr_id) {
+    unsigned int end = (unsigned int)wr_id + 1;
+    if (end - nc->send_tail > (unsigned int)nc->send_slots) return -1;
+
+    int ret = 0;
+    while (nc->send_tail != end) {
+        int s = nc->send_tail++ % nc->send_slots;
+        int loan = nc->send_loan[s];
+        if (loan < 0) continue;
+
+        // give the receive buffer back
+        unloan_slot(nc, s);
+        if (conn_release_recv(nc, loan)) ret = -1;
+    }
+    if (nc->stats) STAT_SET(nc->stats->sq_used, nc->send_head - nc->send_tail);
+    // owed credits or released slots may have waited for a free slot
+    if (nc->credit_fc && send_credit_update(nc)) ret = -1;
+    if (nc->write_imm && send_ring_update(nc)) ret = -1;
+    return ret;
+}
+
+// read len bytes at addr/rkey of the peer into buf. takes a send slot and
+// is always signaled, the IBV_WC_RDMA_READ completion goes through
+// conn_send_done() like a send. returns -1 when every send slot is in
+// flight.
+int conn_post_read(struct connection *nc, void *buf, uint32_t lkey,
+                   uint64_t addr, uint32_t rkey, uint32_t len) {
+    if (send_ring_full(nc)) return -1;
+    // queued sends come first, completions arrive in posting order
+    int ret = conn_flush_send(nc);
+    if (ret) return ret;
+
+    // only the slot's turn is used, its buffer stays untouched
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)buf,
+        .length = len,
+        .lkey = lkey,
+    };
+    struct ibv_send_wr wr = {0}, *bad_wr = NULL;
+    wr.wr_id = nc->send_head;
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.wr.rdma.remote_addr = addr;
+    wr.wr.rdma.rkey = rkey;
+
+    if (nc->send_ns) nc->send_ns[nc->send_head % nc->send_slots] = now_ns();
+    ret = ibv_post_send(nc->qp, &wr, &bad_wr);
+    count_send_post(nc, 1);
+    if (ret == 0) {
+        nc->send_head++;
+        nc->send_unsignaled = 0;
+        if (nc->stats) {
+            STAT_ADD(nc->stats->reads, 1);
+            STAT_SET(nc->stats->sq_used, nc->send_head - nc->send_tail);
+        }
+    }
+    return ret;
+}
+
+// let both sides have RD_ATOMIC reads outstanding, as far as the device
+// allows. the acceptor should not go above what the request offered.
+void conn_rd_atomic(struct rdma_cm_id *cm_id, struct rdma_conn_param *param) {
+    struct ibv_device_attr attr;
+    int depth = RD_ATOMIC;
+    if (ibv_query_device(cm_id->verbs, &attr) == 0) {
+        if (depth > attr.max_qp_rd_atom) depth = attr.max_qp_rd_atom;
+        if (depth > attr.max_qp_init_rd_atom) depth = attr.max_qp_init_rd_atom;
+    }
+    param->initiator_depth = depth;
+    param->responder_resources = depth;
+}
+
+// the local receive ring for the peer to write into. with credits alone
+// only its size matters, it is the peer's initial credit.
+void conn_ring_info(struct connection *nc, struct ring_info *ri) {
+    ri->addr = htobe64((uintptr_t)nc->recv_buff);
+    ri->rkey = htonl(nc->recv_mr ? nc->recv_mr->rkey : 0);
+    ri->slots = htonl(nc->recv_slots);
+}
+
+// take the peer's ring from rdma_cm private data, -1 if there is none
+int conn_set_peer_ring(struct connection *nc, const void *data, size_t len) {
+    struct ring_info ri;
+    if (data == NULL || len < sizeof(ri)) return -1;
+    memcpy(&ri, data, sizeof(ri));
+    nc->peer_addr = be64toh(ri.addr);
+    nc->peer_rkey = ntohl(ri.rkey);
+    nc->peer_slots = ntohl(ri.slots);
+    if (nc->write_imm && nc->peer_slots > IMM_LEN_MASK) return -1;
+    // every receive of the peer's ring is posted before it connects
+    if (nc->credit_fc) nc->send_credits = nc->peer_slots;
+    return nc->peer_slots > 0 ? 0 : -1;
 }
@@ -1,7 +1,9 @@
 #ifndef RDMA_COMMON_H
 #define RDMA_COMMON_H
 
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <infiniband/verbs.h>
 #include <netdb.h>
 #include <rdma/rdma_cma.h>
@@ -15,7 +17,19 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "bufpool.h"
+#include "excq.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+
 #define BUFFER_SIZE 1024
+#define QUEUE_DEPTH 10
+#define RECV_SLOTS 16
+#define SRQ_SLOTS 64
+#define SRQ_MAX_SLOTS 4096
+#define QP_TABLE_SIZE 64
+#define MAX_INLINE 256
 #define PORT "20079"
 
 #define IF_NZERO_DIE(x)                                         \
@@ -32,28 +46,277 @@
         }                                                      \
     } while (0)
 
+// shared receive queue. buffers are registered one chunk at a time: the
+// queue starts with a single chunk and grows by another one whenever the
+// device reports that fewer than <limit> receives are left posted.
+struct srq {
+    struct ibv_srq *srq;
+    struct ibv_pd *pd;
+    int chunk;      // slots added per growth step
+    int max_slots;  // capacity of the ibv_srq
+    int slots;      // slots backed by a buffer so far
+    int batch;
+    int limit;
+    char **bufs;  // one buffer of chunk * BUFFER_SIZE per growth step
+    struct ibv_mr **mrs;
+    struct ibv_sge *sge;
+    struct ibv_recv_wr *wr;
+    int *pending;
+    int npending;
+    void *context;  // owned by the application
+};
+
+// open addressing hash table from qp number to connection
+struct qp_entry {
+    uint32_t qp_num;
+    struct connection *conn;  // NULL marks an empty entry
+};
+
+struct qp_table {
+    struct qp_entry *entries;
+    uint32_t mask;
+    uint32_t shift;
+    uint32_t count;
+};
+
+static inline uint32_t qp_table_hash(const struct qp_table *t,
+                                     uint32_t qp_num) {
+    return (qp_num * 0x9e3779b1u) >> t->shift;
+}
+
+static inline struct connection *qp_table_lookup(const struct qp_table *t,
+                                                 uint32_t qp_num) {
+    uint32_t i = qp_table_hash(t, qp_num);
+    for (;; i = (i + 1) & t->mask) {
+        struct qp_entry *e = &t->entries[i];
+        if (e->conn == NULL || e->qp_num == qp_num) return e->conn;
+    }
+}
+
+// completion channel and cq shared by many connections. cq_context points to
+// the shared_cq, completions find their connection through qpt.
+struct shared_cq {
+    struct ibv_context *ctx;
+    struct ibv_comp_channel *cc;
+    struct ibv_cq *cq;
+    struct ex_cq *xcq;  // how cq is polled, NULL for ibv_poll_cq()
+    int cqe;   // capacity of the cq
+    int used;  // entries reserved by the attached connections
+    struct qp_table qpt;
+};
+
+// resources shared by every connection opened on the same device
+struct device {
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;
+    struct buf_pool *pool;  // created by the application on demand
+    struct device *next;
+};
+
 struct connection {
+    struct device *dev;      // set when the pd is shared
+    struct buf_pool *pool;   // set when the buffers come from a pool
+    struct shared_cq *scq;   // set when cc and cq are shared
     struct ibv_context *ctx;
     struct ibv_pd *pd;
     struct ibv_comp_channel *cc;
-    struct ibv_cq *cq;
+    struct ibv_cq *cq;  // cq_context points back to the connection
+    struct ex_cq *xcq;  // how cq is polled, NULL for ibv_poll_cq()
     struct ibv_qp *qp;
+    struct srq *srq;  // receives come from here instead of the ring
+    void *context;    // owned by the application
 
-    char *recv_buff;
-    char *send_buff;
+    // receive ring, wr_id of a receive is its slot index. consumed slots are
+    // re-posted as one linked chain once recv_batch of them are pending, so
+    // at least recv_slots - recv_batch + 1 receives stay posted.
+    int recv_slots;
+    int recv_batch;
+    char *recv_buff;   // recv_slots * BUFFER_SIZE, NULL with a pool
+    char **recv_bufs;  // buffer of each slot
     struct ibv_mr *recv_mr;
+    struct ibv_sge *recv_sge;
+    struct ibv_recv_wr *recv_wr;
+    int *recv_pending;
+    int recv_npending;
+    int recv_posted;  // receives on the qp right now
+
+    // send ring, sends complete in posting order so head/tail is enough.
+    // only every send_signal-th send asks for a completion, which reclaims
+    // every slot up to it.
+    int send_slots;
+    int send_signal;
+    int send_unsignaled;  // sends posted since the last signaled one
+    uint32_t max_inline;  // sends up to this size are copied into the wqe
+    unsigned int send_head;
+    unsigned int send_tail;
+    char *send_buff;   // send_slots * BUFFER_SIZE, NULL with a pool
+    char **send_bufs;  // buffer of each slot
+    int *send_loan;    // receive slot a send carries, -1 for its own buffer
     struct ibv_mr *send_mr;
-    struct ibv_sge recv_sge;
-    struct ibv_sge send_sge;
-    struct ibv_recv_wr recv_wr;
-    struct ibv_send_wr send_wr;
+    struct ibv_sge *send_sge;
+    struct ibv_send_wr *send_wr;
+
+    // with send_chain a posted send is only linked here, conn_flush_send()
+    // hands the whole list to the device with one ibv_post_send(), one
+    // doorbell. the caller flushes once it is done with a batch of work.
+    int send_chain;
+    struct ibv_send_wr *chain_head;
+    struct ibv_send_wr *chain_tail;
+    int chain_len;
+    uint64_t send_posts;  // ibv_post_send calls
+    uint64_t send_wrs;    // work requests they carried
+    uint64_t recv_posts;  // ibv_post_recv calls
+    uint64_t recv_wrs;
+
+    // write_imm transport: sends are RDMA writes into the peer's receive
+    // ring, the n-th into slot n % peer_slots. receives have no sge and only
+    // deliver the notification, the immediate carries the length.
+    // a slot is written again only once the peer has released it and
+    // re-posted a receive for it, a completed write only means it arrived.
+    // slots are released in any order, so each side counts those released
+    // in the order they were written and returns the count in the
+    // immediate of its writes, or in a zero length write of its own once
+    // credit_batch have piled up. one receive beyond the ring stays posted
+    // for those, they never wait for the ring to drain.
+    int write_imm;
+    uint64_t peer_addr;
+    uint32_t peer_rkey;
+    int peer_slots;  // 0 until the peer's ring is known
+    unsigned int ring_head;      // writes into the peer's ring
+    unsigned int peer_released;  // of those, released by the peer
+    unsigned int ring_seq;       // writes received into our ring
+    unsigned int ring_freed;     // of those, released in written order
+    unsigned int ring_reposted;  // receives re-posted for released slots
+    unsigned int ring_reported;  // count last returned to the peer
+    char *ring_done;  // released slots ring_freed has not reached yet
+
+    // credit flow control: a message is only sent while the peer is known
+    // to have a receive posted for it, so the qp never hits an rnr retry.
+    // the peer starts with peer_slots credits. receives re-posted here are
+    // returned in the immediate of the next send, or in a zero length send
+    // of their own once credit_batch of them are owed.
+    int credit_fc;
+    int send_credits;    // receives the peer has posted for us
+    int credits_owed;    // receives re-posted here the peer does not know
+    int credit_batch;
+    int credit_stalled;  // the last send was refused for lack of credit
+    uint64_t credit_stalls;   // times sending stopped for lack of credit
+    uint64_t credit_updates;  // zero length sends that only carried credits,
+                              // or with write_imm released slots
+
+    struct conn_stats *stats;  // published counters, NULL for none
+
+    // stage latencies, see trace.h. send_ns is when each send slot was
+    // posted, kept while tracing whether or not trace is set.
+    uint64_t *send_ns;
+    struct trace *trace;  // owned by the application, NULL for none
+};
+
+// a receive ring advertised in rdma_cm private data, network byte order
+struct ring_info {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t slots;
+} __attribute__((packed));
+
+// write_imm immediate: the low bits of the released count, then the length.
+// a ring has fewer than 2^16 slots, the count is never further behind.
+#define IMM_RELEASED_SHIFT 16
+#define IMM_LEN_MASK 0xffff
+
+// every message starts with this header, len is the whole message in
+// network byte order
+enum msg_type {
+    MSG_EAGER = 1,  // the payload follows the header
+    MSG_RNDV_RTS,   // a large payload is ready to be read, see rndv.h
+    MSG_RNDV_FIN,   // the peer is done reading a large payload
+    MSG_COALESCED,  // several small messages, see coalesce.h
+    MSG_DATAGRAM,   // a numbered request or echo over ud, see ud.h
+};
+
+struct msg_hdr {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t len;
+} __attribute__((packed));
+
+#define MSG_HDR_SIZE sizeof(struct msg_hdr)
+// outstanding rdma reads per qp, bounded by the device
+#define RD_ATOMIC 4
+
+static inline void msg_hdr_init(void *buf, enum msg_type type, uint32_t len) {
+    struct msg_hdr *h = buf;
+    h->type = type;
+    memset(h->reserved, 0, sizeof(h->reserved));
+    h->len = htonl(len);
+}
+
+#define RECV_BUF(nc, slot) ((nc)->recv_bufs[(slot)])
+#define SEND_BUF(nc, slot) ((nc)->send_bufs[(slot)])
+
+// zero-initialized fields fall back to the defaults
+struct conn_config {
+    int queue_depth;  // send slots, also the send queue size
+    int recv_slots;   // receive ring size
+    int recv_batch;   // re-post consumed receives in chains of this size
+    int signal_every; // ask for a send completion every this many sends
+    int max_inline;   // inline data to ask of the qp, negative for none
+    int write_imm;    // write_imm transport, needs a private ring
+    int credits;      // credit flow control, needs a private ring and sends
+    int cq_ex;        // poll through ibv_cq_ex, see excq.h
+    int trace;        // timestamp completions and posted sends
+    int send_chain;   // queue sends until conn_flush_send()
+    struct srq *srq;        // receive from this srq instead of a ring
+    struct shared_cq *scq;  // use its cq instead of creating one, with srq
+                            // it must already hold srq->max_slots in used
+    struct buf_pool *pool;  // take buffers from here, nothing is registered
+    // srq and scq imply the device pd, pool implies its own pd
 };
 
 void die(const char *reason);
-void LOG(const char *msg);
-void LOGF(const char *format, ...);
 void check_cm_event(struct rdma_cm_event *, enum rdma_cm_event_type);
 const char *wc_opcode_str(enum ibv_wc_opcode);
-struct connection *setup_connection(struct rdma_cm_id *cm_id);
+struct connection *setup_connection(struct rdma_cm_id *cm_id,
+                                   const struct conn_config *cfg);
+// setup_connection() in two steps
+struct connection *conn_alloc(struct ibv_context *ctx,
+                              const struct conn_config *cfg);
+int conn_bind(struct connection *nc, struct rdma_cm_id *cm_id);
+void destroy_connection(struct connection *nc);
+int conn_cq_flags(const struct conn_config *c);
+
+// a receive slot is loaned to the application from its IBV_WC_RECV until it
+// is returned, either with conn_release_recv() or by sending the buffer in
+// place with conn_send_loaned(), which returns it once the send completes.
+char *conn_recv_buf(struct connection *nc, int slot);
+int conn_release_recv(struct connection *nc, int slot);
+int conn_recv_slot(struct connection *nc, const struct ibv_wc *wc,
+                   uint32_t *len);
+int conn_send_loaned(struct connection *nc, int slot, uint32_t len);
+int conn_flush_recv(struct connection *nc);
+char *conn_send_buf(struct connection *nc);
+int conn_post_send(struct connection *nc, uint32_t len);
+int conn_flush_send(struct connection *nc);
+int conn_send_inline(struct connection *nc, const void *buf, uint32_t len);
+int conn_send_done(struct connection *nc, uint64_t wr_id);
+int conn_post_read(struct connection *nc, void *buf, uint32_t lkey,
+                   uint64_t addr, uint32_t rkey, uint32_t len);
+void conn_rd_atomic(struct rdma_cm_id *cm_id, struct rdma_conn_param *param);
+void conn_ring_info(struct connection *nc, struct ring_info *ri);
+int conn_set_peer_ring(struct connection *nc, const void *data, size_t len);
+char *srq_buf(struct srq *s, int slot);
+int srq_release(struct srq *s, int slot);
+int srq_flush(struct srq *s);
+struct device *get_device(struct ibv_context *ctx);
+struct srq *create_srq(struct device *dev, int slots, int max_slots,
+                       int batch);
+void srq_on_limit(struct srq *s);
+void qp_table_init(struct qp_table *t, uint32_t size);
+void qp_table_insert(struct qp_table *t, uint32_t qp_num,
+                     struct connection *nc);
+void qp_table_remove(struct qp_table *t, uint32_t qp_num);
+struct shared_cq *create_shared_cq(struct ibv_context *ctx, int cqe,
+                                   int flags);
+void destroy_shared_cq(struct shared_cq *scq);
 
 #endif
@@ -0,0 +1,194 @@
+#include "common.h"
+#include "connpool.h"
+#include "cqwait.h"
+
+#define DEFAULT_COUNT 1000
+#define DEFAULT_CONCURRENCY 16
+#define MAX_CONCURRENCY 1024
+
+// one connection in flight, a slot is reused once it is torn down
+struct attempt {
+    struct rdma_cm_id *id;
+    struct connection *nc;
+    uint64_t started;     // rdma_resolve_addr()
+    uint64_t connecting;  // rdma_connect()
+    int established;
+};
+
+struct bench {
+    struct rdma_event_channel *ec;
+    struct addrinfo *ai;
+    struct conn_pool *pool;  // client ends, set up ahead like the server's
+    int count;
+    int started;
+    int done;
+    int failed;
+    struct trace_hist resolved;   // rdma_resolve_addr() -> established
+    struct trace_hist connected;  // rdma_connect() -> established
+};
+
+static void start(struct bench *b, struct attempt *a) {
+    memset(a, 0, sizeof(*a));
+    IF_NZERO_DIE(rdma_create_id(b->ec, &a->id, a, RDMA_PS_TCP));
+    a->started = now_ns();
+    IF_NZERO_DIE(rdma_resolve_addr(a->id, NULL, b->ai->ai_addr, 2000));
+    b->started++;
+}
+
+// tear <a> down and start the next connection in its place
+static void finish(struct bench *b, struct attempt *a, int ok) {
+    if (a->nc) {
+        destroy_connection(a->nc);
+        // destroy_connection() already destroyed the qp
+        a->id->qp = NULL;
+    }
+    rdma_destroy_id(a->id);
+    a->id = NULL;
+    b->done++;
+    if (!ok) b->failed++;
+    if (b->started < b->count) start(b, a);
+}
+
+static int connect_attempt(struct bench *b, struct attempt *a) {
+    a->nc = conn_pool_get(b->pool);
+    if (a->nc == NULL) a->nc = conn_alloc(a->id->verbs, &b->pool->cfg);
+    if (a->nc == NULL) return -1;
+    if (conn_bind(a->nc, a->id)) return -1;
+
+    struct rdma_conn_param param = {0};
+    param.retry_count = 3;
+    param.rnr_retry_count = 7;  // 7 is infinity
+    a->connecting = now_ns();
+    return rdma_connect(a->id, &param);
+}
+
+// returns 0 until every connection is done
+static int handle_event(struct bench *b) {
+    struct rdma_cm_event *event = NULL;
+    IF_NZERO_DIE(rdma_get_cm_event(b->ec, &event));
+    uint64_t now = now_ns();
+    // an id can not be destroyed while one of its events is unacked
+    struct attempt *a = event->id->context;
+    enum rdma_cm_event_type type = event->event;
+    int status = event->status;
+    rdma_ack_cm_event(event);
+
+    switch (type) {
+        case RDMA_CM_EVENT_ADDR_RESOLVED:
+            if (rdma_resolve_route(a->id, 2000)) finish(b, a, 0);
+            break;
+        case RDMA_CM_EVENT_ROUTE_RESOLVED:
+            if (connect_attempt(b, a)) finish(b, a, 0);
+            break;
+        case RDMA_CM_EVENT_ESTABLISHED:
+            trace_hist_record(&b->resolved, now - a->started);
+            trace_hist_record(&b->connected, now - a->connecting);
+            a->established = 1;
+            rdma_disconnect(a->id);
+            break;
+        case RDMA_CM_EVENT_DISCONNECTED:
+            finish(b, a, a->established);
+            break;
+        default:
+            LOGF("event: %s, status %d\n", rdma_event_str(type), status);
+            finish(b, a, 0);
+            break;
+    }
+    return b->done == b->count;
+}
+
+static void print_hist(const char *name, const struct trace_hist *h) {
+    if (h->count == 0) {
+        printf("  %-22s no samples\n", name);
+        return;
+    }
+    printf("  %-22s avg %8.2f  p50 %8.2f  p99 %8.2f  max %8.2f us\n", name,
+           h->sum / h->count / 1e3, trace_hist_percentile(h, 0.5) / 1e3,
+           trace_hist_percentile(h, 0.99) / 1e3, h->max / 1e3);
+}
+
+// the device connections to <ai> go out of
+static struct ibv_context *route_device(struct rdma_event_channel *ec,
+                                        struct addrinfo *ai) {
+    struct rdma_cm_id *id = NULL;
+    struct rdma_cm_event *event = NULL;
+    IF_NZERO_DIE(rdma_create_id(ec, &id, NULL, RDMA_PS_TCP));
+    IF_NZERO_DIE(rdma_resolve_addr(id, NULL, ai->ai_addr, 2000));
+    IF_NZERO_DIE(rdma_get_cm_event(ec, &event));
+    check_cm_event(event, RDMA_CM_EVENT_ADDR_RESOLVED);
+    rdma_ack_cm_event(event);
+    struct ibv_context *ctx = id->verbs;
+    IF_NULL_DIE(ctx);
+    rdma_destroy_id(id);
+    return ctx;
+}
+
+int main(int argc, char *argv[]) {
+    int opt, count = DEFAULT_COUNT, concurrency = DEFAULT_CONCURRENCY;
+    while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (argc - optind != 1 || count <= 0 || concurrency <= 0 ||
+        concurrency > MAX_CONCURRENCY)
+        goto usage;
+    if (concurrency > count) concurrency = count;
+
+    struct bench b = {0};
+    b.count = count;
+    IF_NULL_DIE(b.ec = rdma_create_event_channel());
+
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    IF_NZERO_DIE(getaddrinfo(argv[optind], PORT, &hints, &b.ai));
+
+    // the client side is set up ahead too, only the server is measured
+    struct conn_config cfg = {0};
+    b.pool = conn_pool_create(route_device(b.ec, b.ai), &cfg, concurrency);
+
+    struct attempt *slots = NULL;
+    IF_NULL_DIE(slots = calloc(concurrency, sizeof(*slots)));
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < concurrency; i++) {
+        start(&b, &slots[i]);
+    }
+    while (!handle_event(&b)) {
+    }
+    double secs = (now_ns() - t0) / 1e9;
+
+    printf("%d connections, %d at a time, %d failed\n", count, concurrency,
+           b.failed);
+    printf("  %.0f connections/s\n", (count - b.failed) / secs);
+    print_hist("resolve->established", &b.resolved);
+    print_hist("connect->established", &b.connected);
+    printf("  client pool: %lu hits, %lu misses\n", b.pool->hits,
+           b.pool->misses);
+
+    conn_pool_stop();
+    conn_pool_destroy(b.pool);
+    free(slots);
+    freeaddrinfo(b.ai);
+    rdma_destroy_event_channel(b.ec);
+    return 0;
+
+usage:
+    fprintf(stderr,
+            "usage: %s [-n count] [-c concurrency] <server_ip>\n"
+            "  -n count        connections to set up and tear down "
+            "(default %d)\n"
+            "  -c concurrency  connections in flight (default %d, max %d)\n"
+            "the server must run without -W and -C, with -t it also reports "
+            "its accept latency on SIGUSR1\n",
+            argv[0], DEFAULT_COUNT, DEFAULT_CONCURRENCY, MAX_CONCURRENCY);
+    return 1;
+}
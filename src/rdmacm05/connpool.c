@@ -0,0 +1,143 @@
+#include "connpool.h"
+
+#include <time.h>
+
+// how often the refill thread looks at the pools without being asked
+#define REFILL_PERIOD_NS 100000000
+
+static pthread_mutex_t g_refill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_refill_cond;
+static pthread_t g_refill_thread;
+static int g_refill_running = 0;
+static int g_refill_kicked = 0;
+static int g_refill_stop = 0;
+// pools are only prepended while the refill thread runs, it can walk from
+// any head it saw
+static struct conn_pool *g_pools = NULL;
+
+// allocate outside the lock, conn_alloc() registers memory and is slow.
+// only the refill thread and conn_pool_create() push, so nothing overshoots.
+static void conn_pool_fill(struct conn_pool *pool) {
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        int need = pool->nfree < pool->target;
+        pthread_mutex_unlock(&pool->lock);
+        if (!need) return;
+
+        struct connection *nc = conn_alloc(pool->ctx, &pool->cfg);
+        if (nc == NULL) {
+            // out of cq entries or buffers, try again next period
+            if (!pool->starved) LOG("connection pool can not refill");
+            pool->starved = 1;
+            return;
+        }
+        pool->starved = 0;
+        pthread_mutex_lock(&pool->lock);
+        pool->free[pool->nfree++] = nc;
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void *refill_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_refill_lock);
+    while (!g_refill_stop) {
+        struct conn_pool *head = g_pools;
+        pthread_mutex_unlock(&g_refill_lock);
+        for (struct conn_pool *p = head; p; p = p->next) {
+            conn_pool_fill(p);
+        }
+        pthread_mutex_lock(&g_refill_lock);
+
+        if (!g_refill_kicked && !g_refill_stop) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += REFILL_PERIOD_NS;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&g_refill_cond, &g_refill_lock, &ts);
+        }
+        g_refill_kicked = 0;
+    }
+    pthread_mutex_unlock(&g_refill_lock);
+    return NULL;
+}
+
+struct conn_pool *conn_pool_create(struct ibv_context *ctx,
+                                   const struct conn_config *cfg,
+                                   int target) {
+    struct conn_pool *pool = NULL;
+    IF_NULL_DIE(pool = calloc(1, sizeof(*pool)));
+    pool->ctx = ctx;
+    pool->cfg = *cfg;
+    pool->target = target;
+    IF_NULL_DIE(pool->free = calloc(target, sizeof(*pool->free)));
+    pthread_mutex_init(&pool->lock, NULL);
+    conn_pool_fill(pool);
+    LOGF("connection pool: %d of %d ready\n", pool->nfree, target);
+
+    pthread_mutex_lock(&g_refill_lock);
+    pool->next = g_pools;
+    g_pools = pool;
+    if (!g_refill_running) {
+        // timed waits against the clock now_ns() also uses
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&g_refill_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        if (pthread_create(&g_refill_thread, NULL, refill_main, NULL))
+            die("Failed to create pool refill thread");
+        g_refill_running = 1;
+    }
+    pthread_mutex_unlock(&g_refill_lock);
+    return pool;
+}
+
+struct connection *conn_pool_get(struct conn_pool *pool) {
+    struct connection *nc = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nfree > 0) {
+        nc = pool->free[--pool->nfree];
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // replace it right away rather than at the next period
+    pthread_mutex_lock(&g_refill_lock);
+    g_refill_kicked = 1;
+    pthread_cond_signal(&g_refill_cond);
+    pthread_mutex_unlock(&g_refill_lock);
+    return nc;
+}
+
+void conn_pool_stop(void) {
+    pthread_mutex_lock(&g_refill_lock);
+    int running = g_refill_running;
+    g_refill_stop = 1;
+    pthread_cond_signal(&g_refill_cond);
+    pthread_mutex_unlock(&g_refill_lock);
+    if (running) pthread_join(g_refill_thread, NULL);
+}
+
+void conn_pool_destroy(struct conn_pool *pool) {
+    pthread_mutex_lock(&g_refill_lock);
+    for (struct conn_pool **pp = &g_pools; *pp; pp = &(*pp)->next) {
+        if (*pp == pool) {
+            *pp = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_refill_lock);
+
+    for (int i = 0; i < pool->nfree; i++) {
+        destroy_connection(pool->free[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->free);
+    free(pool);
+}
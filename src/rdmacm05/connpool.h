@@ -0,0 +1,39 @@
+#ifndef RDMA_CONNPOOL_H
+#define RDMA_CONNPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// connections made ahead of time with conn_alloc(): pd, cq, rings and their
+// registration are ready, taking one leaves only conn_bind(), the qp and
+// the initial receives, to the accept path. rdma_cm creates a qp on its
+// cm_id, so that part cannot be done before the request arrives.
+// one background thread tops every pool back up to its target.
+struct conn_pool {
+    struct ibv_context *ctx;
+    struct conn_config cfg;  // what every connection is allocated with
+    int target;
+
+    pthread_mutex_t lock;
+    struct connection **free;  // stack of ready connections
+    int nfree;
+    uint64_t hits;    // conn_pool_get() found one
+    uint64_t misses;  // the pool was empty
+    int starved;      // the last refill failed, logged once
+
+    struct conn_pool *next;  // in the refill thread's list
+};
+
+// fills the pool before returning and hands it to the refill thread
+struct conn_pool *conn_pool_create(struct ibv_context *ctx,
+                                   const struct conn_config *cfg, int target);
+// a ready connection, NULL when the pool ran dry
+struct connection *conn_pool_get(struct conn_pool *pool);
+// stop the refill thread, before any conn_pool_destroy()
+void conn_pool_stop(void);
+// destroys the connections still in the pool
+void conn_pool_destroy(struct conn_pool *pool);
+
+#endif
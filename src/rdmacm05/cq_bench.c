@@ -0,0 +1,197 @@
+#include "common.h"
+#include "cqwait.h"
+
+#define DEFAULT_ROUNDS 10000
+#define DEFAULT_BATCH 64
+#define MAX_BATCH 512
+#define POLL_BATCH 16  // as many as the server polls at once
+#define MSG_SIZE 64
+
+struct poll_acc {
+    uint64_t wcs;
+    uint64_t polls;     // that returned completions
+    uint64_t poll_ns;   // spent in those polls
+    uint64_t total_ns;  // in those polls and handling what they returned
+};
+
+static void expect_event(struct rdma_event_channel *ec,
+                         enum rdma_cm_event_type type,
+                         struct rdma_cm_id **id) {
+    struct rdma_cm_event *event = NULL;
+    IF_NZERO_DIE(rdma_get_cm_event(ec, &event));
+    check_cm_event(event, type);
+    if (id) *id = event->id;
+    rdma_ack_cm_event(event);
+}
+
+// connect the bench to itself through <ai>, both ends on cfg->scq.
+// ids[0] listens, ids[1] and nc[0] send, ids[2] and nc[1] receive.
+static void connect_loop(struct rdma_event_channel *ec, struct addrinfo *ai,
+                         const struct conn_config *cfg,
+                         struct rdma_cm_id *ids[3], struct connection *nc[2]) {
+    struct sockaddr_in addr;
+    memcpy(&addr, ai->ai_addr, sizeof(addr));
+    addr.sin_port = 0;
+    IF_NZERO_DIE(rdma_create_id(ec, &ids[0], NULL, RDMA_PS_TCP));
+    IF_NZERO_DIE(rdma_bind_addr(ids[0], (struct sockaddr *)&addr));
+    IF_NZERO_DIE(rdma_listen(ids[0], 1));
+    addr.sin_port = rdma_get_src_port(ids[0]);
+
+    struct rdma_conn_param param = {0};
+    param.retry_count = 3;
+    param.rnr_retry_count = 7;  // 7 is infinity
+
+    IF_NZERO_DIE(rdma_create_id(ec, &ids[1], NULL, RDMA_PS_TCP));
+    IF_NZERO_DIE(rdma_resolve_addr(ids[1], NULL, (struct sockaddr *)&addr,
+                                   2000));
+    expect_event(ec, RDMA_CM_EVENT_ADDR_RESOLVED, NULL);
+    IF_NZERO_DIE(rdma_resolve_route(ids[1], 2000));
+    expect_event(ec, RDMA_CM_EVENT_ROUTE_RESOLVED, NULL);
+    IF_NULL_DIE(nc[0] = setup_connection(ids[1], cfg));
+    IF_NZERO_DIE(rdma_connect(ids[1], &param));
+
+    expect_event(ec, RDMA_CM_EVENT_CONNECT_REQUEST, &ids[2]);
+    IF_NULL_DIE(nc[1] = setup_connection(ids[2], cfg));
+    IF_NZERO_DIE(rdma_accept(ids[2], &param));
+    // one for each end
+    expect_event(ec, RDMA_CM_EVENT_ESTABLISHED, NULL);
+    expect_event(ec, RDMA_CM_EVENT_ESTABLISHED, NULL);
+}
+
+// handle completions the way the server does: a send returns its slot, a
+// receive is looked at and re-posted
+static void handle(struct connection *nc[2], struct ibv_wc *wcs, int ne,
+                   uint64_t *bytes) {
+    for (int i = 0; i < ne; i++) {
+        struct ibv_wc *wc = &wcs[i];
+        if (wc->status != IBV_WC_SUCCESS) {
+            LOGF("WC error %s wr_id=%lu\n", ibv_wc_status_str(wc->status),
+                 wc->wr_id);
+            die("completion failed");
+        }
+        if (wc->opcode == IBV_WC_SEND) {
+            IF_NZERO_DIE(conn_send_done(nc[0], wc->wr_id));
+            continue;
+        }
+        uint32_t len;
+        int slot = conn_recv_slot(nc[1], wc, &len);
+        *bytes += len;
+        IF_NZERO_DIE(conn_release_recv(nc[1], slot));
+    }
+}
+
+// post <batch> sends from one end to the other, then take the 2 * <batch>
+// completions off the shared cq, <rounds> times. only polls that return
+// completions are timed, waiting for the device is not.
+static void run(const char *name, struct rdma_event_channel *ec,
+                struct addrinfo *ai, struct ibv_context *ctx, int flags,
+                int rounds, int batch) {
+    struct conn_config cfg = {0};
+    cfg.queue_depth = batch;
+    cfg.recv_slots = 2 * batch;
+    cfg.recv_batch = batch / 2 > 0 ? batch / 2 : 1;
+    cfg.signal_every = 1;
+    cfg.cq_ex = flags & EX_CQ_EXTENDED;
+    cfg.scq = create_shared_cq(ctx, 2 * (cfg.queue_depth + cfg.recv_slots),
+                               flags);
+
+    struct rdma_cm_id *ids[3];
+    struct connection *nc[2];
+    connect_loop(ec, ai, &cfg, ids, nc);
+
+    struct poll_acc acc = {0};
+    struct ibv_wc wcs[POLL_BATCH];
+    uint64_t bytes = 0;
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < batch; i++) {
+            char *buf = conn_send_buf(nc[0]);
+            IF_NULL_DIE(buf);
+            msg_hdr_init(buf, MSG_EAGER, MSG_SIZE);
+            IF_NZERO_DIE(conn_post_send(nc[0], MSG_SIZE));
+        }
+
+        for (int got = 0; got < 2 * batch;) {
+            uint64_t t0 = now_ns();
+            int ne = cfg.scq->xcq
+                         ? ex_cq_poll(cfg.scq->xcq, POLL_BATCH, wcs, NULL)
+                         : ibv_poll_cq(cfg.scq->cq, POLL_BATCH, wcs);
+            uint64_t t1 = now_ns();
+            if (ne < 0) die("poll");
+            if (ne == 0) continue;
+            handle(nc, wcs, ne, &bytes);
+            uint64_t t2 = now_ns();
+
+            acc.wcs += ne;
+            acc.polls++;
+            acc.poll_ns += t1 - t0;
+            acc.total_ns += t2 - t0;
+            got += ne;
+        }
+    }
+
+    printf("%s (%lu completions, %lu bytes received)\n", name, acc.wcs,
+           bytes);
+    printf("  poll    %8.1f ns/wc  %6.2f wc/poll\n",
+           (double)acc.poll_ns / acc.wcs, (double)acc.wcs / acc.polls);
+    printf("  handled %8.1f ns/wc\n", (double)acc.total_ns / acc.wcs);
+
+    for (int i = 0; i < 2; i++) {
+        destroy_connection(nc[i]);
+        // destroy_connection() already destroyed the qp
+        ids[i + 1]->qp = NULL;
+    }
+    for (int i = 2; i >= 0; i--) rdma_destroy_id(ids[i]);
+    destroy_shared_cq(cfg.scq);
+}
+
+int main(int argc, char *argv[]) {
+    int opt, rounds = DEFAULT_ROUNDS, batch = DEFAULT_BATCH;
+    while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+        switch (opt) {
+            case 'n':
+                rounds = atoi(optarg);
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (argc - optind != 1 || rounds <= 0 || batch <= 0 || batch > MAX_BATCH)
+        goto usage;
+
+    struct rdma_event_channel *ec = NULL;
+    IF_NULL_DIE(ec = rdma_create_event_channel());
+
+    struct addrinfo *ai;
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    IF_NZERO_DIE(getaddrinfo(argv[optind], NULL, &hints, &ai));
+
+    // a bound id to find the device
+    struct rdma_cm_id *id = NULL;
+    IF_NZERO_DIE(rdma_create_id(ec, &id, NULL, RDMA_PS_TCP));
+    IF_NZERO_DIE(rdma_bind_addr(id, ai->ai_addr));
+    IF_NULL_DIE(id->verbs);
+
+    run("ibv_poll_cq", ec, ai, id->verbs, 0, rounds, batch);
+    run("ibv_start_poll", ec, ai, id->verbs, EX_CQ_EXTENDED, rounds, batch);
+
+    rdma_destroy_id(id);
+    freeaddrinfo(ai);
+    rdma_destroy_event_channel(ec);
+    return 0;
+
+usage:
+    fprintf(stderr,
+            "usage: %s [-n rounds] [-b batch] <local_ip>\n"
+            "  -n rounds  rounds per poll mode (default %d)\n"
+            "  -b batch   sends per round, each also completes a receive "
+            "(default %d, max %d)\n",
+            argv[0], DEFAULT_ROUNDS, DEFAULT_BATCH, MAX_BATCH);
+    return 1;
+}
@@ -0,0 +1,114 @@
+#include "cqwait.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void spin_window_init(struct spin_window *sw, uint64_t max_ns) {
+    sw->max_ns = max_ns;
+    sw->spin_ns = max_ns;
+    sw->avg_gap_ns = 0;
+    sw->last_ns = 0;
+}
+
+void spin_window_arrival(struct spin_window *sw, uint64_t now) {
+    if (sw->last_ns) {
+        uint64_t gap = now - sw->last_ns;
+        // moving average over roughly the last 8 arrivals
+        if (sw->avg_gap_ns == 0)
+            sw->avg_gap_ns = gap;
+        else
+            sw->avg_gap_ns = sw->avg_gap_ns - sw->avg_gap_ns / 8 + gap / 8;
+        // traffic this sparse would make every spin a miss, go to sleep
+        // right away until it picks up again
+        uint64_t spin = 2 * sw->avg_gap_ns;
+        sw->spin_ns = spin <= sw->max_ns ? spin : 0;
+    }
+    sw->last_ns = now;
+}
+
+void cq_waiter_init(struct cq_waiter *w, struct ibv_cq *cq,
+                    struct ibv_comp_channel *cc, uint64_t max_spin_ns) {
+    w->cq = cq;
+    w->cc = cc;
+    w->xcq = NULL;
+    w->timeout_ns = 0;
+    spin_window_init(&w->sw, max_spin_ns);
+    w->unacked = 0;
+    w->spin_hits = 0;
+    w->arm_races = 0;
+    w->sleep_wakeups = 0;
+    w->empty_wakeups = 0;
+}
+
+static int poll_cq(struct cq_waiter *w, int n, struct ibv_wc *wcs) {
+    return w->xcq ? ex_cq_poll(w->xcq, n, wcs, NULL)
+                  : ibv_poll_cq(w->cq, n, wcs);
+}
+
+// wait for at least one completion and return up to n of them, or -1. cc
+// must deliver events for this cq only. with a timeout 0 means nothing
+// completed for that long.
+int cq_wait(struct cq_waiter *w, int n, struct ibv_wc *wcs) {
+    int ne;
+    uint64_t start = now_ns();
+    for (;;) {
+        ne = poll_cq(w, n, wcs);
+        if (ne != 0) {
+            if (ne > 0) w->spin_hits++;
+            goto out;
+        }
+        if (now_ns() - start >= w->sw.spin_ns) break;
+    }
+
+    for (;;) {
+        if (ibv_req_notify_cq(w->cq, 0)) return -1;
+        // a completion that arrived between the last poll and the arm raises
+        // no event, so look once more before sleeping
+        ne = poll_cq(w, n, wcs);
+        if (ne != 0) {
+            if (ne > 0) w->arm_races++;
+            goto out;
+        }
+
+        if (w->timeout_ns) {
+            // the cq stays armed, the event is picked up by the next wait
+            struct pollfd pfd = {.fd = w->cc->fd, .events = POLLIN};
+            int left = (int)((w->timeout_ns + 999999) / 1000000);
+            int ret = poll(&pfd, 1, left);
+            if (ret < 0 && errno != EINTR) return -1;
+            if (ret <= 0) return 0;
+        }
+
+        struct ibv_cq *ev_cq;
+        void *ev_ctx;
+        if (ibv_get_cq_event(w->cc, &ev_cq, &ev_ctx)) return -1;
+        if (++w->unacked >= CQ_ACK_BATCH) {
+            ibv_ack_cq_events(w->cq, w->unacked);
+            w->unacked = 0;
+        }
+        w->sleep_wakeups++;
+
+        ne = poll_cq(w, n, wcs);
+        if (ne != 0) goto out;
+        // the event was raised for completions already taken by an earlier
+        // arm race, arm again
+        w->empty_wakeups++;
+    }
+
+out:
+    if (ne > 0) spin_window_arrival(&w->sw, now_ns());
+    return ne < 0 ? -1 : ne;
+}
+
+// ack what is left, required before the cq is destroyed
+void cq_waiter_finish(struct cq_waiter *w) {
+    if (w->unacked) ibv_ack_cq_events(w->cq, w->unacked);
+    w->unacked = 0;
+}
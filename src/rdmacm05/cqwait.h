@@ -0,0 +1,46 @@
+#ifndef RDMA_CQWAIT_H
+#define RDMA_CQWAIT_H
+
+#include <infiniband/verbs.h>
+#include <stdint.h>
+
+#include "excq.h"
+
+#define SPIN_MAX_NS 50000  // never spin longer than this before sleeping
+#define CQ_ACK_BATCH 64    // ack cq events in batches of this size
+
+// how long to busy-poll before blocking. tracks a moving average of the gap
+// between arrivals and spins for about two gaps when that is affordable.
+struct spin_window {
+    uint64_t max_ns;
+    uint64_t spin_ns;  // current window
+    uint64_t avg_gap_ns;
+    uint64_t last_ns;  // last arrival, 0 before the first
+};
+
+void spin_window_init(struct spin_window *sw, uint64_t max_ns);
+void spin_window_arrival(struct spin_window *sw, uint64_t now);
+uint64_t now_ns(void);
+
+// hybrid completion wait on one cq: poll for the spin window, then arm the
+// cq and block on its completion channel.
+struct cq_waiter {
+    struct ibv_cq *cq;
+    struct ibv_comp_channel *cc;
+    struct ex_cq *xcq;  // polled through this when set
+    struct spin_window sw;
+    uint64_t timeout_ns;   // cq_wait() gives up sleeping after this, 0 never
+    unsigned int unacked;  // events taken but not acked yet
+
+    uint64_t spin_hits;      // completions found while busy-polling
+    uint64_t arm_races;      // found by the poll right after arming
+    uint64_t sleep_wakeups;  // blocked on the channel and woke up
+    uint64_t empty_wakeups;  // woke up to an already drained cq
+};
+
+void cq_waiter_init(struct cq_waiter *w, struct ibv_cq *cq,
+                    struct ibv_comp_channel *cc, uint64_t max_spin_ns);
+int cq_wait(struct cq_waiter *w, int n, struct ibv_wc *wcs);
+void cq_waiter_finish(struct cq_waiter *w);
+
+#endif
@@ -0,0 +1,159 @@
+#include "excq.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "cqwait.h"
+#include "log.h"
+
+const char *ts_source_str(enum ts_source s) {
+    switch (s) {
+        case TS_POLL:
+            return "poll time";
+        case TS_DEVICE:
+            return "device clock";
+        case TS_WALLCLOCK:
+            return "device wallclock";
+        default:
+            return "none";
+    }
+}
+
+// re-anchor the conversion of device stamps to now_ns()
+static void ex_cq_sync(struct ex_cq *xc) {
+    if (xc->source == TS_WALLCLOCK) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        xc->synced = now_ns();
+        xc->wall_off = (int64_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec) -
+                       (int64_t)xc->synced;
+    } else if (xc->source == TS_DEVICE) {
+        struct ibv_values_ex v = {.comp_mask = IBV_VALUES_MASK_RAW_CLOCK};
+        uint64_t before = now_ns();
+        if (ibv_query_rt_values_ex(xc->ctx, &v)) return;
+        uint64_t after = now_ns();
+        // the query sits somewhere between the two reads
+        xc->mono0 = before + (after - before) / 2;
+        xc->raw0 = (uint64_t)v.raw_clock.tv_sec * 1000000000ULL +
+                   (uint64_t)v.raw_clock.tv_nsec;
+        xc->synced = after;
+    }
+}
+
+static int ts_supported(struct ex_cq *xc, enum ts_source source) {
+    if (source != TS_DEVICE) return 1;
+    // converting raw stamps needs the clock rate and a way to read the clock
+    struct ibv_device_attr_ex attr;
+    if (ibv_query_device_ex(xc->ctx, NULL, &attr) ||
+        attr.hca_core_clock == 0)
+        return 0;
+    xc->khz = attr.hca_core_clock;
+    struct ibv_values_ex v = {.comp_mask = IBV_VALUES_MASK_RAW_CLOCK};
+    return ibv_query_rt_values_ex(xc->ctx, &v) == 0;
+}
+
+// with EX_CQ_TIMESTAMPS the best timestamp the device offers, falling back
+// to an ibv_cq_ex without one and then to a plain cq
+struct ibv_cq *ex_cq_create(struct ex_cq *xc, struct ibv_context *ctx,
+                            int cqe, void *cq_context,
+                            struct ibv_comp_channel *cc, int flags) {
+    static const struct {
+        enum ts_source source;
+        uint64_t flag;
+    } tries[] = {
+        {TS_WALLCLOCK, IBV_WC_EX_WITH_COMPLETION_TIMESTAMP_WALLCLOCK},
+        {TS_DEVICE, IBV_WC_EX_WITH_COMPLETION_TIMESTAMP},
+        {TS_POLL, 0},
+    };
+    int stamps = flags & EX_CQ_TIMESTAMPS;
+
+    memset(xc, 0, sizeof(*xc));
+    xc->ctx = ctx;
+    for (size_t i = stamps ? 0 : 2; i < sizeof(tries) / sizeof(tries[0]);
+         i++) {
+        if (!ts_supported(xc, tries[i].source)) continue;
+        struct ibv_cq_init_attr_ex attr = {
+            .cqe = cqe,
+            .cq_context = cq_context,
+            .channel = cc,
+            .wc_flags = IBV_WC_EX_WITH_BYTE_LEN | IBV_WC_EX_WITH_IMM |
+                        IBV_WC_EX_WITH_QP_NUM | tries[i].flag,
+        };
+        xc->cq = ibv_create_cq_ex(ctx, &attr);
+        if (xc->cq == NULL) continue;
+        xc->source = stamps ? tries[i].source : TS_NONE;
+        xc->ibcq = ibv_cq_ex_to_cq(xc->cq);
+        ex_cq_sync(xc);
+        LOGF("cq: ibv_cq_ex, timestamps: %s\n", ts_source_str(xc->source));
+        return xc->ibcq;
+    }
+
+    xc->source = stamps ? TS_POLL : TS_NONE;
+    xc->ibcq = ibv_create_cq(ctx, cqe, cq_context, cc, 0);
+    if (xc->ibcq)
+        LOGF("cq: plain, timestamps: %s\n", ts_source_str(xc->source));
+    return xc->ibcq;
+}
+
+static uint64_t ts_read(struct ex_cq *xc) {
+    if (xc->source == TS_WALLCLOCK)
+        return ibv_wc_read_completion_wallclock_ns(xc->cq) - xc->wall_off;
+    int64_t d = (int64_t)(ibv_wc_read_completion_ts(xc->cq) - xc->raw0);
+    return xc->mono0 + d * 1000000 / (int64_t)xc->khz;
+}
+
+// only what the completion handlers look at. a failed entry has wr_id,
+// status, vendor_err and qp_num, immediate data only matters to receives.
+static void read_wc(struct ibv_cq_ex *cq, struct ibv_wc *wc) {
+    wc->wr_id = cq->wr_id;
+    wc->status = cq->status;
+    wc->qp_num = ibv_wc_read_qp_num(cq);
+    if (wc->status != IBV_WC_SUCCESS) {
+        wc->vendor_err = ibv_wc_read_vendor_err(cq);
+        return;
+    }
+    wc->opcode = ibv_wc_read_opcode(cq);
+    wc->byte_len = ibv_wc_read_byte_len(cq);
+    if (wc->opcode & IBV_WC_RECV) {
+        wc->wc_flags = ibv_wc_read_wc_flags(cq);
+        if (wc->wc_flags & IBV_WC_WITH_IMM)
+            wc->imm_data = ibv_wc_read_imm_data(cq);
+    } else {
+        wc->wc_flags = 0;
+    }
+}
+
+// ibv_poll_cq() that with timestamps also returns the completion time of
+// every entry in ts
+int ex_cq_poll(struct ex_cq *xc, int n, struct ibv_wc *wcs, uint64_t *ts) {
+    if (xc->cq == NULL) {
+        int ne = ibv_poll_cq(xc->ibcq, n, wcs);
+        if (xc->source == TS_POLL && ne > 0) {
+            uint64_t now = now_ns();
+            for (int i = 0; i < ne; i++) ts[i] = now;
+        }
+        return ne;
+    }
+
+    if (xc->source >= TS_DEVICE && now_ns() - xc->synced >= TS_SYNC_NS)
+        ex_cq_sync(xc);
+    struct ibv_poll_cq_attr attr = {0};
+    int ret = ibv_start_poll(xc->cq, &attr);
+    if (ret) return ret == ENOENT ? 0 : -1;
+
+    uint64_t now = xc->source == TS_NONE ? 0 : now_ns();
+    int ne = 0;
+    do {
+        struct ibv_wc *wc = &wcs[ne];
+        read_wc(xc->cq, wc);
+        if (xc->source >= TS_DEVICE && wc->status == IBV_WC_SUCCESS)
+            ts[ne] = ts_read(xc);
+        else if (xc->source != TS_NONE)
+            ts[ne] = now;
+        ne++;
+    } while (ne < n && ibv_next_poll(xc->cq) == 0);
+    ibv_end_poll(xc->cq);
+    // entries read so far are consumed, a failure shows on the next call
+    return ne;
+}
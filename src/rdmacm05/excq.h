@@ -0,0 +1,45 @@
+#ifndef RDMA_EXCQ_H
+#define RDMA_EXCQ_H
+
+#include <infiniband/verbs.h>
+#include <stdint.h>
+
+// a cq polled through ibv_cq_ex when the device has it: ibv_start_poll()
+// and ibv_next_poll() walk the entries in place and only the fields the
+// server looks at are read, instead of ibv_poll_cq() filling every field of
+// every struct ibv_wc. devices without it get a plain cq and ibv_poll_cq().
+
+#define EX_CQ_EXTENDED 1    // poll through ibv_cq_ex when possible
+#define EX_CQ_TIMESTAMPS 2  // stamp every completion, see trace.h
+
+// where completion timestamps come from
+enum ts_source {
+    TS_NONE,       // not asked for
+    TS_POLL,       // now_ns() when the completion is polled
+    TS_DEVICE,     // the device's free running clock
+    TS_WALLCLOCK,  // the device's clock converted to real time by the driver
+};
+
+// device clock to now_ns() conversion is re-anchored this often, the clocks
+// drift apart by up to a few ppm
+#define TS_SYNC_NS 10000000
+
+struct ex_cq {
+    struct ibv_cq_ex *cq;  // NULL for a plain cq
+    struct ibv_cq *ibcq;   // what the qp and the completion channel use
+    struct ibv_context *ctx;
+    enum ts_source source;
+    uint64_t khz;      // device clock rate, TS_DEVICE
+    uint64_t raw0;     // device clock at mono0
+    uint64_t mono0;
+    int64_t wall_off;  // CLOCK_REALTIME - now_ns(), TS_WALLCLOCK
+    uint64_t synced;   // now_ns() of the last anchor
+};
+
+struct ibv_cq *ex_cq_create(struct ex_cq *xc, struct ibv_context *ctx,
+                            int cqe, void *cq_context,
+                            struct ibv_comp_channel *cc, int flags);
+int ex_cq_poll(struct ex_cq *xc, int n, struct ibv_wc *wcs, uint64_t *ts);
+const char *ts_source_str(enum ts_source s);
+
+#endif
@@ -0,0 +1,412 @@
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+enum arg_kind { ARG_INT, ARG_UINT, ARG_CHAR, ARG_DOUBLE, ARG_STR, ARG_PTR };
+enum len_mod { LM_NONE, LM_HH, LM_H, LM_L, LM_LL, LM_Z, LM_J, LM_T, LM_LD };
+
+// one conversion of a format, parsed the same way by the caller to store
+// its arguments and by the writer to print them
+struct conv {
+    const char *start;  // the '%'
+    const char *mod;    // the length modifier, dropped when printing
+    const char *end;    // one past the conversion character
+    int stars;          // '*' width and precision, each an int argument
+    int prec;           // -1 without, -2 for '*'
+    enum len_mod lm;
+    enum arg_kind kind;
+    int print;  // 0 for %n, which only consumes its pointer
+};
+
+union log_arg {
+    int64_t i;
+    uint64_t u;
+    double d;
+};
+
+struct log_record {
+    uint64_t tsc;
+    const char *format;
+    int nargs;  // values stored, '*' ones included
+    union log_arg args[LOG_MAX_ARGS];
+    char strs[LOG_STR_BYTES];  // %s arguments, offsets are in args
+};
+
+// single producer, the owning thread, and single consumer, the writer
+struct log_ring {
+    unsigned int head __attribute__((aligned(64)));
+    uint64_t dropped;
+    unsigned int tail __attribute__((aligned(64)));
+    uint64_t reported;  // drops already written out
+    struct log_ring *next;
+    struct log_record recs[LOG_RING_SIZE];
+};
+
+static __thread struct log_ring *t_ring;
+static struct log_ring *g_rings;  // only ever prepended to
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static pthread_t g_writer;
+static int g_stop;
+
+// timestamps are raw ticks, converted to wall clock time by the writer
+static uint64_t g_tsc0;
+static uint64_t g_mono0_ns;
+static uint64_t g_real0_ns;
+static double g_ns_per_tick = 1.0;
+
+static uint64_t clock_ns(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t read_tsc(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return clock_ns(CLOCK_MONOTONIC);
+#endif
+}
+
+// parse the conversion at p, which points at a '%' that is not "%%".
+// returns 0 for a conversion this logger does not know.
+static int parse_conv(const char *p, struct conv *c) {
+    memset(c, 0, sizeof(*c));
+    c->start = p++;
+    c->prec = -1;
+    c->print = 1;
+    while (*p && strchr("-+ #0'", *p)) p++;
+    if (*p == '*') {
+        c->stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') p++;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            c->stars++;
+            c->prec = -2;
+            p++;
+        } else {
+            c->prec = 0;
+            while (*p >= '0' && *p <= '9') c->prec = c->prec * 10 + *p++ - '0';
+        }
+    }
+
+    c->mod = p;
+    switch (*p) {
+        case 'h':
+            c->lm = p[1] == 'h' ? LM_HH : LM_H;
+            p += p[1] == 'h' ? 2 : 1;
+            break;
+        case 'l':
+            c->lm = p[1] == 'l' ? LM_LL : LM_L;
+            p += p[1] == 'l' ? 2 : 1;
+            break;
+        case 'z': c->lm = LM_Z; p++; break;
+        case 'j': c->lm = LM_J; p++; break;
+        case 't': c->lm = LM_T; p++; break;
+        case 'L': c->lm = LM_LD; p++; break;
+    }
+
+    switch (*p) {
+        case 'd':
+        case 'i':
+            c->kind = ARG_INT;
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            c->kind = ARG_UINT;
+            break;
+        case 'c':
+            c->kind = ARG_CHAR;
+            break;
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A':
+            c->kind = ARG_DOUBLE;
+            break;
+        case 's':
+            c->kind = ARG_STR;
+            break;
+        case 'p':
+            c->kind = ARG_PTR;
+            break;
+        case 'n':
+            c->kind = ARG_PTR;
+            c->print = 0;
+            break;
+        default:
+            return 0;
+    }
+    c->end = p + 1;
+    return 1;
+}
+
+static int64_t fetch_int(va_list *ap, enum len_mod lm) {
+    switch (lm) {
+        case LM_HH: return (signed char)va_arg(*ap, int);
+        case LM_H: return (short)va_arg(*ap, int);
+        case LM_L: return va_arg(*ap, long);
+        case LM_LL: return va_arg(*ap, long long);
+        case LM_Z: return va_arg(*ap, ssize_t);
+        case LM_J: return va_arg(*ap, intmax_t);
+        case LM_T: return va_arg(*ap, ptrdiff_t);
+        default: return va_arg(*ap, int);
+    }
+}
+
+static uint64_t fetch_uint(va_list *ap, enum len_mod lm) {
+    switch (lm) {
+        case LM_HH: return (unsigned char)va_arg(*ap, unsigned int);
+        case LM_H: return (unsigned short)va_arg(*ap, unsigned int);
+        case LM_L: return va_arg(*ap, unsigned long);
+        case LM_LL: return va_arg(*ap, unsigned long long);
+        case LM_Z: return va_arg(*ap, size_t);
+        case LM_J: return va_arg(*ap, uintmax_t);
+        case LM_T: return (uint64_t)va_arg(*ap, ptrdiff_t);
+        default: return va_arg(*ap, unsigned int);
+    }
+}
+
+static void calibrate(void) {
+    uint64_t tsc = read_tsc(), mono = clock_ns(CLOCK_MONOTONIC);
+    if (mono - g_mono0_ns > 0 && tsc != g_tsc0)
+        g_ns_per_tick = (double)(mono - g_mono0_ns) / (double)(tsc - g_tsc0);
+}
+
+// print one record as one line, the format decides how its values are read
+static void write_record(const struct log_record *r) {
+    char line[1024], spec[32];
+    size_t n = 0;
+
+    uint64_t ns = g_real0_ns + (uint64_t)((double)(r->tsc - g_tsc0) *
+                                          g_ns_per_tick);
+    time_t sec = ns / 1000000000ULL;
+    static time_t last_sec = -1;
+    static char sec_str[32];
+    if (sec != last_sec) {
+        struct tm tm_info;
+        localtime_r(&sec, &tm_info);
+        strftime(sec_str, sizeof(sec_str), "%Y-%m-%d %H:%M:%S", &tm_info);
+        last_sec = sec;
+    }
+    n += snprintf(line, sizeof(line), "%s.%06lu ", sec_str,
+                  (unsigned long)(ns % 1000000000ULL / 1000));
+
+    int a = 0;
+    for (const char *p = r->format; *p && n < sizeof(line) - 1;) {
+        struct conv c;
+        if (*p != '%' || p[1] == '%' || !parse_conv(p, &c)) {
+            line[n++] = *p;
+            p += (*p == '%' && p[1] == '%') ? 2 : 1;
+            continue;
+        }
+        p = c.end;
+        if (a + c.stars + 1 > r->nargs) {
+            // the record ran out of room for values
+            line[n++] = '?';
+            continue;
+        }
+
+        // drop the length modifier, every value is passed at full width
+        size_t head = c.mod - c.start, len;
+        if (head > sizeof(spec) - 4) head = sizeof(spec) - 4;
+        memcpy(spec, c.start, head);
+        len = head;
+        if (c.kind == ARG_INT || c.kind == ARG_UINT) {
+            spec[len++] = 'l';
+            spec[len++] = 'l';
+        }
+        spec[len++] = c.end[-1];
+        spec[len] = '\0';
+
+        int w1 = c.stars > 0 ? (int)r->args[a].i : 0;
+        int w2 = c.stars > 1 ? (int)r->args[a + 1].i : 0;
+        union log_arg v = r->args[a + c.stars];
+        a += c.stars + 1;
+        if (!c.print) continue;
+
+        char *out = line + n;
+        size_t room = sizeof(line) - n;
+        int ret = 0;
+#define PRINT_ARG(val)                                               \
+    (c.stars == 2   ? snprintf(out, room, spec, w1, w2, val)         \
+     : c.stars == 1 ? snprintf(out, room, spec, w1, val)             \
+                    : snprintf(out, room, spec, val))
+        switch (c.kind) {
+            case ARG_INT: ret = PRINT_ARG((long long)v.i); break;
+            case ARG_UINT: ret = PRINT_ARG((unsigned long long)v.u); break;
+            case ARG_CHAR: ret = PRINT_ARG((int)v.i); break;
+            case ARG_DOUBLE: ret = PRINT_ARG(v.d); break;
+            case ARG_STR: ret = PRINT_ARG(r->strs + v.u); break;
+            case ARG_PTR: ret = PRINT_ARG((void *)(uintptr_t)v.u); break;
+        }
+#undef PRINT_ARG
+        if (ret > 0) n += (size_t)ret < room ? (size_t)ret : room - 1;
+    }
+    if (n >= sizeof(line)) n = sizeof(line) - 1;
+    fwrite(line, 1, n, stdout);
+}
+
+// write out everything the rings hold, returns how many records that was
+static int drain(void) {
+    int count = 0;
+    calibrate();
+    for (struct log_ring *ring = __atomic_load_n(&g_rings, __ATOMIC_ACQUIRE);
+         ring != NULL; ring = ring->next) {
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned int tail = ring->tail;
+        for (; tail != head; tail++, count++)
+            write_record(&ring->recs[tail % LOG_RING_SIZE]);
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            fprintf(stdout, "log: %lu records dropped\n",
+                    (unsigned long)(dropped - ring->reported));
+            ring->reported = dropped;
+            count++;
+        }
+    }
+    if (count > 0) fflush(stdout);
+    return count;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    struct timespec idle = {0, LOG_FLUSH_US * 1000L};
+    while (!__atomic_load_n(&g_stop, __ATOMIC_ACQUIRE)) {
+        if (drain() == 0) nanosleep(&idle, NULL);
+    }
+    drain();
+    return NULL;
+}
+
+// flush what is left when the process exits
+static void log_shutdown(void) {
+    __atomic_store_n(&g_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(g_writer, NULL);
+}
+
+static void log_init(void) {
+    g_tsc0 = read_tsc();
+    g_mono0_ns = clock_ns(CLOCK_MONOTONIC);
+    g_real0_ns = clock_ns(CLOCK_REALTIME);
+    // a first tick rate, the writer refines it as time goes by
+    struct timespec ts = {0, 10 * 1000 * 1000};
+    nanosleep(&ts, NULL);
+    calibrate();
+
+    if (pthread_create(&g_writer, NULL, writer_main, NULL)) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    atexit(log_shutdown);
+}
+
+static struct log_ring *thread_ring(void) {
+    struct log_ring *ring;
+    if (posix_memalign((void **)&ring, 64, sizeof(*ring))) return NULL;
+    memset(ring, 0, sizeof(*ring));
+    pthread_mutex_lock(&g_rings_lock);
+    ring->next = g_rings;
+    __atomic_store_n(&g_rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_rings_lock);
+    return ring;
+}
+
+// level only decides at compile time whether the call exists at all
+void log_write(int level, const char *format, ...) {
+    (void)level;
+    pthread_once(&g_once, log_init);
+    if (t_ring == NULL && (t_ring = thread_ring()) == NULL) return;
+
+    struct log_ring *ring = t_ring;
+    unsigned int head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+        LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct log_record *r = &ring->recs[head % LOG_RING_SIZE];
+    r->tsc = read_tsc();
+    r->format = format;
+    r->nargs = 0;
+    r->strs[LOG_STR_BYTES - 1] = '\0';  // where strings go when out of room
+    size_t used = 0;
+
+    va_list ap;
+    va_start(ap, format);
+    for (const char *p = format; *p; p++) {
+        struct conv c;
+        if (*p != '%') continue;
+        if (p[1] == '%') {
+            p++;
+            continue;
+        }
+        if (!parse_conv(p, &c)) continue;
+        p = c.end - 1;
+        // a conversion is stored whole or not at all, the writer prints '?'
+        if (r->nargs + c.stars + 1 > LOG_MAX_ARGS) break;
+
+        int prec = c.prec;
+        for (int i = 0; i < c.stars; i++) {
+            int v = va_arg(ap, int);
+            if (i == c.stars - 1 && c.prec == -2) prec = v;
+            r->args[r->nargs++].i = v;
+        }
+        union log_arg *v = &r->args[r->nargs++];
+        switch (c.kind) {
+            case ARG_INT:
+            case ARG_CHAR:
+                v->i = fetch_int(&ap, c.kind == ARG_CHAR ? LM_NONE : c.lm);
+                break;
+            case ARG_UINT:
+                v->u = fetch_uint(&ap, c.lm);
+                break;
+            case ARG_DOUBLE:
+                v->d = c.lm == LM_LD ? (double)va_arg(ap, long double)
+                                     : va_arg(ap, double);
+                break;
+            case ARG_PTR:
+                v->u = (uintptr_t)va_arg(ap, void *);
+                break;
+            case ARG_STR: {
+                // the caller's buffer may be reused at once, keep a copy
+                const char *s = va_arg(ap, const char *);
+                size_t room = LOG_STR_BYTES - 1 - used;
+                if (s == NULL) s = "(null)";
+                if (room == 0) {
+                    v->u = LOG_STR_BYTES - 1;
+                    break;
+                }
+                size_t max = room - 1;
+                if (prec >= 0 && (size_t)prec < max) max = prec;
+                size_t len = strnlen(s, max);
+                memcpy(r->strs + used, s, len);
+                r->strs[used + len] = '\0';
+                v->u = used;
+                used += len + 1;
+                break;
+            }
+        }
+    }
+    va_end(ap);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
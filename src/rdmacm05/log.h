@@ -0,0 +1,42 @@
+#ifndef RDMA_LOG_H
+#define RDMA_LOG_H
+
+#include <stdint.h>
+
+// asynchronous logging. a call stores a binary record, the raw timestamp,
+// the format pointer and the arguments, in a lock-free ring of the calling
+// thread. a background thread formats the records and writes them to
+// stdout. when a ring is full the record is dropped and counted, logging
+// never blocks the caller.
+
+#define LOG_LVL_DEBUG 0
+#define LOG_LVL_INFO 1
+
+// records below this level are compiled out, build with LOG_LEVEL=0 to get
+// per-message logs
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LVL_INFO
+#endif
+
+#define LOG_RING_SIZE 1024  // records per thread, a power of two
+#define LOG_MAX_ARGS 12     // values per record, conversions past it print ?
+#define LOG_STR_BYTES 128   // bytes of %s arguments per record
+#define LOG_FLUSH_US 1000   // how long the writer sleeps when idle
+
+void log_write(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define LOG(msg) log_write(LOG_LVL_INFO, "%s\n", (msg))
+#define LOGF(...) log_write(LOG_LVL_INFO, __VA_ARGS__)
+
+#if LOG_LEVEL <= LOG_LVL_DEBUG
+#define LOGD(...) log_write(LOG_LVL_DEBUG, __VA_ARGS__)
+#else
+// still type checked, but never evaluated
+#define LOGD(...)                                      \
+    do {                                               \
+        if (0) log_write(LOG_LVL_DEBUG, __VA_ARGS__); \
+    } while (0)
+#endif
+
+#endif
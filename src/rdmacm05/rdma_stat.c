@@ -0,0 +1,168 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// samples the stats region of a running server and prints rates
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-i interval_s] [-c count] <pid>\n"
+            "  -i interval_s  seconds between samples (default 1)\n"
+            "  -c count       stop after <count> samples, 0 for never "
+            "(default 0)\n",
+            prog);
+    exit(1);
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// counters are read field by field with relaxed loads, a sample is not one
+// instant but every value in it is whole
+static void sample(const struct stats_region *r, struct stats_region *s) {
+    const uint64_t *src = (const uint64_t *)r;
+    uint64_t *dst = (uint64_t *)s;
+    for (size_t i = 0; i < sizeof(*r) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+static void print_workers(const struct stats_region *a,
+                          const struct stats_region *b, double dt) {
+    printf("%-6s %10s %8s %8s %10s %8s %8s %8s %6s %6s\n", "worker",
+           "wakeups/s", "spin%", "cqev/s", "polls/s", "empty%", "wc/poll",
+           "wc/s", "errs", "rnr");
+    for (int i = -1; i < (int)b->nworkers; i++) {
+        const struct worker_stats *x = i < 0 ? &a->cm : &a->workers[i];
+        const struct worker_stats *y = i < 0 ? &b->cm : &b->workers[i];
+        // the cm thread only has a row of its own when it runs apart
+        if (i < 0 && y->epoll_wakeups == 0) continue;
+
+        uint64_t wakeups = y->epoll_wakeups - x->epoll_wakeups;
+        uint64_t polls = y->polls - x->polls;
+        uint64_t wcs = y->completions - x->completions;
+        char name[16];
+        snprintf(name, sizeof(name), i < 0 ? "cm" : "%d", i);
+        printf("%-6s %10.0f %8.1f %8.0f %10.0f %8.1f %8.2f %8.0f %6lu "
+               "%6lu\n",
+               name, wakeups / dt,
+               wakeups ? 100.0 * (y->spin_hits - x->spin_hits) / wakeups : 0,
+               (y->cq_events - x->cq_events) / dt, polls / dt,
+               polls ? 100.0 * (y->empty_polls - x->empty_polls) / polls : 0,
+               polls ? (double)wcs / polls : 0, wcs / dt,
+               (unsigned long)y->wc_errors, (unsigned long)y->rnr_errors);
+    }
+}
+
+// work requests per ibv_post_* call over the interval
+static double per_post(uint64_t wrs, uint64_t posts) {
+    return posts ? (double)wrs / posts : 0;
+}
+
+static void print_conns(const struct stats_region *a,
+                        const struct stats_region *b, double dt) {
+    printf("%-8s %6s %10s %9s %10s %9s %8s %4s %4s %7s %7s %8s %6s %6s\n",
+           "qp", "worker", "msgs_in/s", "MB_in/s", "msgs_out/s", "MB_out/s",
+           "reads/s", "sq", "rq", "sq/post", "rq/post", "stalls/s", "errs",
+           "rnr");
+    for (int i = 0; i < STATS_MAX_CONNS; i++) {
+        const struct conn_stats *x = &a->conns[i], *y = &b->conns[i];
+        if (!y->in_use) continue;
+        // an entry taken over by another connection starts from zero
+        struct conn_stats zero = {0};
+        if (!x->in_use || x->gen != y->gen) x = &zero;
+
+        printf("%-8u %6d %10.0f %9.2f %10.0f %9.2f %8.0f %4u %4u %7.2f "
+               "%7.2f %8.0f %6lu %6lu\n",
+               y->qp_num, y->worker, (y->msgs_in - x->msgs_in) / dt,
+               (y->bytes_in - x->bytes_in) / dt / 1e6,
+               (y->msgs_out - x->msgs_out) / dt,
+               (y->bytes_out - x->bytes_out) / dt / 1e6,
+               (y->reads - x->reads) / dt, y->sq_used, y->rq_posted,
+               per_post(y->send_wrs - x->send_wrs,
+                        y->send_posts - x->send_posts),
+               per_post(y->recv_wrs - x->recv_wrs,
+                        y->recv_posts - x->recv_posts),
+               (y->credit_stalls - x->credit_stalls) / dt,
+               (unsigned long)y->wc_errors, (unsigned long)y->rnr_errors);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int opt, count = 0;
+    double interval = 1.0;
+    while ((opt = getopt(argc, argv, "i:c:")) != -1) {
+        switch (opt) {
+            case 'i':
+                interval = atof(optarg);
+                if (interval <= 0) usage(argv[0]);
+                break;
+            case 'c':
+                count = atoi(optarg);
+                if (count < 0) usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) usage(argv[0]);
+
+    char name[64];
+    snprintf(name, sizeof(name), STATS_NAME_FMT, atoi(argv[optind]));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(name);
+        exit(1);
+    }
+    const struct stats_region *r = mmap(NULL, sizeof(*r), PROT_READ,
+                                        MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        r->version != STATS_VERSION) {
+        fprintf(stderr, "%s: not a stats region of this version\n", name);
+        exit(1);
+    }
+
+    struct stats_region *prev = malloc(sizeof(*prev));
+    struct stats_region *cur = malloc(sizeof(*cur));
+    if (prev == NULL || cur == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sample(r, prev);
+    double t0 = now_sec();
+    for (int n = 0; count == 0 || n < count; n++) {
+        struct timespec ts = {(time_t)interval,
+                              (long)((interval - (time_t)interval) * 1e9)};
+        nanosleep(&ts, NULL);
+        sample(r, cur);
+        double t1 = now_sec();
+
+        printf("\npid %d, last %.1f s\n", (int)cur->pid, t1 - t0);
+        print_workers(prev, cur, t1 - t0);
+        printf("\n");
+        print_conns(prev, cur, t1 - t0);
+        fflush(stdout);
+
+        struct stats_region *tmp = prev;
+        prev = cur;
+        cur = tmp;
+        t0 = t1;
+    }
+
+    free(prev);
+    free(cur);
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include "rndv.h"
+
+// max_len of 0 means RNDV_MAX_LEN, a single read never goes above 4 GiB
+void rndv_init(struct rndv_state *rs, size_t threshold, size_t max_len) {
+    memset(rs, 0, sizeof(*rs));
+    if (threshold == 0 || threshold > RNDV_THRESHOLD)
+        threshold = RNDV_THRESHOLD;
+    rs->threshold = threshold;
+    if (max_len == 0) max_len = RNDV_MAX_LEN;
+    if (max_len > UINT32_MAX) max_len = UINT32_MAX;
+    rs->max_len = max_len;
+}
+
+void rndv_destroy(struct rndv_state *rs) {
+    for (int i = 0; i < RNDV_SLOTS; i++) {
+        if (rs->in[i].used) rndv_in_free(&rs->in[i]);
+    }
+}
+
+// a control message through the send ring, -1 when it is full
+static int send_ctrl(struct connection *nc, const void *msg, uint32_t len) {
+    char *buf = conn_send_buf(nc);
+    if (buf == NULL) return -1;
+    memcpy(buf, msg, len);
+    return conn_post_send(nc, len);
+}
+
+// offer buf, which mr must cover with remote read access. cookie comes back
+// from rndv_on_fin() once the peer is done. returns -1 when RNDV_SLOTS
+// offers are pending or the send ring is full.
+int rndv_send(struct connection *nc, struct rndv_state *rs, void *buf,
+              size_t len, struct ibv_mr *mr, void *cookie) {
+    struct rndv_out *out = NULL;
+    for (int i = 0; i < RNDV_SLOTS && out == NULL; i++) {
+        if (!rs->out[i].used) out = &rs->out[i];
+    }
+    if (out == NULL) return -1;
+
+    struct rndv_rts rts;
+    msg_hdr_init(&rts, MSG_RNDV_RTS, sizeof(rts));
+    rts.addr = htobe64((uintptr_t)buf);
+    rts.len = htobe64(len);
+    rts.rkey = htonl(mr->rkey);
+    rts.id = htonl(rs->next_id);
+    int ret = send_ctrl(nc, &rts, sizeof(rts));
+    if (ret) return ret;
+
+    out->used = 1;
+    out->id = rs->next_id++;
+    out->cookie = cookie;
+    return 0;
+}
+
+static int send_fin(struct connection *nc, uint32_t peer_id,
+                    uint32_t status) {
+    struct rndv_fin fin;
+    msg_hdr_init(&fin, MSG_RNDV_FIN, sizeof(fin));
+    fin.id = htonl(peer_id);
+    fin.status = htonl(status);
+    return send_ctrl(nc, &fin, sizeof(fin));
+}
+
+// the peer is done with an offer: 0 when it read it, 1 when it refused it,
+// -1 for an id that is not pending. either way the buffer is free again.
+int rndv_on_fin(struct rndv_state *rs, const void *msg, uint32_t len,
+                void **cookie) {
+    struct rndv_fin fin;
+    if (len < sizeof(fin)) return -1;
+    memcpy(&fin, msg, sizeof(fin));
+    uint32_t id = ntohl(fin.id);
+
+    for (int i = 0; i < RNDV_SLOTS; i++) {
+        struct rndv_out *out = &rs->out[i];
+        if (out->used && out->id == id) {
+            out->used = 0;
+            *cookie = out->cookie;
+            return ntohl(fin.status) == RNDV_FIN_REFUSED;
+        }
+    }
+    return -1;
+}
+
+// start pulling an offered payload into *in. the message may be released
+// once this returns. returns -1 when RNDV_SLOTS reads are pending or the
+// send ring is full, the caller should retry later. an offer above max_len
+// or one there is no memory for is refused: *in is NULL, the peer gets a
+// refusing MSG_RNDV_FIN and 0 is returned.
+int rndv_on_rts(struct connection *nc, struct rndv_state *rs, const void *msg,
+                uint32_t len, struct rndv_in **in) {
+    struct rndv_rts rts;
+    *in = NULL;
+    if (len < sizeof(rts)) return -1;
+    memcpy(&rts, msg, sizeof(rts));
+
+    struct rndv_in *slot = NULL;
+    for (int i = 0; i < RNDV_SLOTS && slot == NULL; i++) {
+        if (!rs->in[i].used) slot = &rs->in[i];
+    }
+    // the read or the refusal needs a send slot, do not allocate for nothing
+    if (slot == NULL || conn_send_buf(nc) == NULL) return -1;
+
+    uint32_t peer_id = ntohl(rts.id);
+    uint64_t plen = be64toh(rts.len);
+    if (plen > rs->max_len) return send_fin(nc, peer_id, RNDV_FIN_REFUSED);
+
+    memset(slot, 0, sizeof(*slot));
+    slot->peer_id = peer_id;
+    slot->len = plen;
+    slot->buf = malloc(plen ? plen : 1);
+    if (slot->buf)
+        slot->mr = ibv_reg_mr(nc->pd, slot->buf, plen ? plen : 1,
+                              IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+    if (slot->mr == NULL) {
+        rndv_in_free(slot);
+        return send_fin(nc, peer_id, RNDV_FIN_REFUSED);
+    }
+    slot->seq = nc->send_head;
+    IF_NZERO_DIE(conn_post_read(nc, slot->buf, slot->mr->lkey,
+                                be64toh(rts.addr), ntohl(rts.rkey),
+                                (uint32_t)plen));
+    slot->used = 1;
+    *in = slot;
+    return 0;
+}
+
+// the IBV_WC_RDMA_READ completion with this wr_id, NULL if it was no pull
+struct rndv_in *rndv_read_done(struct rndv_state *rs, uint64_t wr_id) {
+    for (int i = 0; i < RNDV_SLOTS; i++) {
+        struct rndv_in *in = &rs->in[i];
+        if (in->used && !in->ready && in->seq == (unsigned int)wr_id) {
+            in->ready = 1;
+            return in;
+        }
+    }
+    return NULL;
+}
+
+// let the peer reuse its buffer, -1 when the send ring is full
+int rndv_send_fin(struct connection *nc, struct rndv_in *in) {
+    int ret = send_fin(nc, in->peer_id, RNDV_FIN_DONE);
+    if (ret == 0) in->fin_sent = 1;
+    return ret;
+}
+
+void rndv_in_free(struct rndv_in *in) {
+    if (in->mr) ibv_dereg_mr(in->mr);
+    free(in->buf);
+    memset(in, 0, sizeof(*in));
+}
@@ -0,0 +1,75 @@
+#ifndef RDMA_RNDV_H
+#define RDMA_RNDV_H
+
+#include "common.h"
+
+// rendezvous for messages that do not fit a ring buffer. the sender offers
+// a registered buffer with MSG_RNDV_RTS, the receiver pulls it with an
+// rdma read into a buffer sized for it and answers MSG_RNDV_FIN, after
+// which the sender may reuse its buffer. an offer the receiver can not
+// take is answered with a refusing MSG_RNDV_FIN instead.
+
+#define RNDV_SLOTS 16
+// largest payload sent eagerly, larger ones go through rendezvous
+#define RNDV_THRESHOLD (BUFFER_SIZE - MSG_HDR_SIZE)
+// largest offer pulled by default, the peer's length is never trusted
+#define RNDV_MAX_LEN (1UL << 30)
+
+#define RNDV_FIN_DONE 0     // the payload was read
+#define RNDV_FIN_REFUSED 1  // too large or no memory for it, never read
+
+struct rndv_rts {
+    struct msg_hdr hdr;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t rkey;
+    uint32_t id;
+} __attribute__((packed));
+
+struct rndv_fin {
+    struct msg_hdr hdr;
+    uint32_t id;
+    uint32_t status;  // RNDV_FIN_
+} __attribute__((packed));
+
+// a buffer this side offered that the peer has not finished reading
+struct rndv_out {
+    int used;
+    uint32_t id;
+    void *cookie;
+};
+
+// a payload this side pulls from the peer
+struct rndv_in {
+    int used;
+    int ready;     // the read completed, buf holds the payload
+    int fin_sent;  // the peer was told it may reuse its buffer
+    int stage;     // owned by the application
+    uint32_t peer_id;
+    unsigned int seq;  // send sequence number of the read
+    char *buf;
+    size_t len;
+    struct ibv_mr *mr;  // local write and remote read, buf can be offered on
+};
+
+struct rndv_state {
+    size_t threshold;
+    size_t max_len;  // larger offers are refused
+    uint32_t next_id;
+    struct rndv_out out[RNDV_SLOTS];
+    struct rndv_in in[RNDV_SLOTS];
+};
+
+void rndv_init(struct rndv_state *rs, size_t threshold, size_t max_len);
+void rndv_destroy(struct rndv_state *rs);
+int rndv_send(struct connection *nc, struct rndv_state *rs, void *buf,
+              size_t len, struct ibv_mr *mr, void *cookie);
+int rndv_on_fin(struct rndv_state *rs, const void *msg, uint32_t len,
+                void **cookie);
+int rndv_on_rts(struct connection *nc, struct rndv_state *rs, const void *msg,
+                uint32_t len, struct rndv_in **in);
+struct rndv_in *rndv_read_done(struct rndv_state *rs, uint64_t wr_id);
+int rndv_send_fin(struct connection *nc, struct rndv_in *in);
+void rndv_in_free(struct rndv_in *in);
+
+#endif
@@ -1,20 +1,66 @@
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <rdma/rdma_cma.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <signal.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 
+#include "coalesce.h"
 #include "common.h"
+#include "connpool.h"
+#include "cqwait.h"
+#include "rndv.h"
+#include "ud.h"
+
+#define MAX_EVENTS 16
+#define MAX_DEVICES 16
+#define MAX_WORKERS 64
+#define SHARED_CQE 4096
+#define POLL_BATCH 16
 
 static volatile int keep_running = 1;
-static int epoll_fd = 0;
+static struct conn_config g_config;
+
+// per-worker shared cq of this many entries when started with -c or -w
+static int g_shared_cqe = 0;
+// per-worker srq when started with -S
+static int g_srq = 0;
+static int g_srq_slots = SRQ_SLOTS;
+static int g_srq_max = SRQ_MAX_SLOTS;
+// registered buffer pool per device when started with -P
+static int g_pool_slices = 0;
+static int g_pool_flags = 0;
+// longest busy-poll of the epoll set before blocking in it
+static long g_spin_ns = SPIN_MAX_NS;
+// pre-warmed connections per worker and device when started with -A
+static int g_prewarm = 0;
+// one ud qp per worker and device instead of connections with -U
+static int g_ud = 0;
 
 static void sigint_handle(int s) {
     (void)s;
     keep_running = 0;
 }
 
-#define MAX_EVENTS 16
+// SIGUSR1 asks every worker to dump its stage latencies when tracing
+static volatile sig_atomic_t g_trace_dumps = 0;
+
+static void sigusr1_handle(int s) {
+    (void)s;
+    g_trace_dumps++;
+}
+
+// how long accepting takes with -t, recorded and dumped by the cm thread
+enum accept_span {
+    ACCEPT_POSTED,       // connect request until rdma_accept() returned
+    ACCEPT_ESTABLISHED,  // connect request until established
+    ACCEPT_SPANS,
+};
+
+static struct trace_hist g_accept[ACCEPT_SPANS];
+static unsigned int g_accept_dumps = 0;
 
 enum conn_state {
     ACCEPTING,
@@ -22,35 +68,354 @@ enum conn_state {
     DISCONNECTED,
 };
 
+// messages from the cm thread to a worker
+enum mail_type {
+    MAIL_ADD,        // start serving a connection
+    MAIL_DEL,        // tear a connection down
+    MAIL_SRQ_LIMIT,  // the worker's srq reached its limit
+};
+
+struct mail {
+    enum mail_type type;
+    void *ptr;
+    struct mail *next;
+};
+
+// cq and srq a worker owns on one device
+struct worker_dev {
+    struct ibv_context *ctx;
+    struct shared_cq *scq;
+    struct srq *srq;
+    struct conn_pool *pool;  // pre-warmed connections with -A
+    struct ud_ep *ud;        // with -U, created on the first request
+};
+
+// every connection belongs to exactly one worker, which polls its cq,
+// echoes its messages and tears it down. the cm thread only hands
+// connections over through the mailbox.
+struct worker {
+    int index;
+    pthread_t thread;
+    int epoll_fd;
+    int event_fd;  // rings when mail arrives
+    int nconns;    // connections assigned, read by the cm thread
+
+    pthread_mutex_t lock;
+    struct mail *mail_head;
+    struct mail *mail_tail;
+
+    // written by the cm thread before any connection uses them
+    struct worker_dev devs[MAX_DEVICES];
+    int ndevs;
+
+    struct spin_window spin;
+    struct worker_stats *stats;  // in the shared stats region
+    struct trace *trace;         // stage latencies with -t, else NULL
+
+    // connections whose sends the current poll batch queued with -D
+    struct connection *chained[POLL_BATCH];
+    int nchained;
+};
+
+struct pending_reply {
+    int slot;
+    uint32_t len;
+    uint64_t since;  // when the handler first saw it, with -t
+};
+
 struct conn_context {
     struct rdma_cm_id *id;
-    struct ibv_comp_channel *cc;
     struct connection *conn;
+    struct worker *worker;
     enum conn_state state;
+    uint64_t requested;  // when the connect request was read, with -t
+
+    // received slots waiting for a free send slot, in arrival order. a
+    // private ring bounds them to recv_slots, with an srq it grows.
+    struct pending_reply *backlog;
+    int backlog_cap;
+    int backlog_head;
+    int backlog_len;
+
+    // large messages pulled from the client and echoed back the same way
+    struct rndv_state rndv;
 };
 
-void handle_new_request(void *arg) {
-    struct conn_context *cctx = arg;
+static struct worker g_workers[MAX_WORKERS];
+static struct stats_region *g_stats;
+_Static_assert(MAX_WORKERS <= STATS_MAX_WORKERS, "stats has no room");
+static int g_num_workers = 0;
+static int g_threaded = 0;
+static int g_least_loaded = 0;
+static int g_next_worker = 0;
 
-    struct connection *nc = NULL;
-    IF_NULL_DIE(nc = setup_connection(cctx->id));
-    cctx->conn = nc;
+// epoll fd of the cm thread, the same as worker 0's without -w
+static int cm_epoll_fd = -1;
+
+// devices whose async event fd is registered with the cm thread
+static struct device *g_async_devs[MAX_DEVICES];
+static int g_num_async_devs = 0;
+
+static void watch_device(struct device *dev) {
+    for (int i = 0; i < g_num_async_devs; i++) {
+        if (g_async_devs[i] == dev) return;
+    }
+    if (g_num_async_devs == MAX_DEVICES) die("Too many devices");
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = dev;
+    if (epoll_ctl(cm_epoll_fd, EPOLL_CTL_ADD, dev->ctx->async_fd, &ev))
+        die("Failed to register async event fd");
+    g_async_devs[g_num_async_devs++] = dev;
+}
+
+static struct device *async_source(void *ptr) {
+    for (int i = 0; i < g_num_async_devs; i++) {
+        if (g_async_devs[i] == ptr) return g_async_devs[i];
+    }
+    return NULL;
+}
+
+static void post_mail(struct worker *w, enum mail_type type, void *ptr) {
+    struct mail *m = NULL;
+    IF_NULL_DIE(m = malloc(sizeof(*m)));
+    m->type = type;
+    m->ptr = ptr;
+    m->next = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->mail_tail) {
+        w->mail_tail->next = m;
+    } else {
+        w->mail_head = m;
+    }
+    w->mail_tail = m;
+    pthread_mutex_unlock(&w->lock);
+
+    uint64_t one = 1;
+    if (write(w->event_fd, &one, sizeof(one)) != sizeof(one))
+        LOG("Failed to ring worker event fd");
+}
+
+static void init_worker(struct worker *w, int index) {
+    memset(w, 0, sizeof(*w));
+    w->index = index;
+    w->epoll_fd = epoll_create1(0);
+    if (w->epoll_fd < 0) die("Failed to create epoll fd");
+    w->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (w->event_fd < 0) die("Failed to create event fd");
+    pthread_mutex_init(&w->lock, NULL);
+    spin_window_init(&w->spin, g_spin_ns);
+    w->stats = index < 0 ? &g_stats->cm : &g_stats->workers[index];
+    if (g_config.trace && index >= 0)
+        IF_NULL_DIE(w->trace = calloc(1, sizeof(*w->trace)));
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev))
+        die("Failed to register worker event fd");
+}
+
+// what connections of <wd> are set up with
+static struct conn_config worker_dev_config(struct worker_dev *wd) {
+    struct conn_config cfg = g_config;
+    cfg.scq = wd->scq;
+    cfg.srq = wd->srq;
+    if (g_pool_slices > 0) {
+        struct device *dev = get_device(wd->ctx);
+        if (dev->pool == NULL)
+            dev->pool = buf_pool_create(dev->pd, BUFFER_SIZE, g_pool_slices,
+                                        g_pool_flags);
+        cfg.pool = dev->pool;
+    }
+    return cfg;
+}
+
+// find or create the worker's cq, srq and connection pool on a device, cm
+// thread only
+static struct worker_dev *get_worker_dev(struct worker *w,
+                                         struct ibv_context *ctx) {
+    for (int i = 0; i < w->ndevs; i++) {
+        if (w->devs[i].ctx == ctx) return &w->devs[i];
+    }
+    if (w->ndevs == MAX_DEVICES) die("Too many devices");
+
+    struct worker_dev *wd = &w->devs[w->ndevs];
+    wd->ctx = ctx;
+    if (g_srq) {
+        struct device *dev = get_device(ctx);
+        int batch = g_config.recv_batch;
+        if (batch <= 0) batch = g_srq_slots / 4 > 0 ? g_srq_slots / 4 : 1;
+        wd->srq = create_srq(dev, g_srq_slots, g_srq_max, batch);
+        wd->srq->context = w;
+        // the srq grows on IBV_EVENT_SRQ_LIMIT_REACHED
+        watch_device(dev);
+    }
+    if (g_shared_cqe > 0) {
+        // every receive the srq has posted may complete before it is
+        // polled, that room comes on top of what connections reserve
+        int srq_cqe = wd->srq ? wd->srq->max_slots : 0;
+        wd->scq = create_shared_cq(ctx, g_shared_cqe + srq_cqe,
+                                   conn_cq_flags(&g_config));
+        wd->scq->used = srq_cqe;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = wd->scq->cc;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, wd->scq->cc->fd, &ev))
+            die("Failed to register cq event fd");
+        LOGF("worker %d: shared cq created: %d entries\n", w->index,
+             wd->scq->cqe);
+    }
+    if (g_prewarm > 0) {
+        // pooled connections hold their share of the shared cq
+        struct conn_config cfg = worker_dev_config(wd);
+        wd->pool = conn_pool_create(ctx, &cfg, g_prewarm);
+    }
+    // ud_source() reads it on the worker
+    __atomic_store_n(&w->ndevs, w->ndevs + 1, __ATOMIC_RELEASE);
+    return wd;
+}
 
-    // register cq event fd
+// the worker's ud qp on the device and port of <id>, cm thread only
+static struct ud_ep *get_worker_ud(struct worker *w, struct rdma_cm_id *id) {
+    struct worker_dev *wd = get_worker_dev(w, id->verbs);
+    if (wd->ud) return wd->ud;
+
+    struct ud_ep *ep = ud_ep_create(id->verbs, id->port_num, &g_config);
+    ep->context = w;
+    // published before its channel can wake the worker, see ud_source()
+    __atomic_store_n(&wd->ud, ep, __ATOMIC_RELEASE);
     struct epoll_event ev;
-    int comp_fd = nc->cc->fd;
     ev.events = EPOLLIN;
-    ev.data.ptr = nc->cc;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, comp_fd, &ev))
+    ev.data.ptr = ep->cc;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, ep->cc->fd, &ev))
         die("Failed to register cq event fd");
+    return ep;
+}
+
+// round-robin, or the worker with the fewest connections with -l
+static struct worker *pick_worker(void) {
+    if (!g_least_loaded) {
+        struct worker *w = &g_workers[g_next_worker];
+        g_next_worker = (g_next_worker + 1) % g_num_workers;
+        return w;
+    }
+
+    struct worker *best = &g_workers[0];
+    for (int i = 1; i < g_num_workers; i++) {
+        if (__atomic_load_n(&g_workers[i].nconns, __ATOMIC_RELAXED) <
+            __atomic_load_n(&best->nconns, __ATOMIC_RELAXED))
+            best = &g_workers[i];
+    }
+    return best;
+}
+
+// req is the client's connect request, its private data is already gone.
+// peer_ring is the client's receive ring from it, NULL when it sent none.
+int handle_new_request(struct conn_context *cctx,
+                       const struct rdma_conn_param *req,
+                       const struct ring_info *peer_ring) {
+    struct worker *w = pick_worker();
+    struct worker_dev *wd = get_worker_dev(w, cctx->id->verbs);
+
+    // a pooled connection only needs its qp, an empty pool falls back to
+    // setting up everything here
+    struct connection *nc = wd->pool ? conn_pool_get(wd->pool) : NULL;
+    if (nc == NULL) {
+        struct conn_config cfg = worker_dev_config(wd);
+        nc = conn_alloc(cctx->id->verbs, &cfg);
+        if (nc == NULL) return -1;
+    }
+    if (conn_bind(nc, cctx->id)) {
+        destroy_connection(nc);
+        return -1;
+    }
+    if ((nc->write_imm || nc->credit_fc) &&
+        (peer_ring == NULL ||
+         conn_set_peer_ring(nc, peer_ring, sizeof(*peer_ring)))) {
+        LOG("client did not advertise a receive ring");
+        destroy_connection(nc);
+        return -1;
+    }
+    nc->context = cctx;
+    // counters are best effort, a connection past the table goes unseen
+    nc->stats = stats_conn_alloc(g_stats, nc->qp->qp_num, w->index);
+    nc->trace = w->trace;
+    cctx->conn = nc;
+    cctx->worker = w;
+    cctx->backlog_cap = nc->recv_slots;
+    cctx->backlog_head = 0;
+    cctx->backlog_len = 0;
+    // offers are pulled with one read, no larger than the port allows
+    struct ibv_port_attr port;
+    size_t max_len = 0;
+    if (ibv_query_port(cctx->id->verbs, cctx->id->port_num, &port) == 0)
+        max_len = port.max_msg_sz;
+    rndv_init(&cctx->rndv, 0, max_len);
+    IF_NULL_DIE(cctx->backlog =
+                    calloc(nc->recv_slots, sizeof(*cctx->backlog)));
+
+    if (!nc->scq) {
+        // register cq event fd with the worker
+        struct epoll_event ev;
+        int comp_fd = nc->cc->fd;
+        ev.events = EPOLLIN;
+        ev.data.ptr = nc->cc;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, comp_fd, &ev))
+            die("Failed to register cq event fd");
+    }
+
+    // hand over before accepting, the worker sees the mail no later than
+    // the first completion of this connection
+    __atomic_add_fetch(&w->nconns, 1, __ATOMIC_RELAXED);
+    post_mail(w, MAIL_ADD, cctx);
 
     struct rdma_conn_param conn_parm = {0};
     conn_parm.retry_count = 3;
-    conn_parm.rnr_retry_count = 7;  // try infinity
+    // with credits a message never arrives without a receive for it, an
+    // rnr would be a bug
+    conn_parm.rnr_retry_count = nc->credit_fc ? 0 : 7;  // 7 is infinity
+    // rendezvous pulls are rdma reads in both directions
+    conn_rd_atomic(cctx->id, &conn_parm);
+    if (conn_parm.responder_resources > req->initiator_depth)
+        conn_parm.responder_resources = req->initiator_depth;
+    if (conn_parm.initiator_depth > req->responder_resources)
+        conn_parm.initiator_depth = req->responder_resources;
+    // tell the client where to write its messages, or how many it may send
+    struct ring_info ring;
+    if (nc->write_imm || nc->credit_fc) {
+        conn_ring_info(nc, &ring);
+        conn_parm.private_data = &ring;
+        conn_parm.private_data_len = sizeof(ring);
+    }
     // Accept new connection
     IF_NZERO_DIE(rdma_accept(cctx->id, &conn_parm));
+    if (g_config.trace)
+        trace_hist_record(&g_accept[ACCEPT_POSTED],
+                          now_ns() - cctx->requested);
 
     cctx->state = ACCEPTING;
+    return 0;
+}
+
+// a client asks for a ud qp to send to. there is no connection: the reply
+// names the qp of the picked worker and the request's id is done with.
+static int handle_ud_request(struct rdma_cm_id *id) {
+    struct worker *w = pick_worker();
+    struct ud_ep *ep = get_worker_ud(w, id);
+
+    struct rdma_conn_param conn_parm = {0};
+    conn_parm.qp_num = ep->qp->qp_num;
+    if (rdma_accept(id, &conn_parm)) {
+        LOG("rdma_accept failed");
+        return -1;
+    }
+    // clients are only counted, for -l, never disconnected
+    __atomic_add_fetch(&w->nconns, 1, __ATOMIC_RELAXED);
+    rdma_destroy_id(id);
+    return 0;
 }
 
 int handle_cm_event(struct rdma_event_channel *ec) {
@@ -60,8 +425,17 @@ int handle_cm_event(struct rdma_event_channel *ec) {
         LOG("rdma_get_cm_event failed");
         return -1;
     }
+    uint64_t now = g_config.trace ? now_ns() : 0;
 
     new_event = *event;
+    // private data lives in the event, keep a copy past the ack
+    struct ring_info peer_ring;
+    int has_peer_ring = 0;
+    if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST && !g_ud &&
+        event->param.conn.private_data_len >= sizeof(peer_ring)) {
+        memcpy(&peer_ring, event->param.conn.private_data, sizeof(peer_ring));
+        has_peer_ring = 1;
+    }
     rdma_ack_cm_event(event);
 
     struct conn_context *cctx = NULL;
@@ -69,21 +443,38 @@ int handle_cm_event(struct rdma_event_channel *ec) {
     switch (new_event.event) {
         case RDMA_CM_EVENT_CONNECT_REQUEST:
             LOG("event: CONNECT REQUEST");
-            cctx = malloc(sizeof(*cctx));
+            if (g_ud) {
+                if (handle_ud_request(new_event.id)) {
+                    rdma_reject(new_event.id, NULL, 0);
+                    rdma_destroy_id(new_event.id);
+                }
+                break;
+            }
+            cctx = calloc(1, sizeof(*cctx));
             if (cctx == NULL) {
                 LOG("Failed to alloc conn_context");
                 rdma_reject(new_event.id, NULL, 0);
                 break;
             }
             cctx->id = new_event.id;
+            cctx->requested = now;
             new_event.id->context = cctx;
-            handle_new_request(cctx);
+            if (handle_new_request(cctx, &new_event.param.conn,
+                                   has_peer_ring ? &peer_ring : NULL)) {
+                LOG("Failed to set up connection");
+                rdma_reject(new_event.id, NULL, 0);
+                new_event.id->context = NULL;
+                free(cctx);
+            }
             break;
 
         case RDMA_CM_EVENT_ESTABLISHED:
             LOG("event: ESTABLISHED");
             cctx = new_event.id->context;
             cctx->state = ESTABLISHED;
+            if (g_config.trace)
+                trace_hist_record(&g_accept[ACCEPT_ESTABLISHED],
+                                  now - cctx->requested);
             break;
 
         case RDMA_CM_EVENT_DISCONNECTED:
@@ -93,37 +484,244 @@ int handle_cm_event(struct rdma_event_channel *ec) {
 
             cctx->state = DISCONNECTED;
             rdma_disconnect(cctx->id);
-            rdma_destroy_id(cctx->id);
-
-            struct connection *nc = cctx->conn;
-            // unregister cq event fd
-            struct epoll_event ev;
-            int comp_fd = nc->cc->fd;
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, comp_fd, &ev))
-                LOG("Failed to unregister cq event fd");
-
-            if (nc->qp) ibv_destroy_qp(nc->qp);
-            if (nc->cq) ibv_destroy_cq(nc->cq);
-            if (nc->send_mr) ibv_dereg_mr(nc->send_mr);
-            if (nc->recv_mr) ibv_dereg_mr(nc->recv_mr);
-            if (nc->send_buff) free(nc->send_buff);
-            if (nc->recv_buff) free(nc->recv_buff);
-            if (nc->cc) ibv_destroy_comp_channel(nc->cc);
-            if (nc->pd) ibv_dealloc_pd(nc->pd);
-            free(nc);
-
             new_event.id->context = NULL;
-            free(cctx);
+
+            // the owning worker destroys the connection
+            post_mail(cctx->worker, MAIL_DEL, cctx);
             break;
 
         default:
-            LOGF("event: %s", rdma_event_str(event->event));
+            LOGF("event: %s\n", rdma_event_str(new_event.event));
+            break;
+    }
+    return 0;
+}
+
+// runs on the cm thread, srq events are forwarded to the owning worker
+static void handle_async_event(struct device *dev) {
+    struct ibv_async_event event;
+
+    while (ibv_get_async_event(dev->ctx, &event) == 0) {
+        switch (event.event_type) {
+            case IBV_EVENT_SRQ_LIMIT_REACHED: {
+                struct srq *s = event.element.srq->srq_context;
+                post_mail(s->context, MAIL_SRQ_LIMIT, s);
+                break;
+            }
+            default:
+                LOGF("async event: %s\n",
+                     ibv_event_type_str(event.event_type));
+                break;
+        }
+        ibv_ack_async_event(&event);
+    }
+}
+
+static void close_connection(struct worker *w, struct conn_context *cctx) {
+    struct connection *nc = cctx->conn;
+    if (nc->scq) {
+        qp_table_remove(&nc->scq->qpt, nc->qp->qp_num);
+    } else {
+        // unregister cq event fd
+        struct epoll_event ev;
+        int comp_fd = nc->cc->fd;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, comp_fd, &ev))
+            LOG("Failed to unregister cq event fd");
+    }
+
+    if (nc->credit_fc)
+        LOGF("Connection closed, %lu credit stalls, %lu credit updates\n",
+             nc->credit_stalls, nc->credit_updates);
+    LOGF("Connection closed, %.2f sends per ibv_post_send, %.2f receives per "
+         "ibv_post_recv\n",
+         nc->send_posts ? (double)nc->send_wrs / nc->send_posts : 0,
+         nc->recv_posts ? (double)nc->recv_wrs / nc->recv_posts : 0);
+    // it may go away in the middle of a poll batch
+    for (int i = 0; i < w->nchained; i++) {
+        if (w->chained[i] == nc) w->chained[i] = w->chained[--w->nchained];
+    }
+    if (nc->stats) stats_conn_free(nc->stats);
+    rdma_destroy_id(cctx->id);
+    // pulled buffers are registered on the connection's pd
+    rndv_destroy(&cctx->rndv);
+    destroy_connection(nc);
+    __atomic_sub_fetch(&w->nconns, 1, __ATOMIC_RELAXED);
+
+    free(cctx->backlog);
+    free(cctx);
+}
+
+static void drain_mailbox(struct worker *w) {
+    uint64_t n;
+    if (read(w->event_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        LOG("Failed to read worker event fd");
+
+    pthread_mutex_lock(&w->lock);
+    struct mail *m = w->mail_head;
+    w->mail_head = w->mail_tail = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    while (m) {
+        struct mail *next = m->next;
+        struct conn_context *cctx = m->ptr;
+        switch (m->type) {
+            case MAIL_ADD:
+                // completions are dispatched by qp number
+                if (cctx->conn->scq)
+                    qp_table_insert(&cctx->conn->scq->qpt,
+                                    cctx->conn->qp->qp_num, cctx->conn);
+                break;
+            case MAIL_DEL:
+                close_connection(w, cctx);
+                break;
+            case MAIL_SRQ_LIMIT:
+                srq_on_limit(m->ptr);
+                break;
+        }
+        free(m);
+        m = next;
+    }
+}
+
+// stages of a pulled payload, kept in rndv_in.stage
+#define RNDV_PULLING 0
+#define RNDV_ECHOING 1
+
+// an echo of a message first seen by the handler at <since> is posted
+static void trace_reply(struct connection *nc, uint64_t since) {
+    if (nc->trace) trace_span(nc->trace, TRACE_HANDLER_REPLY, since, now_ns());
+}
+
+// handle a received message. an eager one is echoed back from its own
+// buffer and the receive slot goes back to the ring when the send
+// completes. a rendezvous offer starts the pull. returns -1 when every
+// send slot is still in flight, the message is retried later.
+static int handle_msg(struct conn_context *cctx, int slot, uint32_t len,
+                      uint64_t since) {
+    struct connection *nc = cctx->conn;
+    char *msg = conn_recv_buf(nc, slot);
+    const struct msg_hdr *h = (const struct msg_hdr *)msg;
+    struct rndv_in *in;
+    void *cookie;
+    int n;
+
+    if (len < MSG_HDR_SIZE) {
+        LOG("Message without header");
+        return conn_release_recv(nc, slot) ? -1 : 0;
+    }
+    switch (h->type) {
+        case MSG_EAGER:
+            LOGD("Recevied: %.*s\n", (int)(len - MSG_HDR_SIZE),
+                 msg + MSG_HDR_SIZE);
+            if (conn_send_loaned(nc, slot, len)) return -1;
+            trace_reply(nc, since);
+            return 0;
+        case MSG_COALESCED:
+            // the batch goes back as it came, it is coalesced already
+            n = batch_unpack(msg, len, NULL, NULL);
+            if (n < 0) {
+                LOG("Malformed batch");
+                break;
+            }
+            LOGD("Recevied a batch of %d messages\n", n);
+            if (conn_send_loaned(nc, slot, len)) return -1;
+            trace_reply(nc, since);
+            return 0;
+        case MSG_RNDV_RTS:
+            if (len < sizeof(struct rndv_rts)) {
+                LOG("Short rendezvous offer");
+                break;
+            }
+            if (rndv_on_rts(nc, &cctx->rndv, msg, len, &in)) return -1;
+            if (in == NULL) LOG("Refused a rendezvous offer");
+            break;
+        case MSG_RNDV_FIN:
+            // the client pulled an echoed payload, or refused it
+            if (rndv_on_fin(&cctx->rndv, msg, len, &cookie) >= 0)
+                rndv_in_free(cookie);
+            break;
+        default:
+            LOGF("Unknown message type %d\n", h->type);
             break;
     }
+    IF_NZERO_DIE(conn_release_recv(nc, slot));
     return 0;
 }
 
-int handle_cq_event(struct ibv_comp_channel *cc) {
+// release the client's buffer of every completed pull and offer the payload
+// back as the echo, as far as send slots allow
+static void progress_rndv(struct conn_context *cctx) {
+    struct connection *nc = cctx->conn;
+    for (int i = 0; i < RNDV_SLOTS; i++) {
+        struct rndv_in *in = &cctx->rndv.in[i];
+        if (!in->used || !in->ready || in->stage == RNDV_ECHOING) continue;
+
+        if (!in->fin_sent && rndv_send_fin(nc, in)) return;
+        if (rndv_send(nc, &cctx->rndv, in->buf, in->len, in->mr, in)) return;
+        LOGD("Pulled %zu bytes\n", in->len);
+        in->stage = RNDV_ECHOING;
+    }
+}
+
+// queue a message behind those already waiting for a send slot. the srq
+// does not stop at recv_slots, the backlog doubles when it is full.
+static void backlog_push(struct conn_context *cctx, int slot, uint32_t len,
+                         uint64_t since) {
+    if (cctx->backlog_len == cctx->backlog_cap) {
+        int cap = 2 * cctx->backlog_cap;
+        struct pending_reply *b = NULL;
+        IF_NULL_DIE(b = calloc(cap, sizeof(*b)));
+        for (int i = 0; i < cctx->backlog_len; i++) {
+            int from = (cctx->backlog_head + i) % cctx->backlog_cap;
+            b[i] = cctx->backlog[from];
+        }
+        free(cctx->backlog);
+        cctx->backlog = b;
+        cctx->backlog_cap = cap;
+        cctx->backlog_head = 0;
+    }
+    int tail = (cctx->backlog_head + cctx->backlog_len) % cctx->backlog_cap;
+    cctx->backlog[tail].slot = slot;
+    cctx->backlog[tail].len = len;
+    cctx->backlog[tail].since = since;
+    cctx->backlog_len++;
+}
+
+static void drain_backlog(struct conn_context *cctx) {
+    progress_rndv(cctx);
+    while (cctx->backlog_len > 0) {
+        struct pending_reply *r = &cctx->backlog[cctx->backlog_head];
+        if (handle_msg(cctx, r->slot, r->len, r->since)) break;
+        cctx->backlog_head = (cctx->backlog_head + 1) % cctx->backlog_cap;
+        cctx->backlog_len--;
+    }
+}
+
+// remember a connection with sends queued, one per completion at most
+static void mark_chained(struct worker *w, struct connection *nc) {
+    if (nc->chain_len == 0) return;
+    for (int i = 0; i < w->nchained; i++) {
+        if (w->chained[i] == nc) return;
+    }
+    w->chained[w->nchained++] = nc;
+}
+
+// every reply and credit update of a poll batch goes out in one
+// ibv_post_send per connection
+static void flush_chained(struct worker *w) {
+    for (int i = 0; i < w->nchained; i++)
+        IF_NZERO_DIE(conn_flush_send(w->chained[i]));
+    w->nchained = 0;
+}
+
+// a signaled send or read of <nc> completed at <at>
+static void trace_send(struct connection *nc, uint64_t wr_id, uint64_t at) {
+    if (nc->trace)
+        trace_span(nc->trace, TRACE_POST_COMPLETE,
+                   nc->send_ns[wr_id % nc->send_slots], at);
+}
+
+int handle_cq_event(struct worker *w, struct ibv_comp_channel *cc) {
     // LOG("handle_cq_event");
 
     struct ibv_cq *cq = NULL;
@@ -135,68 +733,442 @@ int handle_cq_event(struct ibv_comp_channel *cc) {
     }
 
     ibv_ack_cq_events(cq, 1);
+    STAT_ADD(w->stats->cq_events, 1);
     if (ibv_req_notify_cq(cq, 0)) {
         LOG("ibv_get_cq_event failed");
         return -1;
     }
 
-    // poll completions
-    struct ibv_wc wcs[16];
+    // a shared cq serves many connections, look each completion up by qp
+    struct shared_cq *scq = g_shared_cqe > 0 ? cq_ctx : NULL;
+    struct connection *nc = scq ? NULL : cq_ctx;
+    IF_NULL_DIE(scq || nc);
+    struct ex_cq *xcq = scq ? scq->xcq : nc->xcq;
+
+    // poll completions, with their completion times when tracing
+    struct ibv_wc wcs[POLL_BATCH];
+    uint64_t ts[POLL_BATCH];
     int ne = 0;
     do {
-        ne = ibv_poll_cq(cq, 16, wcs);
+        ne = xcq ? ex_cq_poll(xcq, POLL_BATCH, wcs, ts)
+                 : ibv_poll_cq(cq, POLL_BATCH, wcs);
+        STAT_ADD(w->stats->polls, 1);
         if (ne < 0) {
             LOG("ibv_poll_cq failed");
             break;
         } else if (ne == 0) {
+            STAT_ADD(w->stats->empty_polls, 1);
             break;
         }
+        STAT_ADD(w->stats->completions, ne);
 
-        struct ibv_recv_wr *bad_rwr = NULL;
-        struct ibv_send_wr *bad_swr = NULL;
         for (int i = 0; i < ne; i++) {
             struct ibv_wc *wc = &wcs[i];
-            if (wc->status != IBV_WC_SUCCESS) {
-                LOGF("WC error %s opcode=%d wr_id=%lu\n",
-                     ibv_wc_status_str(wc->status), wc->opcode, wc->wr_id);
+            if (scq) {
+                nc = qp_table_lookup(&scq->qpt, wc->qp_num);
+                if (nc == NULL) {
+                    // the connection may still be in the mailbox
+                    drain_mailbox(w);
+                    nc = qp_table_lookup(&scq->qpt, wc->qp_num);
+                }
             }
 
-            struct connection *nc = NULL;
-            IF_NULL_DIE(nc = (struct connection *)(wc->wr_id));
+            if (wc->status != IBV_WC_SUCCESS) {
+                int rnr = wc->status == IBV_WC_RNR_RETRY_EXC_ERR;
+                STAT_ADD(w->stats->wc_errors, 1);
+                STAT_ADD(w->stats->rnr_errors, rnr);
+                if (nc && nc->stats) {
+                    STAT_ADD(nc->stats->wc_errors, 1);
+                    STAT_ADD(nc->stats->rnr_errors, rnr);
+                }
+                LOGF("WC error %s opcode=%d wr_id=%lu qp_num=%u\n",
+                     ibv_wc_status_str(wc->status), wc->opcode, wc->wr_id,
+                     wc->qp_num);
+                continue;
+            }
+            // connection already torn down
+            if (nc == NULL) continue;
+            struct conn_context *cctx = nc->context;
 
+            int slot;
+            uint32_t len;
+            uint64_t since = 0;
             switch (wc->opcode) {
                 case IBV_WC_SEND:
-                    // send completed
+                case IBV_WC_RDMA_WRITE:
+                    trace_send(nc, wc->wr_id, ts[i]);
+                    // send completed, its slot may unblock a queued reply
+                    IF_NZERO_DIE(conn_send_done(nc, wc->wr_id));
+                    drain_backlog(cctx);
+                    break;
+                case IBV_WC_RDMA_READ:
+                    trace_send(nc, wc->wr_id, ts[i]);
+                    // a pull finished, it also frees its send slot
+                    IF_NZERO_DIE(conn_send_done(nc, wc->wr_id));
+                    rndv_read_done(&cctx->rndv, wc->wr_id);
+                    drain_backlog(cctx);
                     break;
                 case IBV_WC_RECV:
-                    LOGF("Recevied: %s\n", nc->recv_buff);
-
-                    strcpy(nc->send_buff, nc->recv_buff);
-
-                    // post recv wr after we handled the received message.
-                    IF_NZERO_DIE(ibv_post_recv(nc->qp, &nc->recv_wr, &bad_rwr));
-
-                    IF_NZERO_DIE(ibv_post_send(nc->qp, &nc->send_wr, &bad_swr));
+                case IBV_WC_RECV_RDMA_WITH_IMM:
+                    slot = conn_recv_slot(nc, wc, &len);
+                    // returned credits or released ring slots may unblock
+                    // queued replies
+                    if (nc->credit_fc || nc->write_imm) drain_backlog(cctx);
+                    if (slot < 0) break;  // a credit update only
+                    if (nc->trace) {
+                        since = now_ns();
+                        trace_span(nc->trace, TRACE_COMPLETE_HANDLER, ts[i],
+                                   since);
+                    }
+                    if (cctx->backlog_len > 0 ||
+                        handle_msg(cctx, slot, len, since))
+                        backlog_push(cctx, slot, len, since);
                     break;
                 default:
                     LOGF("Unknown opcode: %s", wc_opcode_str(wc->opcode));
                     break;
             }
+            mark_chained(w, nc);
         }
+        flush_chained(w);
     } while (ne > 0);
 
     return 0;
 }
 
-int main() {
+// the worker's ud ep whose completion channel <ptr> is, NULL for none
+static struct ud_ep *ud_source(struct worker *w, void *ptr) {
+    int ndevs = __atomic_load_n(&w->ndevs, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < ndevs; i++) {
+        struct ud_ep *ep = __atomic_load_n(&w->devs[i].ud, __ATOMIC_ACQUIRE);
+        if (ep && ep->cc == ptr) return ep;
+    }
+    return NULL;
+}
+
+// echo a datagram to whoever sent it, the sequence number goes back as it
+// came. returns -1 when it is malformed or cannot be answered right now.
+static int ud_echo(struct ud_ep *ep, const struct ibv_wc *wc, int slot,
+                   uint32_t len) {
+    struct ud_hdr *h = (struct ud_hdr *)ud_recv_buf(ep, slot);
+    if (len < UD_HDR_SIZE || h->msg.type != MSG_DATAGRAM ||
+        ntohl(h->msg.len) != len)
+        return -1;
+    struct ibv_ah *ah = ud_peer_ah(ep, wc);
+    char *buf = ud_send_buf(ep);
+    if (ah == NULL || buf == NULL) return -1;
+    memcpy(buf, h, len);
+    return ud_post_send(ep, ah, wc->src_qp, UD_QKEY, len);
+}
+
+// a datagram that cannot be echoed is dropped, the client sends it again
+static void handle_ud_event(struct worker *w, struct ud_ep *ep) {
+    struct ibv_cq *cq = NULL;
+    void *cq_ctx = NULL;
+    if (ibv_get_cq_event(ep->cc, &cq, &cq_ctx)) {
+        LOG("ibv_get_cq_event failed");
+        return;
+    }
+    ibv_ack_cq_events(cq, 1);
+    STAT_ADD(w->stats->cq_events, 1);
+    if (ibv_req_notify_cq(cq, 0)) {
+        LOG("ibv_req_notify_cq failed");
+        return;
+    }
+
+    struct ibv_wc wcs[POLL_BATCH];
+    int ne = 0;
+    do {
+        ne = ibv_poll_cq(cq, POLL_BATCH, wcs);
+        STAT_ADD(w->stats->polls, 1);
+        if (ne < 0) {
+            LOG("ibv_poll_cq failed");
+            break;
+        } else if (ne == 0) {
+            STAT_ADD(w->stats->empty_polls, 1);
+            break;
+        }
+        STAT_ADD(w->stats->completions, ne);
+
+        for (int i = 0; i < ne; i++) {
+            struct ibv_wc *wc = &wcs[i];
+            if (wc->status != IBV_WC_SUCCESS) {
+                STAT_ADD(w->stats->wc_errors, 1);
+                LOGF("WC error %s opcode=%d wr_id=%lu qp_num=%u\n",
+                     ibv_wc_status_str(wc->status), wc->opcode, wc->wr_id,
+                     wc->qp_num);
+                continue;
+            }
+            if (wc->opcode == IBV_WC_SEND) {
+                IF_NZERO_DIE(ud_send_done(ep, wc->wr_id));
+                continue;
+            }
+            uint32_t len;
+            int slot = ud_recv_slot(ep, wc, &len);
+            if (ud_echo(ep, wc, slot, len)) ep->drops++;
+            IF_NZERO_DIE(ud_release_recv(ep, slot));
+        }
+    } while (ne > 0);
+}
+
+// the event loop of a worker. the worker that also owns the cm event
+// channel gets it as <ec>, everyone else passes NULL.
+// busy-poll the epoll set for the worker's spin window, then block in it.
+// the cqs stay armed either way, spinning only saves the sleep and wakeup
+// while traffic is dense enough to keep the window open.
+static int wait_events(struct worker *w, struct epoll_event *events) {
+    uint64_t start = now_ns();
+    int n;
+    do {
+        n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 0);
+        if (n > 0) STAT_ADD(w->stats->spin_hits, 1);
+    } while (n == 0 && now_ns() - start < w->spin.spin_ns);
+
+    if (n == 0) {
+        n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 1000);
+        if (n > 0) STAT_ADD(w->stats->sleep_wakeups, 1);
+    }
+    if (n > 0) {
+        STAT_ADD(w->stats->epoll_wakeups, 1);
+        spin_window_arrival(&w->spin, now_ns());
+    }
+    return n;
+}
+
+// accept latencies with -t and how often the pools had a connection
+// ready with -A. the cm thread is the only one taking from the pools.
+static void dump_accept(void) {
+    if (g_config.trace) {
+        trace_hist_dump(&g_accept[ACCEPT_POSTED], "cm", "request->accept");
+        trace_hist_dump(&g_accept[ACCEPT_ESTABLISHED], "cm",
+                        "request->established");
+    }
+    for (int i = 0; i < g_num_workers; i++) {
+        struct worker *w = &g_workers[i];
+        for (int d = 0; d < w->ndevs; d++) {
+            struct conn_pool *pool = w->devs[d].pool;
+            if (pool == NULL) continue;
+            LOGF("worker %d: pool on %s: %lu hits, %lu misses\n", i,
+                 ibv_get_device_name(w->devs[d].ctx->device), pool->hits,
+                 pool->misses);
+        }
+    }
+}
+
+static void run_event_loop(struct worker *w, struct rdma_event_channel *ec) {
+    struct epoll_event events[MAX_EVENTS];
+    while (keep_running) {
+        int n = wait_events(w, events);
+        if (ec && g_accept_dumps != g_trace_dumps) {
+            g_accept_dumps = g_trace_dumps;
+            dump_accept();
+        }
+        if (w->trace && w->trace->dumps != g_trace_dumps) {
+            w->trace->dumps = g_trace_dumps;
+            char name[32];
+            snprintf(name, sizeof(name), "worker %d", w->index);
+            trace_dump(w->trace, name);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        } else if (n == 0) {
+            // LOG("epoll no event");
+            //  timeout
+            continue;
+        }
+
+        // LOGF("epoll got %d events\n", n);
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            struct device *dev = NULL;
+            struct ud_ep *ud = NULL;
+            if (ptr == w) {
+                drain_mailbox(w);
+            } else if (ec && ptr == ec) {
+                handle_cm_event(ec);
+            } else if (ec && (dev = async_source(ptr)) != NULL) {
+                handle_async_event(dev);
+            } else if (g_ud && (ud = ud_source(w, ptr)) != NULL) {
+                handle_ud_event(w, ud);
+            } else {
+                handle_cq_event(w, ptr);
+            }
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    run_event_loop(w, NULL);
+    return NULL;
+}
+
+static void start_worker(struct worker *w) {
+    if (pthread_create(&w->thread, NULL, worker_main, w))
+        die("Failed to create worker thread");
+
+    // one worker per core
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(w->index % (ncpus > 0 ? ncpus : 1), &cpus);
+    if (pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus))
+        LOGF("Failed to pin worker %d\n", w->index);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-q queue_depth] [-r recv_slots] [-b recv_batch] "
+            "[-S] [-n srq_slots] [-m srq_max] [-c cqe] [-w workers] [-l] "
+            "[-P slices] [-H] [-e every] [-i inline] [-p spin_us] [-W] [-C] "
+            "[-t] [-x] [-D] [-A conns] [-U]\n"
+            "  -q queue_depth  send slots per connection (default %d)\n"
+            "  -r recv_slots   receive ring size per connection (default %d)\n"
+            "  -b recv_batch   re-post consumed receives in chains of this "
+            "size\n"
+            "  -S              share one receive queue per worker and device\n"
+            "  -n srq_slots    initial srq buffers and growth step "
+            "(default %d)\n"
+            "  -m srq_max      upper bound for srq buffers (default %d)\n"
+            "  -c cqe          share one pd per device and one completion "
+            "channel and cq of <cqe> entries per worker\n"
+            "  -w workers      run <workers> pinned event loop threads, "
+            "implies -c %d unless given\n"
+            "  -l              hand connections to the least loaded worker "
+            "instead of round-robin\n"
+            "  -P slices       take connection buffers from one registered "
+            "pool of <slices> buffers per device\n"
+            "  -H              back the pool with huge pages\n"
+            "  -e every        ask for a send completion every <every> "
+            "sends\n"
+            "  -i inline       inline data to ask of each qp, 0 to disable "
+            "(default %d)\n"
+            "  -p spin_us      busy-poll at most this long before blocking "
+            "(default %d)\n"
+            "  -W              clients write messages into the receive ring "
+            "with RDMA WRITE with immediate, not with -S or -P\n"
+            "  -C              credit flow control, clients must use it too, "
+            "not with -S or -W\n"
+            "  -t              trace per-message stage latencies, dumped on "
+            "SIGUSR1\n"
+            "  -x              poll cqs through ibv_cq_ex, reading only the "
+            "fields in use\n"
+            "  -D              post the replies of each poll batch as one "
+            "chain per connection\n"
+            "  -A conns        keep <conns> connections per worker and device "
+            "set up ahead of accepting, they count against -c\n"
+            "  -U              echo datagrams on one ud qp per worker and "
+            "device, -q -r -b -e -i size it, not with -S -P -W -C -t -x -D "
+            "-A\n",
+            prog, QUEUE_DEPTH, RECV_SLOTS, SRQ_SLOTS, SRQ_MAX_SLOTS,
+            SHARED_CQE, MAX_INLINE, SPIN_MAX_NS / 1000);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    const char *opts = "q:r:b:Sn:m:c:w:lP:He:i:p:WCtxDA:U";
+    while ((opt = getopt(argc, argv, opts)) != -1) {
+        switch (opt) {
+            case 'q':
+                g_config.queue_depth = atoi(optarg);
+                break;
+            case 'r':
+                g_config.recv_slots = atoi(optarg);
+                break;
+            case 'b':
+                g_config.recv_batch = atoi(optarg);
+                break;
+            case 'S':
+                g_srq = 1;
+                break;
+            case 'n':
+                g_srq_slots = atoi(optarg);
+                break;
+            case 'm':
+                g_srq_max = atoi(optarg);
+                break;
+            case 'c':
+                g_shared_cqe = atoi(optarg);
+                break;
+            case 'w':
+                g_num_workers = atoi(optarg);
+                if (g_num_workers <= 0 || g_num_workers > MAX_WORKERS) {
+                    fprintf(stderr, "workers must be in [1, %d]\n",
+                            MAX_WORKERS);
+                    exit(1);
+                }
+                g_threaded = 1;
+                break;
+            case 'l':
+                g_least_loaded = 1;
+                break;
+            case 'P':
+                g_pool_slices = atoi(optarg);
+                break;
+            case 'H':
+                g_pool_flags |= BUF_POOL_HUGETLB;
+                break;
+            case 'e':
+                g_config.signal_every = atoi(optarg);
+                break;
+            case 'i':
+                // zero means default in conn_config
+                g_config.max_inline = atoi(optarg);
+                if (g_config.max_inline <= 0) g_config.max_inline = -1;
+                break;
+            case 'p':
+                g_spin_ns = atol(optarg) * 1000;
+                if (g_spin_ns < 0) usage(argv[0]);
+                break;
+            case 'W':
+                g_config.write_imm = 1;
+                break;
+            case 'C':
+                g_config.credits = 1;
+                break;
+            case 't':
+                g_config.trace = 1;
+                break;
+            case 'x':
+                g_config.cq_ex = 1;
+                break;
+            case 'D':
+                g_config.send_chain = 1;
+                break;
+            case 'A':
+                g_prewarm = atoi(optarg);
+                if (g_prewarm < 0) usage(argv[0]);
+                break;
+            case 'U':
+                g_ud = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (g_srq_slots <= 0 || g_srq_max < g_srq_slots) usage(argv[0]);
+    if (g_config.write_imm && (g_srq || g_pool_slices > 0)) usage(argv[0]);
+    if (g_config.credits && (g_srq || g_config.write_imm)) usage(argv[0]);
+    if (g_ud && (g_srq || g_pool_slices > 0 || g_config.write_imm ||
+                 g_config.credits || g_config.trace || g_config.cq_ex ||
+                 g_config.send_chain || g_prewarm > 0))
+        usage(argv[0]);
+    if (g_threaded && g_shared_cqe == 0) g_shared_cqe = SHARED_CQE;
+    if (!g_threaded) g_num_workers = 1;
+
     signal(SIGINT, sigint_handle);
+    signal(SIGUSR1, sigusr1_handle);
 
     struct rdma_event_channel *ec = NULL;
     LOG("create event channel");
     IF_NULL_DIE(ec = rdma_create_event_channel());
 
     struct rdma_cm_id *listener = NULL;
-    IF_NZERO_DIE(rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP));
+    IF_NZERO_DIE(rdma_create_id(ec, &listener, NULL,
+                                g_ud ? RDMA_PS_UDP : RDMA_PS_TCP));
 
     struct addrinfo *ai;
     struct addrinfo hints = {
@@ -212,46 +1184,93 @@ int main() {
     LOG("listen begin");
     IF_NZERO_DIE(rdma_listen(listener, 10));
 
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd < 0) die("Failed to create epoll fd");
+    g_stats = stats_open(g_num_workers);
+    for (int i = 0; i < g_num_workers; i++) {
+        init_worker(&g_workers[i], i);
+    }
+
+    // without -w the main thread is worker 0 and the cm thread at once
+    struct worker cm;
+    struct worker *cm_worker = &g_workers[0];
+    if (g_threaded) {
+        init_worker(&cm, -1);
+        cm_worker = &cm;
+    }
+    cm_epoll_fd = cm_worker->epoll_fd;
 
     // register cm event fd
     struct epoll_event ev;
     int listen_fd = ec->fd;
     ev.events = EPOLLIN;
     ev.data.ptr = ec;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev))
+    if (epoll_ctl(cm_epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev))
         die("Failed to register listen fd");
 
-    // main loop
-    struct epoll_event events[MAX_EVENTS];
-    while (keep_running) {
-        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            perror("epoll_wait");
-            break;
-        } else if (n == 0) {
-            // LOG("epoll no event");
-            //  timeout
-            continue;
+    if (g_prewarm > 0) {
+        // warm every device now rather than on its first request
+        int ndevs = 0;
+        struct ibv_context **ctxs = NULL;
+        IF_NULL_DIE(ctxs = rdma_get_devices(&ndevs));
+        for (int d = 0; d < ndevs; d++) {
+            for (int i = 0; i < g_num_workers; i++) {
+                get_worker_dev(&g_workers[i], ctxs[d]);
+            }
         }
+        rdma_free_devices(ctxs);
+    }
 
-        // LOGF("epoll got %d events\n", n);
-        for (int i = 0; i < n; i++) {
-            void *ptr = events[i].data.ptr;
-            if (ptr == ec) {
-                handle_cm_event(ec);
-            } else {
-                handle_cq_event(ptr);
-            }
+    if (g_threaded) {
+        for (int i = 0; i < g_num_workers; i++) {
+            start_worker(&g_workers[i]);
+        }
+        LOGF("started %d workers\n", g_num_workers);
+    }
+
+    // main loop
+    run_event_loop(cm_worker, ec);
+
+    if (g_threaded) {
+        for (int i = 0; i < g_num_workers; i++) {
+            pthread_join(g_workers[i].thread, NULL);
         }
     }
 
     // cleanup
+    conn_pool_stop();
+    dump_accept();
+    for (int i = 0; i < g_num_workers; i++) {
+        struct worker *w = &g_workers[i];
+        for (int d = 0; d < w->ndevs; d++) {
+            struct worker_dev *wd = &w->devs[d];
+            if (wd->pool) conn_pool_destroy(wd->pool);
+            if (wd->ud == NULL) continue;
+            LOGF("worker %d: ud qp %u: %lu drops, %u peers, %lu ah cache "
+                 "hits, %lu misses\n",
+                 i, wd->ud->qp->qp_num, wd->ud->drops, wd->ud->ahc.count,
+                 wd->ud->ahc.hits, wd->ud->ahc.misses);
+            ud_ep_destroy(wd->ud);
+        }
+    }
     rdma_destroy_id(listener);
     rdma_destroy_event_channel(ec);
-    if (epoll_fd > 0) close(epoll_fd);
+    for (int i = 0; i < g_num_workers; i++) {
+        struct worker *w = &g_workers[i];
+        LOGF("worker %d: %lu spin hits, %lu sleep wakeups\n", i,
+             w->stats->spin_hits, w->stats->sleep_wakeups);
+        if (w->trace) {
+            char name[32];
+            snprintf(name, sizeof(name), "worker %d", i);
+            trace_dump(w->trace, name);
+            free(w->trace);
+        }
+        close(g_workers[i].event_fd);
+        close(g_workers[i].epoll_fd);
+    }
+    if (g_threaded) {
+        close(cm.event_fd);
+        close(cm.epoll_fd);
+    }
+    stats_close(g_stats);
 
     return 0;
 }
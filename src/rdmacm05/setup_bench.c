@@ -0,0 +1,116 @@
+#include "common.h"
+
+#define DEFAULT_COUNT 1000
+
+struct stat_acc {
+    double total;
+    double min;
+    double max;
+};
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void acc_add(struct stat_acc *acc, double v) {
+    acc->total += v;
+    if (v < acc->min) acc->min = v;
+    if (v > acc->max) acc->max = v;
+}
+
+static void acc_print(const char *name, const struct stat_acc *acc,
+                      int count) {
+    printf("  %-9s avg %8.2f us  min %8.2f us  max %8.2f us\n", name,
+           acc->total / count, acc->min, acc->max);
+}
+
+// set up and destroy <count> connections on ids bound to <ai>, timing only
+// setup_connection() and destroy_connection()
+static void run(const char *name, struct rdma_event_channel *ec,
+                struct addrinfo *ai, const struct conn_config *cfg,
+                int count) {
+    struct stat_acc setup = {0, 1e18, 0}, teardown = {0, 1e18, 0};
+
+    for (int i = 0; i < count; i++) {
+        struct rdma_cm_id *id = NULL;
+        IF_NZERO_DIE(rdma_create_id(ec, &id, NULL, RDMA_PS_TCP));
+        IF_NZERO_DIE(rdma_bind_addr(id, ai->ai_addr));
+        IF_NULL_DIE(id->verbs);
+
+        double t0 = now_us();
+        struct connection *nc = setup_connection(id, cfg);
+        double t1 = now_us();
+        IF_NULL_DIE(nc);
+        destroy_connection(nc);
+        double t2 = now_us();
+
+        // destroy_connection() already destroyed the qp
+        id->qp = NULL;
+        rdma_destroy_id(id);
+        acc_add(&setup, t1 - t0);
+        acc_add(&teardown, t2 - t1);
+    }
+
+    printf("%s (%d connections)\n", name, count);
+    acc_print("setup", &setup, count);
+    acc_print("teardown", &teardown, count);
+}
+
+int main(int argc, char *argv[]) {
+    int opt, count = DEFAULT_COUNT, flags = 0;
+    while ((opt = getopt(argc, argv, "n:H")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'H':
+                flags |= BUF_POOL_HUGETLB;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (argc - optind != 1 || count <= 0) goto usage;
+
+    struct rdma_event_channel *ec = NULL;
+    IF_NULL_DIE(ec = rdma_create_event_channel());
+
+    struct addrinfo *ai;
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    IF_NZERO_DIE(getaddrinfo(argv[optind], NULL, &hints, &ai));
+
+    // a bound id to find the device for the pool
+    struct rdma_cm_id *id = NULL;
+    IF_NZERO_DIE(rdma_create_id(ec, &id, NULL, RDMA_PS_TCP));
+    IF_NZERO_DIE(rdma_bind_addr(id, ai->ai_addr));
+    IF_NULL_DIE(id->verbs);
+    struct device *dev = get_device(id->verbs);
+
+    struct conn_config cfg = {0};
+    run("malloc + ibv_reg_mr", ec, ai, &cfg, count);
+
+    struct conn_config pool_cfg = {0};
+    pool_cfg.pool = buf_pool_create(dev->pd, BUFFER_SIZE,
+                                    QUEUE_DEPTH + RECV_SLOTS, flags);
+    run("buffer pool", ec, ai, &pool_cfg, count);
+
+    buf_pool_destroy(pool_cfg.pool);
+    rdma_destroy_id(id);
+    freeaddrinfo(ai);
+    rdma_destroy_event_channel(ec);
+    return 0;
+
+usage:
+    fprintf(stderr,
+            "usage: %s [-n count] [-H] <local_ip>\n"
+            "  -n count  connections to set up per mode (default %d)\n"
+            "  -H        back the pool with huge pages\n",
+            argv[0], DEFAULT_COUNT);
+    return 1;
+}
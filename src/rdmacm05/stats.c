@@ -0,0 +1,77 @@
+#include "stats.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "cqwait.h"
+
+static int g_stats_shared;  // the region has a name to unlink
+
+// create the region of this process. if shared memory is not available
+// the counters still live in a private mapping, so writers never check.
+struct stats_region *stats_open(int nworkers) {
+    char name[64];
+    snprintf(name, sizeof(name), STATS_NAME_FMT, (int)getpid());
+
+    struct stats_region *r = MAP_FAILED;
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd >= 0) {
+        if (ftruncate(fd, sizeof(*r)) == 0)
+            r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                     0);
+        close(fd);
+        if (r == MAP_FAILED) shm_unlink(name);
+    }
+    if (r == MAP_FAILED) {
+        LOG("no shared memory for stats, rdma-stat will not see them");
+        r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED) die("mmap");
+    } else {
+        g_stats_shared = 1;
+        LOGF("stats published in /dev/shm%s\n", name);
+    }
+
+    // a fresh mapping is zeroed, fill in the header last
+    r->version = STATS_VERSION;
+    r->nworkers = nworkers;
+    r->pid = getpid();
+    r->start_ns = now_ns();
+    __atomic_store_n(&r->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return r;
+}
+
+void stats_close(struct stats_region *r) {
+    if (g_stats_shared) {
+        char name[64];
+        snprintf(name, sizeof(name), STATS_NAME_FMT, (int)r->pid);
+        shm_unlink(name);
+    }
+    munmap(r, sizeof(*r));
+}
+
+// take a free connection entry, NULL when all are in use. any thread.
+struct conn_stats *stats_conn_alloc(struct stats_region *r, uint32_t qp_num,
+                                    int worker) {
+    for (int i = 0; i < STATS_MAX_CONNS; i++) {
+        struct conn_stats *c = &r->conns[i];
+        uint32_t free = 0;
+        if (!__atomic_compare_exchange_n(&c->in_use, &free, 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        // in_use stays set, the reader tells a reused entry apart by its
+        // generation
+        memset(&c->qp_num, 0,
+               sizeof(*c) - offsetof(struct conn_stats, qp_num));
+        c->qp_num = qp_num;
+        c->worker = worker;
+        __atomic_store_n(&c->gen, c->gen + 1, __ATOMIC_RELEASE);
+        return c;
+    }
+    return NULL;
+}
+
+void stats_conn_free(struct conn_stats *c) {
+    __atomic_store_n(&c->in_use, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,72 @@
+#ifndef RDMA_STATS_H
+#define RDMA_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// live counters in a shared memory region, /dev/shm/rdmacm05.<pid>, for
+// rdma-stat to sample. every counter has a single writer, the thread that
+// owns the worker or connection, so updates are plain relaxed stores: no
+// locked instruction and no syscall.
+
+#define STATS_MAGIC 0x3530616d63616472ULL  // "rdmacm05"
+#define STATS_VERSION 2
+#define STATS_MAX_WORKERS 64
+#define STATS_MAX_CONNS 1024
+#define STATS_NAME_FMT "/rdmacm05.%d"
+
+#define STAT_ADD(field, v) \
+    __atomic_store_n(&(field), (field) + (v), __ATOMIC_RELAXED)
+#define STAT_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+
+struct worker_stats {
+    uint64_t epoll_wakeups;  // epoll_wait calls that returned events
+    uint64_t spin_hits;      // of those, found while busy-polling
+    uint64_t sleep_wakeups;  // of those, after blocking
+    uint64_t cq_events;      // completion channel events handled
+    uint64_t polls;          // ibv_poll_cq calls
+    uint64_t empty_polls;    // that returned nothing
+    uint64_t completions;
+    uint64_t wc_errors;
+    uint64_t rnr_errors;  // IBV_WC_RNR_RETRY_EXC_ERR, also in wc_errors
+} __attribute__((aligned(64)));
+
+struct conn_stats {
+    uint32_t in_use;  // 0 for a free entry
+    uint32_t gen;     // bumped every time the entry is taken
+    uint32_t qp_num;
+    int32_t worker;
+    uint64_t msgs_in;
+    uint64_t bytes_in;
+    uint64_t msgs_out;
+    uint64_t bytes_out;
+    uint64_t reads;  // rdma reads posted
+    uint64_t wc_errors;
+    uint64_t rnr_errors;
+    uint64_t credit_stalls;
+    uint64_t send_posts;  // ibv_post_send calls, each rings the doorbell
+    uint64_t send_wrs;    // work requests they carried
+    uint64_t recv_posts;  // ibv_post_recv calls
+    uint64_t recv_wrs;
+    uint32_t sq_used;    // sends in flight
+    uint32_t rq_posted;  // receives on the qp
+} __attribute__((aligned(64)));
+
+struct stats_region {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nworkers;
+    pid_t pid;
+    uint64_t start_ns;  // CLOCK_MONOTONIC when the region was created
+    struct worker_stats cm;  // the cm thread when it runs apart
+    struct worker_stats workers[STATS_MAX_WORKERS];
+    struct conn_stats conns[STATS_MAX_CONNS];
+};
+
+struct stats_region *stats_open(int nworkers);
+void stats_close(struct stats_region *r);
+struct conn_stats *stats_conn_alloc(struct stats_region *r, uint32_t qp_num,
+                                    int worker);
+void stats_conn_free(struct conn_stats *c);
+
+#endif
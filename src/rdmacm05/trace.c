@@ -0,0 +1,72 @@
+#include "trace.h"
+
+#include "log.h"
+
+static int bucket_of(uint64_t v) {
+    if (v < TRACE_SUB_COUNT) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    int sub = (int)(v >> (e - TRACE_SUB_BITS)) & (TRACE_SUB_COUNT - 1);
+    return (e - TRACE_SUB_BITS + 1) * TRACE_SUB_COUNT + sub;
+}
+
+// largest value that falls into bucket b
+static uint64_t bucket_top(int b) {
+    if (b < TRACE_SUB_COUNT) return b;
+    int e = b / TRACE_SUB_COUNT + TRACE_SUB_BITS - 1;
+    uint64_t low = (uint64_t)(TRACE_SUB_COUNT + b % TRACE_SUB_COUNT)
+                   << (e - TRACE_SUB_BITS);
+    return low + (1ULL << (e - TRACE_SUB_BITS)) - 1;
+}
+
+void trace_hist_record(struct trace_hist *h, uint64_t ns) {
+    if (h->count == 0 || ns < h->min) h->min = ns;
+    if (ns > h->max) h->max = ns;
+    h->count++;
+    h->sum += ns;
+    h->buckets[bucket_of(ns)]++;
+}
+
+void trace_record(struct trace *t, enum trace_stage s, uint64_t ns) {
+    trace_hist_record(&t->stage[s], ns);
+}
+
+// p in [0, 1], the top of the bucket holding that fraction, capped by max
+uint64_t trace_hist_percentile(const struct trace_hist *h, double p) {
+    uint64_t want = (uint64_t)(p * h->count + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (int b = 0; b < TRACE_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= want) {
+            uint64_t top = bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static const char *stage_names[TRACE_STAGES] = {
+    [TRACE_POST_COMPLETE] = "post->completion",
+    [TRACE_COMPLETE_HANDLER] = "completion->handler",
+    [TRACE_HANDLER_REPLY] = "handler->reply",
+};
+
+// one line, everything recorded since the start
+void trace_hist_dump(const struct trace_hist *h, const char *name,
+                     const char *what) {
+    if (h->count == 0) {
+        LOGF("%s %-19s: no samples\n", name, what);
+        return;
+    }
+    LOGF("%s %-19s: n %lu avg %lu min %lu p50 %lu p90 %lu p99 %lu "
+         "p99.9 %lu max %lu ns\n",
+         name, what, h->count, h->sum / h->count, h->min,
+         trace_hist_percentile(h, 0.5), trace_hist_percentile(h, 0.9),
+         trace_hist_percentile(h, 0.99), trace_hist_percentile(h, 0.999),
+         h->max);
+}
+
+void trace_dump(const struct trace *t, const char *name) {
+    for (int s = 0; s < TRACE_STAGES; s++) {
+        trace_hist_dump(&t->stage[s], name, stage_names[s]);
+    }
+}
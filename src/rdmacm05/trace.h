@@ -0,0 +1,56 @@
+#ifndef RDMA_TRACE_H
+#define RDMA_TRACE_H
+
+#include <stdint.h>
+
+// per-message stage latencies, in now_ns() time:
+//   post -> completion     a send or read until the device completes it
+//   completion -> handler  a receive until the worker gets to it
+//   handler -> reply       a received message until its echo is posted
+// completions carry the device's timestamp when the cq can provide one,
+// otherwise they are stamped when polled, and the first stage then also
+// holds the wait for the poll, see excq.h.
+
+enum trace_stage {
+    TRACE_POST_COMPLETE,
+    TRACE_COMPLETE_HANDLER,
+    TRACE_HANDLER_REPLY,
+    TRACE_STAGES,
+};
+
+// log-linear histogram: one bucket per value below TRACE_SUB_COUNT, then
+// TRACE_SUB_COUNT buckets per power of two, within 1/16 of the value
+#define TRACE_SUB_BITS 4
+#define TRACE_SUB_COUNT (1 << TRACE_SUB_BITS)
+#define TRACE_BUCKETS ((64 - TRACE_SUB_BITS + 1) * TRACE_SUB_COUNT)
+
+struct trace_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[TRACE_BUCKETS];
+};
+
+// one per worker, only its thread records
+struct trace {
+    struct trace_hist stage[TRACE_STAGES];
+    unsigned int dumps;  // dump requests already served
+};
+
+// a single histogram, for spans other than the message stages
+void trace_hist_record(struct trace_hist *h, uint64_t ns);
+uint64_t trace_hist_percentile(const struct trace_hist *h, double p);
+void trace_hist_dump(const struct trace_hist *h, const char *name,
+                     const char *what);
+
+void trace_record(struct trace *t, enum trace_stage s, uint64_t ns);
+// records to - from, a stamp of the device may come out slightly ahead of
+// the host clock and counts as 0
+static inline void trace_span(struct trace *t, enum trace_stage s,
+                              uint64_t from, uint64_t to) {
+    trace_record(t, s, to > from ? to - from : 0);
+}
+void trace_dump(const struct trace *t, const char *name);
+
+#endif
@@ -0,0 +1,281 @@
+#include "ud.h"
+
+static char *recv_slot_base(struct ud_ep *ep, int slot) {
+    return ep->recv_buff + (size_t)slot * ep->recv_size;
+}
+
+static char *send_slot_buf(struct ud_ep *ep, int slot) {
+    return ep->send_buff + (size_t)slot * ep->mtu;
+}
+
+// a ud qp goes to rts on its own, there is no peer to transition against
+static void ud_qp_ready(struct ud_ep *ep) {
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = ep->port_num;
+    attr.qkey = UD_QKEY;
+    IF_NZERO_DIE(ibv_modify_qp(ep->qp, &attr,
+                               IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+                                   IBV_QP_PORT | IBV_QP_QKEY));
+    attr.qp_state = IBV_QPS_RTR;
+    IF_NZERO_DIE(ibv_modify_qp(ep->qp, &attr, IBV_QP_STATE));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = 0;
+    IF_NZERO_DIE(ibv_modify_qp(ep->qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN));
+}
+
+static void ah_cache_init(struct ah_cache *c, uint32_t size) {
+    IF_NULL_DIE(c->entries = calloc(size, sizeof(*c->entries)));
+    c->mask = size - 1;
+    c->count = 0;
+    c->hits = 0;
+    c->misses = 0;
+}
+
+static uint32_t peer_hash(const union ibv_gid *gid, uint16_t lid) {
+    uint64_t h = gid->global.subnet_prefix ^ gid->global.interface_id ^ lid;
+    return (uint32_t)((h * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static struct ud_peer *ah_cache_slot(struct ah_cache *c,
+                                     const union ibv_gid *gid, uint16_t lid) {
+    uint32_t i = peer_hash(gid, lid) & c->mask;
+    for (;; i = (i + 1) & c->mask) {
+        struct ud_peer *p = &c->entries[i];
+        if (p->ah == NULL ||
+            (p->lid == lid && !memcmp(&p->gid, gid, sizeof(*gid))))
+            return p;
+    }
+}
+
+static void ah_cache_grow(struct ah_cache *c) {
+    struct ud_peer *old = c->entries;
+    uint32_t size = c->mask + 1;
+    uint64_t hits = c->hits, misses = c->misses;
+    ah_cache_init(c, size * 2);
+    c->hits = hits;
+    c->misses = misses;
+    for (uint32_t i = 0; i < size; i++) {
+        if (old[i].ah == NULL) continue;
+        *ah_cache_slot(c, &old[i].gid, old[i].lid) = old[i];
+        c->count++;
+    }
+    free(old);
+}
+
+struct ud_ep *ud_ep_create(struct ibv_context *ctx, uint8_t port_num,
+                           const struct conn_config *cfg) {
+    struct ud_ep *ep = NULL;
+    IF_NULL_DIE(ep = calloc(1, sizeof(*ep)));
+    ep->ctx = ctx;
+    ep->port_num = port_num;
+    ep->pd = get_device(ctx)->pd;
+
+    struct ibv_port_attr port;
+    IF_NZERO_DIE(ibv_query_port(ctx, port_num, &port));
+    ep->mtu = 128u << port.active_mtu;  // IBV_MTU_256 is 1
+
+    ep->send_slots = cfg->queue_depth > 0 ? cfg->queue_depth : UD_SEND_SLOTS;
+    ep->recv_slots = cfg->recv_slots > 0 ? cfg->recv_slots : UD_RECV_SLOTS;
+    ep->recv_batch = cfg->recv_batch > 0 ? cfg->recv_batch
+                                         : ep->recv_slots / 4;
+    if (ep->recv_batch <= 0) ep->recv_batch = 1;
+    if (ep->recv_batch > ep->recv_slots) ep->recv_batch = ep->recv_slots;
+    ep->send_signal = cfg->signal_every > 0 ? cfg->signal_every : 1;
+    if (ep->send_signal > ep->send_slots) ep->send_signal = ep->send_slots;
+    int max_inline = cfg->max_inline == 0 ? MAX_INLINE : cfg->max_inline;
+    if (max_inline < 0) max_inline = 0;
+    if ((uint32_t)max_inline > ep->mtu) max_inline = ep->mtu;
+
+    IF_NULL_DIE(ep->cc = ibv_create_comp_channel(ctx));
+    IF_NULL_DIE(ep->cq = ibv_create_cq(ctx, ep->send_slots + ep->recv_slots,
+                                       ep, ep->cc, 0));
+    IF_NZERO_DIE(ibv_req_notify_cq(ep->cq, 0));
+
+    struct ibv_qp_init_attr qp_attr;
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.send_cq = ep->cq;
+    qp_attr.recv_cq = ep->cq;
+    qp_attr.qp_type = IBV_QPT_UD;
+    qp_attr.cap.max_send_wr = ep->send_slots;
+    qp_attr.cap.max_recv_wr = ep->recv_slots;
+    qp_attr.cap.max_send_sge = 1;
+    qp_attr.cap.max_recv_sge = 1;
+    qp_attr.cap.max_inline_data = max_inline;
+    qp_attr.sq_sig_all = 0;
+    // back off until the provider accepts the inline size, as conn_bind()
+    while ((ep->qp = ibv_create_qp(ep->pd, &qp_attr)) == NULL) {
+        if (qp_attr.cap.max_inline_data == 0) die("ibv_create_qp");
+        qp_attr.cap.max_inline_data /= 2;
+    }
+    ep->max_inline = qp_attr.cap.max_inline_data;
+    ud_qp_ready(ep);
+
+    size_t send_len = (size_t)ep->send_slots * ep->mtu;
+    IF_NULL_DIE(ep->send_buff = calloc(1, send_len));
+    IF_NULL_DIE(ep->send_mr = ibv_reg_mr(ep->pd, ep->send_buff, send_len,
+                                         IBV_ACCESS_LOCAL_WRITE));
+    IF_NULL_DIE(ep->send_sge = calloc(ep->send_slots, sizeof(*ep->send_sge)));
+    IF_NULL_DIE(ep->send_wr = calloc(ep->send_slots, sizeof(*ep->send_wr)));
+    for (int i = 0; i < ep->send_slots; i++) {
+        ep->send_sge[i].addr = (uintptr_t)send_slot_buf(ep, i);
+        ep->send_sge[i].lkey = ep->send_mr->lkey;
+        ep->send_wr[i].opcode = IBV_WR_SEND;
+        ep->send_wr[i].sg_list = &ep->send_sge[i];
+        ep->send_wr[i].num_sge = 1;
+    }
+
+    ep->recv_size = UD_GRH_SIZE + ep->mtu;
+    size_t recv_len = (size_t)ep->recv_slots * ep->recv_size;
+    IF_NULL_DIE(ep->recv_buff = calloc(1, recv_len));
+    IF_NULL_DIE(ep->recv_mr = ibv_reg_mr(ep->pd, ep->recv_buff, recv_len,
+                                         IBV_ACCESS_LOCAL_WRITE));
+    IF_NULL_DIE(ep->recv_sge = calloc(ep->recv_slots, sizeof(*ep->recv_sge)));
+    IF_NULL_DIE(ep->recv_wr = calloc(ep->recv_slots, sizeof(*ep->recv_wr)));
+    IF_NULL_DIE(ep->recv_pending =
+                    calloc(ep->recv_slots, sizeof(*ep->recv_pending)));
+    for (int i = 0; i < ep->recv_slots; i++) {
+        ep->recv_sge[i].addr = (uintptr_t)recv_slot_base(ep, i);
+        ep->recv_sge[i].length = ep->recv_size;
+        ep->recv_sge[i].lkey = ep->recv_mr->lkey;
+        ep->recv_wr[i].sg_list = &ep->recv_sge[i];
+        ep->recv_wr[i].num_sge = 1;
+        ep->recv_wr[i].wr_id = i;
+        ep->recv_pending[i] = i;
+    }
+    ep->recv_npending = ep->recv_slots;
+    IF_NZERO_DIE(ud_flush_recv(ep));
+
+    ah_cache_init(&ep->ahc, UD_AH_CACHE);
+    LOGF("ud qp %u: mtu %u, %d send and %d receive slots, inline %u\n",
+         ep->qp->qp_num, ep->mtu, ep->send_slots, ep->recv_slots,
+         ep->max_inline);
+    return ep;
+}
+
+void ud_ep_destroy(struct ud_ep *ep) {
+    ibv_destroy_qp(ep->qp);
+    for (uint32_t i = 0; i <= ep->ahc.mask; i++) {
+        if (ep->ahc.entries[i].ah) ibv_destroy_ah(ep->ahc.entries[i].ah);
+    }
+    free(ep->ahc.entries);
+    ibv_destroy_cq(ep->cq);
+    ibv_destroy_comp_channel(ep->cc);
+    ibv_dereg_mr(ep->send_mr);
+    ibv_dereg_mr(ep->recv_mr);
+    free(ep->send_buff);
+    free(ep->recv_buff);
+    free(ep->send_sge);
+    free(ep->send_wr);
+    free(ep->recv_sge);
+    free(ep->recv_wr);
+    free(ep->recv_pending);
+    free(ep);
+}
+
+// the datagram in a receive slot, past the grh
+char *ud_recv_buf(struct ud_ep *ep, int slot) {
+    return recv_slot_base(ep, slot) + UD_GRH_SIZE;
+}
+
+// slot and datagram length of a receive completion, the grh always takes
+// the first UD_GRH_SIZE bytes whether it is there or not
+int ud_recv_slot(struct ud_ep *ep, const struct ibv_wc *wc, uint32_t *len) {
+    *len = wc->byte_len > UD_GRH_SIZE ? wc->byte_len - UD_GRH_SIZE : 0;
+    return (int)wc->wr_id;
+}
+
+// hand a consumed receive slot back to the ring
+int ud_release_recv(struct ud_ep *ep, int slot) {
+    ep->recv_pending[ep->recv_npending++] = slot;
+    if (ep->recv_npending < ep->recv_batch) return 0;
+    return ud_flush_recv(ep);
+}
+
+// post every pending receive slot with a single ibv_post_recv
+int ud_flush_recv(struct ud_ep *ep) {
+    int n = ep->recv_npending;
+    if (n == 0) return 0;
+
+    for (int i = 0; i < n; i++) {
+        struct ibv_recv_wr *wr = &ep->recv_wr[ep->recv_pending[i]];
+        wr->next = (i + 1 < n) ? &ep->recv_wr[ep->recv_pending[i + 1]] : NULL;
+    }
+    ep->recv_npending = 0;
+
+    struct ibv_recv_wr *bad_wr = NULL;
+    return ibv_post_recv(ep->qp, &ep->recv_wr[ep->recv_pending[0]], &bad_wr);
+}
+
+// next free send buffer of one mtu, NULL when every send slot is in flight
+char *ud_send_buf(struct ud_ep *ep) {
+    if (ep->send_head - ep->send_tail >= (unsigned int)ep->send_slots)
+        return NULL;
+    return send_slot_buf(ep, ep->send_head % ep->send_slots);
+}
+
+// send the buffer returned by ud_send_buf() to qp_num behind ah
+int ud_post_send(struct ud_ep *ep, struct ibv_ah *ah, uint32_t qp_num,
+                 uint32_t qkey, uint32_t len) {
+    if (len > ep->mtu) return -1;
+    int slot = ep->send_head % ep->send_slots;
+    struct ibv_send_wr *wr = &ep->send_wr[slot];
+    ep->send_sge[slot].length = len;
+
+    // signal every send_signal-th send and the one that fills the ring, see
+    // conn_post_send()
+    unsigned int used = ep->send_head + 1 - ep->send_tail;
+    int signaled = used == (unsigned int)ep->send_slots ||
+                   ep->send_unsignaled + 1 >= ep->send_signal;
+    wr->send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+    if (len <= ep->max_inline) wr->send_flags |= IBV_SEND_INLINE;
+    wr->wr_id = ep->send_head;
+    wr->wr.ud.ah = ah;
+    wr->wr.ud.remote_qpn = qp_num;
+    wr->wr.ud.remote_qkey = qkey;
+    wr->next = NULL;
+
+    struct ibv_send_wr *bad_wr = NULL;
+    int ret = ibv_post_send(ep->qp, wr, &bad_wr);
+    if (ret == 0) {
+        ep->send_head++;
+        ep->send_unsignaled = signaled ? 0 : ep->send_unsignaled + 1;
+    }
+    return ret;
+}
+
+// called for every IBV_WC_SEND completion with its wr_id, reclaims the
+// signaled send and every unsignaled one posted before it
+int ud_send_done(struct ud_ep *ep, uint64_t wr_id) {
+    unsigned int end = (unsigned int)wr_id + 1;
+    if (end - ep->send_tail > (unsigned int)ep->send_slots) return -1;
+    ep->send_tail = end;
+    return 0;
+}
+
+// the address handle of whoever sent a receive, created on its first
+// datagram and kept for as long as the ep lives
+struct ibv_ah *ud_peer_ah(struct ud_ep *ep, const struct ibv_wc *wc) {
+    struct ibv_grh *grh = (struct ibv_grh *)recv_slot_base(ep, wc->wr_id);
+    union ibv_gid gid;
+    memset(&gid, 0, sizeof(gid));
+    if (wc->wc_flags & IBV_WC_GRH) gid = grh->sgid;
+
+    struct ah_cache *c = &ep->ahc;
+    struct ud_peer *p = ah_cache_slot(c, &gid, wc->slid);
+    if (p->ah) {
+        c->hits++;
+        return p->ah;
+    }
+    c->misses++;
+    struct ibv_ah *ah = ibv_create_ah_from_wc(ep->pd, (struct ibv_wc *)wc,
+                                              grh, ep->port_num);
+    if (ah == NULL) return NULL;
+    p->gid = gid;
+    p->lid = wc->slid;
+    p->ah = ah;
+    if (++c->count * 2 > c->mask + 1) ah_cache_grow(c);
+    return ah;
+}
@@ -0,0 +1,98 @@
+#ifndef RDMA_UD_H
+#define RDMA_UD_H
+
+#include "common.h"
+
+// unreliable datagram transport: one ud qp serves every peer instead of a
+// qp, cq and rings per connection. clients find the qp through rdma_cm's
+// RDMA_PS_UDP handshake and from then on only send datagrams to it, the
+// server learns a client's address from its first datagram and caches an
+// address handle for it. a datagram is at most one mtu and may be dropped
+// on the way: the client numbers its requests and sends one again when its
+// echo does not come back in time, the server echoes whatever arrives.
+
+#define UD_GRH_SIZE 40         // every receive starts with room for a grh
+#define UD_QKEY RDMA_UDP_QKEY  // what rdma_cm uses for RDMA_PS_UDP
+#define UD_SEND_SLOTS 128
+#define UD_RECV_SLOTS 512
+#define UD_AH_CACHE 64  // initial address handle cache size
+
+// a datagram is a msg_hdr of type MSG_DATAGRAM, the sequence number of the
+// request, then the payload. an echo carries the request's number back.
+struct ud_hdr {
+    struct msg_hdr msg;
+    uint32_t seq;  // network byte order
+} __attribute__((packed));
+
+#define UD_HDR_SIZE sizeof(struct ud_hdr)
+
+// address handles by peer address, open addressing, grows at half full
+struct ud_peer {
+    union ibv_gid gid;  // zero when the peer's datagrams carry no grh
+    uint16_t lid;
+    struct ibv_ah *ah;  // NULL marks an empty entry
+};
+
+struct ah_cache {
+    struct ud_peer *entries;
+    uint32_t mask;
+    uint32_t count;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct ud_ep {
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;  // the device's, see get_device()
+    uint8_t port_num;
+    uint32_t mtu;  // largest datagram, header included
+    struct ibv_comp_channel *cc;
+    struct ibv_cq *cq;  // cq_context points back to the ep
+    struct ibv_qp *qp;
+    void *context;  // owned by the application
+
+    // receive ring, as in struct connection but every slot has room for
+    // the grh in front of the datagram
+    int recv_slots;
+    int recv_batch;
+    uint32_t recv_size;  // UD_GRH_SIZE + mtu
+    char *recv_buff;
+    struct ibv_mr *recv_mr;
+    struct ibv_sge *recv_sge;
+    struct ibv_recv_wr *recv_wr;
+    int *recv_pending;
+    int recv_npending;
+
+    // send ring, as in struct connection. every slot holds one mtu.
+    int send_slots;
+    int send_signal;
+    int send_unsignaled;
+    uint32_t max_inline;
+    unsigned int send_head;
+    unsigned int send_tail;
+    char *send_buff;
+    struct ibv_mr *send_mr;
+    struct ibv_sge *send_sge;
+    struct ibv_send_wr *send_wr;
+
+    struct ah_cache ahc;
+    uint64_t drops;  // datagrams the application could not answer
+};
+
+// queue_depth, recv_slots, recv_batch, signal_every and max_inline of cfg
+// size the rings, zero ones fall back to the UD_ defaults
+struct ud_ep *ud_ep_create(struct ibv_context *ctx, uint8_t port_num,
+                           const struct conn_config *cfg);
+void ud_ep_destroy(struct ud_ep *ep);
+
+char *ud_recv_buf(struct ud_ep *ep, int slot);
+int ud_recv_slot(struct ud_ep *ep, const struct ibv_wc *wc, uint32_t *len);
+int ud_release_recv(struct ud_ep *ep, int slot);
+int ud_flush_recv(struct ud_ep *ep);
+char *ud_send_buf(struct ud_ep *ep);
+int ud_post_send(struct ud_ep *ep, struct ibv_ah *ah, uint32_t qp_num,
+                 uint32_t qkey, uint32_t len);
+int ud_send_done(struct ud_ep *ep, uint64_t wr_id);
+struct ibv_ah *ud_peer_ah(struct ud_ep *ep, const struct ibv_wc *wc);
+
+#endif